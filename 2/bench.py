@@ -0,0 +1,176 @@
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+bench_dir = './benchdir'
+
+parser = argparse.ArgumentParser(description='Benchmarks for shell')
+parser.add_argument('-e', type=str, action='append',
+                    help='executable shell file, can be given several times '
+                         'to compare builds (default ./mybash)')
+parser.add_argument('--scenario', type=str, action='append',
+                    help='scenario to run, all by default')
+parser.add_argument('--count', type=int, default=5000,
+                    help='Number of commands per measurement')
+parser.add_argument('--heap_mb', type=str, default='0,16,64,256',
+                    help='Comma separated shell heap sizes for the spawn test')
+parser.add_argument('--file_mb', type=int, default=2048,
+                    help='File size for the throughput test')
+args = parser.parse_args()
+exes = [os.path.abspath(e) for e in (args.e or ['./mybash'])]
+
+
+def run_shell(exe, script, env=None):
+    start = time.perf_counter()
+    p = subprocess.run([exe], input=script, stdout=subprocess.PIPE,
+                       stderr=subprocess.STDOUT, cwd=bench_dir, env=env)
+    elapsed = time.perf_counter() - start
+    if p.returncode != 0:
+        sys.exit('{} failed with code {}: {}'.format(exe, p.returncode,
+                                                   p.stdout[-200:]))
+    return elapsed, p.stdout
+
+
+# Feeding a huge line to grow the parser buffer would measure the parser rather
+# than process creation. Instead the shell is started with a preloaded library
+# which allocates and touches the given amount of heap before main().
+ballast_src = r'''
+#include <stdlib.h>
+#include <string.h>
+static char *ballast;
+__attribute__((constructor)) static void ballast_init(void) {
+    const char *mb = getenv("BALLAST_MB");
+    if (mb != NULL) {
+        size_t size = (size_t)atoi(mb) << 20;
+        ballast = malloc(size);
+        memset(ballast, 1, size);
+    }
+    unsetenv("BALLAST_MB");
+    unsetenv("LD_PRELOAD");
+}
+'''
+
+
+def build_ballast():
+    src = os.path.join(bench_dir, 'ballast.c')
+    lib = os.path.abspath(os.path.join(bench_dir, 'ballast.so'))
+    with open(src, 'w') as f:
+        f.write(ballast_src)
+    subprocess.run(['gcc', '-shared', '-fPIC', src, '-o', lib], check=True)
+    return lib
+
+
+##########################################################################################
+def bench_spawn():
+    print('⏳ Spawn: {} x `true` at different shell heap sizes'.format(args.count))
+    body = b'true\n' * args.count
+    lib = build_ballast()
+    for exe in exes:
+        for mb in [int(x) for x in args.heap_mb.split(',')]:
+            env = dict(os.environ, LD_PRELOAD=lib, BALLAST_MB=str(mb))
+            base, _ = run_shell(exe, b'', env)
+            elapsed, _ = run_shell(exe, body, env)
+            elapsed = max(elapsed - base, 1e-9)
+            print('{}\theap {:4d} MB\t{:10.0f} cmd/sec'.format(
+                os.path.basename(exe), mb, args.count / elapsed))
+
+
+##########################################################################################
+def bench_echo():
+    count = 100 * 1000
+    print('⏳ Echo: {} lines of `echo ... >> file`'.format(count))
+    # Full path to the utility bypasses the builtin.
+    for echo in ['echo', '/bin/echo']:
+        body = ''.join('{} line {} >> out.txt\n'.format(echo, i)
+                       for i in range(count)).encode()
+        for exe in exes:
+            elapsed, _ = run_shell(exe, body)
+            with open(os.path.join(bench_dir, 'out.txt')) as f:
+                if sum(1 for _ in f) != count:
+                    sys.exit('Wrong line count in the output')
+            os.remove(os.path.join(bench_dir, 'out.txt'))
+            print('{}\t{:9s}\t{:10.0f} lines/sec'.format(
+                os.path.basename(exe), echo, count / elapsed))
+
+
+##########################################################################################
+def bench_splice():
+    size = args.file_mb * 1024 * 1024
+    print('⏳ Splice: copy a {} MB file through cat and tee'.format(args.file_mb))
+    chunk = os.urandom(1024 * 1024)
+    with open(os.path.join(bench_dir, 'big'), 'wb') as f:
+        for _ in range(args.file_mb):
+            f.write(chunk)
+    cases = [
+        '{cat} big > copy',
+        '{cat} big | {cat} > copy',
+        '{cat} big | {tee} copy | {cat} > copy2',
+    ]
+    # Full paths to the utilities bypass the builtins.
+    utils = [{'cat': 'cat', 'tee': 'tee'},
+             {'cat': '/bin/cat', 'tee': '/usr/bin/tee'}]
+    for exe in exes:
+        for case in cases:
+            for u in utils:
+                cmd = case.format(**u)
+                os.sync()
+                elapsed, _ = run_shell(exe, cmd.encode() + b'\n')
+                if os.path.getsize(os.path.join(bench_dir, 'copy')) != size:
+                    sys.exit('Wrong copy size')
+                print('{}\t{:40s}\t{:6.2f} GB/sec'.format(
+                    os.path.basename(exe), cmd, size / elapsed / 2**30))
+    for name in ['big', 'copy', 'copy2']:
+        os.remove(os.path.join(bench_dir, name))
+
+
+##########################################################################################
+def bench_parallel():
+    count = 10 * 1000
+    print('⏳ Parallel: {} x `true`'.format(count))
+    with open(os.path.join(bench_dir, 'cmds.txt'), 'w') as f:
+        f.write('true\n' * count)
+    for exe in exes:
+        for jobs in [1, 4, 16]:
+            elapsed, _ = run_shell(exe, 'parallel -j {} cmds.txt\n'.format(jobs).encode())
+            print('{}\tparallel -j {:2d}\t{:10.0f} cmd/sec'.format(
+                os.path.basename(exe), jobs, count / elapsed))
+    os.remove(os.path.join(bench_dir, 'cmds.txt'))
+
+
+##########################################################################################
+def bench_hash():
+    print('⏳ Hash: {} x `sleep 0` with a long PATH'.format(args.count))
+    # Directories which exist but don't have the command, like on hosts with
+    # many toolchains in PATH.
+    dirs = []
+    for i in range(64):
+        d = os.path.abspath(os.path.join(bench_dir, 'path{}'.format(i)))
+        os.makedirs(d, exist_ok=True)
+        dirs.append(d)
+    env = dict(os.environ, PATH=':'.join(dirs + [os.environ['PATH']]))
+    cases = [('cached', b'sleep 0\n'), ('hash -r', b'hash -r\nsleep 0\n')]
+    for exe in exes:
+        for name, line in cases:
+            elapsed, _ = run_shell(exe, line * args.count, env)
+            print('{}\t{:8s}\t{:10.0f} cmd/sec'.format(
+                os.path.basename(exe), name, args.count / elapsed))
+
+
+scenarios = {
+    'spawn': bench_spawn,
+    'echo': bench_echo,
+    'splice': bench_splice,
+    'parallel': bench_parallel,
+    'hash': bench_hash,
+}
+
+shutil.rmtree(bench_dir, ignore_errors=True)
+os.mkdir(bench_dir)
+for name in args.scenario or scenarios.keys():
+    if name not in scenarios:
+        sys.exit('Unknown scenario {}'.format(name))
+    scenarios[name]()
+shutil.rmtree(bench_dir, ignore_errors=True)
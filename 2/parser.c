@@ -5,8 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 struct parser {
 	char *buffer;
+	/** Offset of the first not consumed byte. */
+	uint32_t begin;
+	/** Offset of the buffer end. */
 	uint32_t size;
 	uint32_t capacity;
 };
@@ -33,10 +40,11 @@ struct token {
 static char *
 token_strdup(const struct token *t)
 {
+	/* Can be empty when it was an empty quoted string. */
 	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
 	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
+	if (t->size > 0)
+		memcpy(res, t->data, t->size);
 	res[t->size] = 0;
 	return res;
 }
@@ -53,6 +61,19 @@ token_append(struct token *t, char c)
 	t->data[t->size++] = c;
 }
 
+static void
+token_append_n(struct token *t, const char *data, uint32_t size)
+{
+	if (t->size + size > t->capacity) {
+		t->capacity = (t->capacity + 1) * 2;
+		if (t->capacity < t->size + size)
+			t->capacity = t->size + size;
+		t->data = realloc(t->data, sizeof(*t->data) * t->capacity);
+	}
+	memcpy(t->data + t->size, data, size);
+	t->size += size;
+}
+
 static void
 token_reset(struct token *t)
 {
@@ -111,6 +132,13 @@ void
 parser_feed(struct parser *p, const char *str, uint32_t len)
 {
 	uint32_t cap = p->capacity - p->size;
+	if (cap < len && p->begin > 0) {
+		/* Consumed bytes are dropped lazily, not on each line. */
+		p->size -= p->begin;
+		memmove(p->buffer, p->buffer + p->begin, p->size);
+		p->begin = 0;
+		cap = p->capacity - p->size;
+	}
 	if (cap < len) {
 		uint32_t new_capacity = (p->capacity + 1) * 2;
 		if (new_capacity - p->size < len)
@@ -126,13 +154,87 @@ parser_feed(struct parser *p, const char *str, uint32_t len)
 static void
 parser_consume(struct parser *p, uint32_t size)
 {
-	assert(p->size >= size);
-	if (size == p->size) {
+	assert(p->size - p->begin >= size);
+	p->begin += size;
+	if (p->begin == p->size) {
+		p->begin = 0;
 		p->size = 0;
-		return;
 	}
-	memmove(p->buffer, p->buffer + size, p->size - size);
-	p->size -= size;
+}
+
+/** Bytes which end a run of plain characters outside of quotes. */
+static const bool char_is_special[256] = {
+	['\t'] = true, ['\n'] = true, ['\r'] = true, [' '] = true,
+	['"'] = true, ['#'] = true, ['&'] = true, ['\''] = true,
+	['>'] = true, ['\\'] = true, ['|'] = true,
+};
+
+/**
+ * Find the first byte special outside of quotes. All of them except '>',
+ * '\\' and '|' are <= '\'', so a vector compare finds candidates cheaply,
+ * and the rare false positives like '!' or '$' are filtered via the table.
+ */
+static const char *
+scan_unquoted(const char *pos, const char *end)
+{
+#if defined(__SSE2__)
+	const __m128i low = _mm_set1_epi8('\'');
+	const __m128i gt = _mm_set1_epi8('>');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i bar = _mm_set1_epi8('|');
+	for (; end - pos >= 16; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m = _mm_cmpeq_epi8(_mm_min_epu8(v, low), v);
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, gt));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, backslash));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bar));
+		for (int mask = _mm_movemask_epi8(m); mask != 0;
+		     mask &= mask - 1) {
+			const char *c = pos + __builtin_ctz(mask);
+			if (char_is_special[(unsigned char)*c])
+				return c;
+		}
+	}
+#endif
+	while (pos < end && !char_is_special[(unsigned char)*pos])
+		++pos;
+	return pos;
+}
+
+/** Find the first '"' or '\\' - the only special bytes in double quotes. */
+static const char *
+scan_double_quoted(const char *pos, const char *end)
+{
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	for (; end - pos >= 16; pos += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)pos);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+					 _mm_cmpeq_epi8(v, backslash));
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return pos + __builtin_ctz(mask);
+	}
+#endif
+	while (pos < end && *pos != '"' && *pos != '\\')
+		++pos;
+	return pos;
+}
+
+/**
+ * Skip a run of bytes which are appended to the token as is in the given
+ * quote mode. The run is then copied with one memcpy.
+ */
+static const char *
+scan_plain(const char *pos, const char *end, char quote)
+{
+	if (quote == 0)
+		return scan_unquoted(pos, end);
+	if (quote == '"')
+		return scan_double_quoted(pos, end);
+	const char *res = memchr(pos, '\'', end - pos);
+	return res != NULL ? res : end;
 }
 
 static uint32_t
@@ -140,6 +242,7 @@ parse_token(const char *pos, const char *end, struct token *out)
 {
 	token_reset(out);
 	const char *begin = pos;
+skip_spaces:
 	while (pos < end) {
 		if (!isspace(*pos))
 			break;
@@ -151,6 +254,13 @@ parse_token(const char *pos, const char *end, struct token *out)
 	}
 	char quote = 0;
 	while (pos < end) {
+		const char *run_end = scan_plain(pos, end, quote);
+		if (run_end != pos) {
+			token_append_n(out, pos, run_end - pos);
+			pos = run_end;
+			if (pos == end)
+				break;
+		}
 		char c = *pos;
 		switch(c) {
 		case '\'':
@@ -196,6 +306,12 @@ parse_token(const char *pos, const char *end, struct token *out)
 			c = *pos;
 			if (c == '\n') {
 				++pos;
+				/*
+				 * A line continuation before any token byte
+				 * is the same as a space.
+				 */
+				if (out->size == 0)
+					goto skip_spaces;
 				continue;
 			}
 			goto append_and_next;
@@ -288,9 +404,9 @@ enum parser_error
 parser_pop_next(struct parser *p, struct command_line **out)
 {
 	struct command_line *line = calloc(1, sizeof(*line));
-	char *pos = p->buffer;
+	char *pos = p->buffer + p->begin;
 	const char *begin = pos;
-	char *end = pos + p->size;
+	char *end = p->buffer + p->size;
 	struct token token = {0};
 	enum parser_error res = PARSER_ERR_NONE;
 
@@ -394,9 +510,10 @@ close_and_return:
 		pos += used;
 	}
 	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
 		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
+		/* Can be empty if the line starts with '>' or '&'. */
+		if (line->tail == NULL ||
+		    line->tail->type != EXPR_TYPE_COMMAND) {
 			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
 			goto return_no_line;
 		}
@@ -0,0 +1,336 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Parser-only benchmark. Each scenario is a generated input which is fed to
+ * the parser in chunks, like the shell does, and all the command lines are
+ * popped. The result is reported in MB/s of the input, lines per second and
+ * the peak RSS of the process which ran the scenario.
+ *
+ * When linked with utils/heap_help (see 'make bench') the benchmark instead
+ * counts the allocations made per parsed line. Heap_help takes a backtrace on
+ * every allocation, so the timings of such a build are meaningless and are
+ * not printed, and the inputs are made smaller.
+ */
+
+enum {
+	INPUT_SIZE = 16 * 1024 * 1024,
+	HEAP_INPUT_SIZE = 1024 * 1024,
+	FEED_CHUNK = 64 * 1024,
+	HUGE_LINE_SIZE = 4 * 1024 * 1024,
+	MANY_ARGS_COUNT = 100 * 1000,
+	HEAP_MANY_ARGS_COUNT = 10 * 1000,
+};
+
+/** Defined only when heap_help is linked in. */
+uint64_t
+heaph_get_alloc_count_total(void) __attribute__((weak));
+
+struct buffer {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+buffer_append(struct buffer *b, const char *str, size_t len)
+{
+	if (b->size + len > b->capacity) {
+		b->capacity = (b->capacity + len) * 2;
+		b->data = realloc(b->data, b->capacity);
+	}
+	memcpy(b->data + b->size, str, len);
+	b->size += len;
+}
+
+static void
+buffer_append_str(struct buffer *b, const char *str)
+{
+	buffer_append(b, str, strlen(str));
+}
+
+/** Repeat the lines until the buffer has at least the given size. */
+static void
+gen_repeat(struct buffer *b, size_t size, const char *const *lines, int count)
+{
+	while (b->size < size) {
+		for (int i = 0; i < count; ++i)
+			buffer_append_str(b, lines[i]);
+	}
+}
+
+static void
+gen_typical(struct buffer *b, size_t size)
+{
+	static const char *const lines[] = {
+		"echo hello world | grep -v pattern > out.txt\n",
+		"ls -la /usr/local/bin && cat \"some file.txt\" | wc -l\n",
+		"sed 's/source/destination/g' input.txt >> result.txt\n",
+		"# A comment describing the next command\n",
+		"make -j8 all || echo 'build failed' &\n",
+	};
+	gen_repeat(b, size, lines, sizeof(lines) / sizeof(lines[0]));
+}
+
+static void
+gen_short_lines(struct buffer *b, size_t size)
+{
+	static const char *const lines[] = {
+		"ls\n", "pwd\n", "cd ..\n", "a | b\n", "true\n", "\n", "x &\n",
+	};
+	gen_repeat(b, size, lines, sizeof(lines) / sizeof(lines[0]));
+}
+
+static void
+gen_long_words(struct buffer *b, size_t size)
+{
+	static const char *const lines[] = {
+		"cp /home/user/projects/sysprog/build/release/artifacts/"
+		"libsomething_with_a_very_long_name.so.1.2.3 /usr/local/lib/"
+		"x86_64-linux-gnu/libsomething_with_a_very_long_name.so.1.2.3\n",
+	};
+	gen_repeat(b, size, lines, 1);
+}
+
+static void
+gen_short_tokens(struct buffer *b, size_t size)
+{
+	static const char *const lines[] = {
+		"a b c d e f g h i j k l m n o p q r s t u v w x y z | a | b\n",
+	};
+	gen_repeat(b, size, lines, 1);
+}
+
+static void
+gen_escapes(struct buffer *b, size_t size)
+{
+	static const char *const lines[] = {
+		"echo a\\ b\\ c\\ d\\ e\\ f\\ g\\ h\\ i\\ j\\ k\\ l\\ m\\ n\n",
+		"echo \"a\\\"b\\\\c\\\"d\\\\e\" 'f\\g' \"\\h\\i\\j\"\\\n| cat\n",
+	};
+	gen_repeat(b, size, lines, 2);
+}
+
+static void
+gen_quoted(struct buffer *b, size_t size)
+{
+	static const char *const lines[] = {
+		"echo \"a long double quoted string with spaces | & > # and "
+		"other special characters inside\" 'and a single quoted one "
+		"with \\ backslashes | & > # inside'\n",
+	};
+	gen_repeat(b, size, lines, 1);
+}
+
+/**
+ * Words glued from many alternating quoted and escaped pieces, so the
+ * parser switches its state every few bytes and never gets a long plain run.
+ */
+static void
+gen_deep_quoting(struct buffer *b, size_t size)
+{
+	static const char *const pieces[] = {
+		"\"a\\\"b\"", "'c\\d'", "e\\ f", "\"g'h\"", "'i\"j'",
+		"\\\"", "\\'", "\"\\\\\"", "\\|", "\"&&\"", "'>'", "k",
+	};
+	const int count = sizeof(pieces) / sizeof(pieces[0]);
+	int next = 0;
+	while (b->size < size) {
+		buffer_append_str(b, "echo");
+		for (int word = 0; word < 6; ++word) {
+			buffer_append_str(b, " ");
+			for (int i = 0; i < 5; ++i, next = (next + 1) % count)
+				buffer_append_str(b, pieces[next]);
+		}
+		buffer_append_str(b, "\n");
+	}
+}
+
+/**
+ * A few lines of several megabytes each. They are much bigger than the feed
+ * chunk, so they are rescanned again and again until the newline arrives.
+ */
+static void
+gen_huge_lines(struct buffer *b, size_t size)
+{
+	char word[1024];
+	memset(word, 'w', sizeof(word) - 1);
+	word[sizeof(word) - 1] = ' ';
+	do {
+		size_t end = b->size + HUGE_LINE_SIZE;
+		buffer_append_str(b, "echo ");
+		while (b->size < end)
+			buffer_append(b, word, sizeof(word));
+		buffer_append_str(b, "\n");
+	} while (b->size < size);
+}
+
+/**
+ * Commands with MANY_ARGS_COUNT arguments each. Heap_help frees in time
+ * linear to the number of live allocations, so with it the commands are
+ * made shorter to finish in a reasonable time.
+ */
+static void
+gen_many_args(struct buffer *b, size_t size)
+{
+	int count = heaph_get_alloc_count_total != NULL ?
+		    HEAP_MANY_ARGS_COUNT : MANY_ARGS_COUNT;
+	char arg[32];
+	do {
+		buffer_append_str(b, "echo");
+		for (int i = 0; i < count; ++i) {
+			int len = snprintf(arg, sizeof(arg), " arg%d", i);
+			buffer_append(b, arg, len);
+		}
+		buffer_append_str(b, "\n");
+	} while (b->size < size);
+}
+
+static double
+clock_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Feed the whole input and pop all the lines. Returns the line count. */
+static uint64_t
+parse_all(const struct buffer *in, size_t chunk)
+{
+	struct parser *p = parser_new();
+	struct command_line *line;
+	uint64_t count = 0;
+	for (size_t pos = 0; pos < in->size; pos += chunk) {
+		size_t len = in->size - pos < chunk ? in->size - pos : chunk;
+		parser_feed(p, in->data + pos, len);
+		while (parser_pop_next(p, &line) == PARSER_ERR_NONE &&
+		       line != NULL) {
+			++count;
+			command_line_delete(line);
+		}
+	}
+	parser_delete(p);
+	return count;
+}
+
+struct scenario {
+	const char *name;
+	void (*gen)(struct buffer *b, size_t size);
+	size_t chunk;
+};
+
+struct result {
+	double mb_per_sec;
+	double lines_per_sec;
+	double allocs_per_line;
+};
+
+static void
+scenario_run(const struct scenario *s, struct result *res)
+{
+	bool count_allocs = heaph_get_alloc_count_total != NULL;
+	struct buffer in = {0};
+	s->gen(&in, count_allocs ? HEAP_INPUT_SIZE : INPUT_SIZE);
+	if (count_allocs) {
+		uint64_t allocs = heaph_get_alloc_count_total();
+		uint64_t lines = parse_all(&in, s->chunk);
+		allocs = heaph_get_alloc_count_total() - allocs;
+		res->allocs_per_line = (double)allocs / lines;
+	} else {
+		uint64_t lines = 0;
+		int iterations = 0;
+		double start = clock_sec(), elapsed;
+		do {
+			lines += parse_all(&in, s->chunk);
+			++iterations;
+			elapsed = clock_sec() - start;
+		} while (elapsed < 0.5);
+		res->mb_per_sec = in.size * iterations / elapsed / (1 << 20);
+		res->lines_per_sec = lines / elapsed;
+	}
+	free(in.data);
+}
+
+/**
+ * Run the scenario in a child process so its peak RSS is not polluted by
+ * the inputs of the previous scenarios.
+ */
+static int
+scenario_run_isolated(const struct scenario *s, struct result *res,
+		      long *max_rss_kb)
+{
+	int fds[2];
+	if (pipe(fds) != 0)
+		return -1;
+	pid_t pid = fork();
+	if (pid < 0)
+		return -1;
+	if (pid == 0) {
+		close(fds[0]);
+		scenario_run(s, res);
+		ssize_t rc = write(fds[1], res, sizeof(*res));
+		_exit(rc == (ssize_t)sizeof(*res) ? 0 : 1);
+	}
+	close(fds[1]);
+	ssize_t rc = read(fds[0], res, sizeof(*res));
+	close(fds[0]);
+	int status;
+	struct rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid || rc != sizeof(*res) ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		return -1;
+	*max_rss_kb = usage.ru_maxrss;
+	return 0;
+}
+
+int
+main(void)
+{
+	static const struct scenario scenarios[] = {
+		{"typical", gen_typical, FEED_CHUNK},
+		{"typical", gen_typical, 16},
+		{"typical", gen_typical, 256},
+		{"typical", gen_typical, 4096},
+		{"short lines", gen_short_lines, FEED_CHUNK},
+		{"long words", gen_long_words, FEED_CHUNK},
+		{"short tokens", gen_short_tokens, FEED_CHUNK},
+		{"escapes", gen_escapes, FEED_CHUNK},
+		{"quoted", gen_quoted, FEED_CHUNK},
+		{"deep quoting", gen_deep_quoting, FEED_CHUNK},
+		{"huge lines", gen_huge_lines, FEED_CHUNK},
+		{"100k args", gen_many_args, FEED_CHUNK},
+	};
+	bool count_allocs = heaph_get_alloc_count_total != NULL;
+	if (count_allocs)
+		printf("%-14s %6s %12s %10s\n", "scenario", "chunk",
+		       "allocs/line", "peak RSS");
+	else
+		printf("%-14s %6s %10s %14s %10s\n", "scenario", "chunk",
+		       "MB/s", "lines/s", "peak RSS");
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i) {
+		const struct scenario *s = &scenarios[i];
+		struct result res = {0};
+		long rss;
+		fflush(stdout);
+		if (scenario_run_isolated(s, &res, &rss) != 0) {
+			printf("%-14s %6zu failed\n", s->name, s->chunk);
+			return 1;
+		}
+		if (count_allocs)
+			printf("%-14s %6zu %12.2f %7.1f MB\n", s->name,
+			       s->chunk, res.allocs_per_line, rss / 1024.0);
+		else
+			printf("%-14s %6zu %10.1f %14.0f %7.1f MB\n", s->name,
+			       s->chunk, res.mb_per_sec, res.lines_per_sec,
+			       rss / 1024.0);
+	}
+	return 0;
+}
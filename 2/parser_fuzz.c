@@ -0,0 +1,164 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Fuzzing harness for the parser. The input is parsed twice: fed at once and
+ * fed in small chunks, with the chunk size taken from the first input byte.
+ * Both runs must not crash and must produce exactly the same command lines
+ * and errors, which catches the fast paths that go wrong on a chunk border.
+ *
+ * libFuzzer:
+ *     make fuzz
+ *     ./parser_fuzz fuzz_corpus
+ *
+ * AFL or a replay of the found crashes, the input is read from the files in
+ * the arguments or from stdin:
+ *     afl-clang-fast -O2 parser_fuzz.c parser.c -o parser_fuzz_afl
+ *     afl-fuzz -i fuzz_corpus -o fuzz_out -- ./parser_fuzz_afl
+ */
+
+struct dump {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+dump_append(struct dump *d, const char *str, size_t len)
+{
+	if (d->size + len + 1 > d->capacity) {
+		d->capacity = (d->capacity + len + 1) * 2;
+		d->data = realloc(d->data, d->capacity);
+	}
+	memcpy(d->data + d->size, str, len);
+	d->size += len;
+}
+
+static void
+dump_str(struct dump *d, const char *str)
+{
+	/* Keep the terminating zero so "a" "b" and "ab" dump differently. */
+	dump_append(d, str, strlen(str) + 1);
+}
+
+static void
+dump_line(struct dump *d, const struct command_line *line)
+{
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		switch (e->type) {
+		case EXPR_TYPE_COMMAND:
+			dump_str(d, "cmd");
+			dump_str(d, e->cmd.exe);
+			for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+				dump_str(d, e->cmd.args[i]);
+			break;
+		case EXPR_TYPE_PIPE:
+			dump_str(d, "|");
+			break;
+		case EXPR_TYPE_AND:
+			dump_str(d, "&&");
+			break;
+		case EXPR_TYPE_OR:
+			dump_str(d, "||");
+			break;
+		}
+	}
+	if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
+		dump_str(d, ">");
+		dump_str(d, line->out_file);
+	} else if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
+		dump_str(d, ">>");
+		dump_str(d, line->out_file);
+	}
+	dump_str(d, line->is_background ? "&\n" : "\n");
+}
+
+/** Parse the input fed in the given chunks and dump all the results. */
+static void
+parse_dump(const uint8_t *data, size_t size, size_t chunk, struct dump *d)
+{
+	struct parser *p = parser_new();
+	struct command_line *line;
+	char err[32];
+	for (size_t pos = 0; pos < size; pos += chunk) {
+		size_t len = size - pos < chunk ? size - pos : chunk;
+		parser_feed(p, (const char *)data + pos, len);
+		while (true) {
+			enum parser_error rc = parser_pop_next(p, &line);
+			if (rc != PARSER_ERR_NONE) {
+				int n = snprintf(err, sizeof(err), "error %d",
+						 (int)rc);
+				dump_append(d, err, n + 1);
+				continue;
+			}
+			if (line == NULL)
+				break;
+			dump_line(d, line);
+			command_line_delete(line);
+		}
+	}
+	parser_delete(p);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	if (size == 0)
+		return 0;
+	size_t chunk = 1 + data[0] % 17;
+	struct dump whole = {0};
+	struct dump chunked = {0};
+	parse_dump(data, size, size, &whole);
+	parse_dump(data, size, chunk, &chunked);
+	if (whole.size != chunked.size || (whole.size != 0 &&
+	    memcmp(whole.data, chunked.data, whole.size) != 0)) {
+		fprintf(stderr, "the result differs when fed by %zu bytes\n",
+			chunk);
+		abort();
+	}
+	free(whole.data);
+	free(chunked.data);
+	return 0;
+}
+
+#ifndef PARSER_FUZZ_LIBFUZZER
+
+static int
+run_file(FILE *f)
+{
+	struct dump in = {0};
+	char buf[4096];
+	size_t rc;
+	while ((rc = fread(buf, 1, sizeof(buf), f)) > 0)
+		dump_append(&in, buf, rc);
+	if (ferror(f)) {
+		free(in.data);
+		return -1;
+	}
+	LLVMFuzzerTestOneInput((const uint8_t *)in.data, in.size);
+	free(in.data);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		return run_file(stdin) == 0 ? 0 : 1;
+	for (int i = 1; i < argc; ++i) {
+		FILE *f = fopen(argv[i], "rb");
+		if (f == NULL || run_file(f) != 0) {
+			fprintf(stderr, "can't read %s\n", argv[i]);
+			if (f != NULL)
+				fclose(f);
+			return 1;
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+#endif
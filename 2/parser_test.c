@@ -364,6 +364,28 @@ test_escape_outside_of_string(void)
 	unit_check(e->next == NULL, "no more exprs");
 	command_line_delete(line);
 
+	unit_msg("Escape new line between tokens, empty string");
+	/*
+	 * echo \
+	 *  "" \
+	 * 	x
+	 */
+	str = "echo \\\n \"\" \\\n\tx";
+	len = strlen(str);
+	for (uint32_t i = 0; i < len; ++i) {
+		parser_feed(p, &str[i], 1);
+		unit_fail_if(parser_pop_next(p, &line) != PARSER_ERR_NONE);
+		unit_fail_if(line != NULL);
+	}
+	parser_feed(p, "\n", 1);
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "") == 0, "arg[0]");
+	unit_check(strcmp(e->cmd.args[1], "x") == 0, "arg[1]");
+	command_line_delete(line);
+
 	parser_delete(p);
 	unit_test_finish();
 }
@@ -808,6 +830,8 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "> test.txt", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
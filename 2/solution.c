@@ -1,5 +1,10 @@
+#define _GNU_SOURCE
 #include "parser.h"
 #include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <signal.h>
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,52 +13,396 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
 
-struct bgproc_list {
-    pid_t *jobs;
-    int count;
-    int capacity;
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+extern char **environ;
+
+/*
+ * Background jobs. Each job is a command line started with '&', possibly
+ * consisting of several processes. The jobs are kept in a list in the order
+ * of their start, and each process is found by its pid via an open addressing
+ * hash table, so a finished process is removed in O(1).
+ *
+ * SIGCHLD is blocked and delivered via a signalfd. The shell only calls
+ * waitpid() when the signalfd says some children have changed their state,
+ * and then collects all of them in one batch.
+ */
+struct job {
+    int id;
+    char *text;
+    int pids_left;
+    pid_t last_pid;
+    int status;
+    /* Is kept after completion to let the 'wait' builtin fetch the status. */
+    bool waited;
+    /* Is not a background job, but is a set of 'parallel' children. */
+    bool foreground;
+    /* Number of the processes which exited with a non-zero status. */
+    int failed;
+    struct job *prev;
+    struct job *next;
 };
 
-static void bgproc_init(struct bgproc_list *bpl) {
-    bpl->jobs = NULL;
-    bpl->count = 0;
-    bpl->capacity = 0;
-}
-
-static void bgproc_add(struct bgproc_list *bpl, pid_t pid) {
-    if (bpl->jobs == NULL) {
-        bpl->capacity = 16;
-        bpl->jobs = malloc(bpl->capacity * sizeof(pid_t));
-    } else if (bpl->count == bpl->capacity) {
-        bpl->capacity *= 2;
-        bpl->jobs = realloc(bpl->jobs, bpl->capacity * sizeof(pid_t));
-    }
-    bpl->jobs[bpl->count++] = pid;
-}
-
-static void bgproc_reap(struct bgproc_list *bpl) {
-    int i = 0;
-    while (i < bpl->count) {
-        int status;
-        pid_t w = waitpid(bpl->jobs[i], &status, WNOHANG);
-        if (w <= 0) {
-            if (w == -1 || (w == bpl->jobs[i] && (WIFEXITED(status) || WIFSIGNALED(status)))) {
-                memmove(&bpl->jobs[i], &bpl->jobs[i+1], (bpl->count-i-1)*sizeof(pid_t));
-                bpl->count--;
-            } else {
-                i++;
-            }
+struct job_pid {
+    pid_t pid;
+    struct job *job;
+};
+
+struct job_list {
+    struct job *first;
+    struct job *last;
+    struct job_pid *pids;
+    uint32_t pid_count;
+    uint32_t pid_capacity;
+    int signal_fd;
+    sigset_t child_sigmask;
+};
+
+static void jobs_init(struct job_list *jl) {
+    memset(jl, 0, sizeof(*jl));
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &jl->child_sigmask);
+    jl->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+static uint32_t job_pid_slot(const struct job_list *jl, pid_t pid) {
+    return ((uint32_t)pid * 2654435761u) & (jl->pid_capacity - 1);
+}
+
+static void job_pid_insert(struct job_list *jl, pid_t pid, struct job *job);
+
+static void job_pid_grow(struct job_list *jl) {
+    struct job_pid *old = jl->pids;
+    uint32_t old_capacity = jl->pid_capacity;
+    jl->pid_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    jl->pids = calloc(jl->pid_capacity, sizeof(*jl->pids));
+    jl->pid_count = 0;
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (old[i].pid != 0) job_pid_insert(jl, old[i].pid, old[i].job);
+    }
+    free(old);
+}
+
+static void job_pid_insert(struct job_list *jl, pid_t pid, struct job *job) {
+    if ((jl->pid_count + 1) * 2 > jl->pid_capacity) job_pid_grow(jl);
+    uint32_t i = job_pid_slot(jl, pid);
+    while (jl->pids[i].pid != 0) i = (i + 1) & (jl->pid_capacity - 1);
+    jl->pids[i].pid = pid;
+    jl->pids[i].job = job;
+    jl->pid_count++;
+}
+
+static struct job *job_pid_find(const struct job_list *jl, pid_t pid) {
+    if (jl->pid_count == 0) return NULL;
+    for (uint32_t i = job_pid_slot(jl, pid); jl->pids[i].pid != 0; i = (i + 1) & (jl->pid_capacity - 1)) {
+        if (jl->pids[i].pid == pid) return jl->pids[i].job;
+    }
+    return NULL;
+}
+
+/* Remove a pid and return its job. Linear probing with backward shift. */
+static struct job *job_pid_remove(struct job_list *jl, pid_t pid) {
+    if (jl->pid_count == 0) return NULL;
+    uint32_t mask = jl->pid_capacity - 1;
+    uint32_t i = job_pid_slot(jl, pid);
+    while (jl->pids[i].pid != pid) {
+        if (jl->pids[i].pid == 0) return NULL;
+        i = (i + 1) & mask;
+    }
+    struct job *job = jl->pids[i].job;
+    jl->pid_count--;
+    for (uint32_t j = (i + 1) & mask; jl->pids[j].pid != 0; j = (j + 1) & mask) {
+        uint32_t home = job_pid_slot(jl, jl->pids[j].pid);
+        /* Move the entry into the hole unless its home is in (i, j]. */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            jl->pids[i] = jl->pids[j];
+            i = j;
+        }
+    }
+    jl->pids[i].pid = 0;
+    return job;
+}
+
+static struct job *job_new(struct job_list *jl, char *text) {
+    struct job *job = calloc(1, sizeof(*job));
+    job->id = jl->last ? jl->last->id + 1 : 1;
+    job->text = text;
+    job->prev = jl->last;
+    if (jl->last) jl->last->next = job; else jl->first = job;
+    jl->last = job;
+    return job;
+}
+
+static void job_delete(struct job_list *jl, struct job *job) {
+    if (job->prev) job->prev->next = job->next; else jl->first = job->next;
+    if (job->next) job->next->prev = job->prev; else jl->last = job->prev;
+    free(job->text);
+    free(job);
+}
+
+static void job_add_pid(struct job_list *jl, struct job *job, pid_t pid) {
+    job_pid_insert(jl, pid, job);
+    job->pids_left++;
+    job->last_pid = pid;
+}
+
+/* Account a finished child. Returns the job if it has completed. */
+static struct job *job_child_done(struct job_list *jl, pid_t pid, int status, bool *done) {
+    struct job *job = job_pid_remove(jl, pid);
+    *done = false;
+    if (job == NULL) return NULL;
+    status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    if (pid == job->last_pid) job->status = status;
+    if (status != 0) job->failed++;
+    *done = --job->pids_left == 0;
+    return job;
+}
+
+/* Drain the signalfd. Returns true if any SIGCHLD has arrived. */
+static bool jobs_drain_signals(struct job_list *jl) {
+    struct signalfd_siginfo si[16];
+    bool got = false;
+    while (read(jl->signal_fd, si, sizeof(si)) > 0) got = true;
+    return got;
+}
+
+/* Collect all the exited children in one batch. */
+static void jobs_collect(struct job_list *jl) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        bool done;
+        struct job *job = job_child_done(jl, pid, status, &done);
+        if (done && !job->waited) job_delete(jl, job);
+    }
+    if (pid < 0 && errno == ECHILD) {
+        /* The jobs are not our children, for example in a forked builtin. */
+        for (struct job *job = jl->first; job != NULL; job = job->next) job->pids_left = 0;
+        for (struct job *job = jl->first, *next; job != NULL; job = next) {
+            next = job->next;
+            if (!job->waited) job_delete(jl, job);
+        }
+        memset(jl->pids, 0, jl->pid_capacity * sizeof(*jl->pids));
+        jl->pid_count = 0;
+    }
+}
+
+/* Called after each command line. Costs one read() when nothing happened. */
+static void jobs_reap(struct job_list *jl) {
+    if (jl->first != NULL && jobs_drain_signals(jl)) jobs_collect(jl);
+}
+
+/* Sleep until some child changes its state. */
+static void jobs_wait_signal(struct job_list *jl) {
+    struct pollfd pfd = {.fd = jl->signal_fd, .events = POLLIN};
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+    jobs_drain_signals(jl);
+}
+
+/* Drop the jobs a forked child has inherited, they are not its children. */
+static void jobs_forget(struct job_list *jl) {
+    while (jl->first) job_delete(jl, jl->first);
+    memset(jl->pids, 0, jl->pid_capacity * sizeof(*jl->pids));
+    jl->pid_count = 0;
+}
+
+/* Are there background jobs nobody else is waiting for. */
+static bool jobs_have_background(const struct job_list *jl) {
+    for (const struct job *job = jl->first; job != NULL; job = job->next) {
+        if (!job->foreground && !job->waited) return true;
+    }
+    return false;
+}
+
+static void jobs_free(struct job_list *jl) {
+    while (jl->first) job_delete(jl, jl->first);
+    free(jl->pids);
+    close(jl->signal_fd);
+}
+
+static char *command_line_text(const struct command_line *line) {
+    size_t size = 1;
+    for (const struct expr *e = line->head; e != NULL; e = e->next) {
+        size += 4;
+        if (e->type != EXPR_TYPE_COMMAND) continue;
+        size += strlen(e->cmd.exe);
+        for (uint32_t i = 0; i < e->cmd.arg_count; ++i) size += strlen(e->cmd.args[i]) + 1;
+    }
+    if (line->out_file) size += strlen(line->out_file) + 4;
+    char *text = malloc(size), *pos = text;
+    for (const struct expr *e = line->head; e != NULL; e = e->next) {
+        if (e != line->head) *pos++ = ' ';
+        if (e->type == EXPR_TYPE_PIPE) {
+            pos = stpcpy(pos, "|");
+        } else if (e->type == EXPR_TYPE_AND) {
+            pos = stpcpy(pos, "&&");
+        } else if (e->type == EXPR_TYPE_OR) {
+            pos = stpcpy(pos, "||");
         } else {
-            i++;
+            pos = stpcpy(pos, e->cmd.exe);
+            for (uint32_t i = 0; i < e->cmd.arg_count; ++i) *pos++ = ' ', pos = stpcpy(pos, e->cmd.args[i]);
         }
     }
+    if (line->out_file) {
+        pos = stpcpy(pos, line->out_type == OUTPUT_TYPE_FILE_NEW ? " > " : " >> ");
+        pos = stpcpy(pos, line->out_file);
+    }
+    *pos = 0;
+    return text;
 }
 
-static void bgproc_free(struct bgproc_list *bpl) {
-    free(bpl->jobs);
+/*
+ * Command hash table like in bash. A command name is resolved into a full
+ * path once by the shell itself with access() over the PATH directories, and
+ * then the children are started via the known path. execvp() would instead
+ * try execve() in each PATH directory in every child. The table is dropped
+ * when PATH changes, and an entry is dropped when its file disappears.
+ */
+struct path_entry {
+    char *name;
+    char *path;
+    uint32_t hits;
+    struct path_entry *next;
+};
+
+struct path_cache {
+    struct path_entry **buckets;
+    uint32_t bucket_count;
+    uint32_t count;
+    /* PATH value the entries were resolved with. */
+    char *path_env;
+};
+
+static uint32_t path_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name != 0; ++name) h = (h ^ (unsigned char)*name) * 16777619u;
+    return h;
 }
 
+static void path_cache_clear(struct path_cache *pc) {
+    for (uint32_t i = 0; i < pc->bucket_count; ++i) {
+        for (struct path_entry *e = pc->buckets[i], *next; e != NULL; e = next) {
+            next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+        pc->buckets[i] = NULL;
+    }
+    pc->count = 0;
+}
+
+static void path_cache_free(struct path_cache *pc) {
+    path_cache_clear(pc);
+    free(pc->buckets);
+    free(pc->path_env);
+}
+
+static struct path_entry **path_cache_slot(struct path_cache *pc, const char *name) {
+    struct path_entry **pos = &pc->buckets[path_hash(name) & (pc->bucket_count - 1)];
+    while (*pos != NULL && strcmp((*pos)->name, name) != 0) pos = &(*pos)->next;
+    return pos;
+}
+
+static void path_cache_grow(struct path_cache *pc) {
+    uint32_t old_count = pc->bucket_count;
+    struct path_entry **old = pc->buckets;
+    pc->bucket_count = old_count == 0 ? 64 : old_count * 2;
+    pc->buckets = calloc(pc->bucket_count, sizeof(*pc->buckets));
+    for (uint32_t i = 0; i < old_count; ++i) {
+        for (struct path_entry *e = old[i], *next; e != NULL; e = next) {
+            next = e->next;
+            struct path_entry **head = &pc->buckets[path_hash(e->name) & (pc->bucket_count - 1)];
+            e->next = *head;
+            *head = e;
+        }
+    }
+    free(old);
+}
+
+static const char *path_env(void) {
+    const char *env = getenv("PATH");
+    /* Same default as execvp() uses. */
+    return env != NULL ? env : "/bin:/usr/bin";
+}
+
+static char *path_search(const char *name) {
+    size_t name_len = strlen(name);
+    for (const char *dir = path_env(), *end;; dir = end + 1) {
+        end = strchrnul(dir, ':');
+        size_t dir_len = end - dir;
+        char *full = malloc(dir_len + name_len + 3);
+        if (dir_len == 0) {
+            /* An empty entry means the current directory. */
+            memcpy(full, "./", 2);
+            dir_len = 1;
+        } else {
+            memcpy(full, dir, dir_len);
+            full[dir_len] = '/';
+        }
+        memcpy(full + dir_len + 1, name, name_len + 1);
+        struct stat st;
+        if (access(full, X_OK) == 0 && stat(full, &st) == 0 && S_ISREG(st.st_mode)) return full;
+        free(full);
+        if (*end == 0) return NULL;
+    }
+}
+
+/*
+ * Find the full path of a command. Returns NULL if the name contains a slash
+ * and doesn't need the lookup, or if the command is not found.
+ */
+static const char *path_cache_find(struct path_cache *pc, const char *name, bool count_hit) {
+    if (strchr(name, '/') != NULL) return NULL;
+    const char *env = path_env();
+    if (pc->path_env == NULL || strcmp(pc->path_env, env) != 0) {
+        path_cache_clear(pc);
+        free(pc->path_env);
+        pc->path_env = strdup(env);
+    }
+    if (pc->bucket_count == 0) path_cache_grow(pc);
+    struct path_entry **pos = path_cache_slot(pc, name);
+    if (*pos == NULL) {
+        char *full = path_search(name);
+        if (full == NULL) return NULL;
+        if (pc->count >= pc->bucket_count) {
+            path_cache_grow(pc);
+            pos = path_cache_slot(pc, name);
+        }
+        struct path_entry *e = calloc(1, sizeof(*e));
+        e->name = strdup(name);
+        e->path = full;
+        *pos = e;
+        pc->count++;
+    }
+    if (count_hit) (*pos)->hits++;
+    return (*pos)->path;
+}
+
+static void path_cache_forget(struct path_cache *pc, const char *name) {
+    if (pc->bucket_count == 0) return;
+    struct path_entry **pos = path_cache_slot(pc, name);
+    struct path_entry *e = *pos;
+    if (e == NULL) return;
+    *pos = e->next;
+    free(e->name);
+    free(e->path);
+    free(e);
+    pc->count--;
+}
+
+struct shell {
+    struct job_list jobs;
+    struct path_cache hash;
+};
+
 struct pipeline_pids {
     pid_t *pids;
     int size;
@@ -117,14 +466,14 @@ static bool handle_exit_cmd(struct expr **cur, int *exit_code) {
 }
 
 static void handle_parent(pid_t pid,
-                          bool is_background,
+                          struct job *job,
                           bool do_pipe,
                           struct pipeline_pids *pp,
-                          struct bgproc_list *bpl,
+                          struct job_list *jl,
                           int *last,
                           int *exit_code) {
-    if (is_background) {
-        bgproc_add(bpl, pid);
+    if (job) {
+        job_add_pid(jl, job, pid);
     } else if (!do_pipe) {
         int st;
         waitpid(pid, &st, 0);
@@ -137,7 +486,811 @@ static void handle_parent(pid_t pid,
     }
 }
 
-static void execute_command_line(const struct command_line *line, int *exit_code, struct bgproc_list *bpl) {
+/*
+ * Builtin utilities. They are executed right in the shell process when they
+ * are not a part of a pipeline, and in a forked child otherwise. A builtin
+ * which meets an option or a format it doesn't support returns
+ * BUILTIN_UNSUPPORTED before producing any output, and the external utility
+ * is executed instead.
+ */
+#define BUILTIN_UNSUPPORTED -1
+
+struct outbuf {
+    int fd;
+    size_t size;
+    char data[4096];
+};
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t rc = write(fd, data, size);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += rc;
+        size -= rc;
+    }
+    return 0;
+}
+
+static void out_flush(struct outbuf *out) {
+    write_all(out->fd, out->data, out->size);
+    out->size = 0;
+}
+
+static void out_write(struct outbuf *out, const char *data, size_t size) {
+    if (out->size + size > sizeof(out->data)) {
+        out_flush(out);
+        if (size > sizeof(out->data)) {
+            write_all(out->fd, data, size);
+            return;
+        }
+    }
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+}
+
+static void out_str(struct outbuf *out, const char *str) {
+    out_write(out, str, strlen(str));
+}
+
+static void out_char(struct outbuf *out, char c) {
+    out_write(out, &c, 1);
+}
+
+/* GNU utilities print help for a sole --help or --version argument. */
+static bool is_info_option(const struct command *cmd) {
+    return cmd->arg_count == 1 && (strcmp(cmd->args[0], "--help") == 0 ||
+                                   strcmp(cmd->args[0], "--version") == 0);
+}
+
+/*
+ * The shell itself handles 'exit' on its own. This one is for 'exit' inside
+ * a pipe, which leaves only its forked child, like a subshell.
+ */
+static int builtin_exit(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)out;
+    (void)sh;
+    return cmd->arg_count ? atoi(cmd->args[0]) & 0xff : EXIT_SUCCESS;
+}
+
+static int builtin_true(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)out;
+    (void)sh;
+    return is_info_option(cmd) ? BUILTIN_UNSUPPORTED : EXIT_SUCCESS;
+}
+
+static int builtin_false(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)out;
+    (void)sh;
+    return is_info_option(cmd) ? BUILTIN_UNSUPPORTED : EXIT_FAILURE;
+}
+
+static int builtin_pwd(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)sh;
+    if (cmd->arg_count != 0) return BUILTIN_UNSUPPORTED;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) return BUILTIN_UNSUPPORTED;
+    out_str(out, cwd);
+    out_char(out, '\n');
+    free(cwd);
+    return EXIT_SUCCESS;
+}
+
+static int builtin_echo(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)sh;
+    uint32_t i = 0;
+    bool newline = true;
+    if (is_info_option(cmd)) return BUILTIN_UNSUPPORTED;
+    /* Like coreutils, only arguments made entirely of option letters count. */
+    for (; i < cmd->arg_count; ++i) {
+        const char *arg = cmd->args[i];
+        if (arg[0] != '-' || arg[1] == 0 || arg[strspn(arg + 1, "neE") + 1] != 0) break;
+        if (strpbrk(arg, "eE") != NULL) return BUILTIN_UNSUPPORTED;
+        newline = false;
+    }
+    for (uint32_t first = i; i < cmd->arg_count; ++i) {
+        if (i != first) out_char(out, ' ');
+        out_str(out, cmd->args[i]);
+    }
+    if (newline) out_char(out, '\n');
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Print one escape sequence starting right after the backslash. Returns the
+ * number of consumed bytes, or -1 if the escape is not supported.
+ */
+static int printf_escape(const char *s, struct outbuf *out) {
+    static const char from[] = "\\\"'abfnrtv";
+    static const char to[] = "\\\"'\a\b\f\n\r\t\v";
+    if (*s != 0 && strchr("xuUc", *s) != NULL) return -1;
+    const char *p = *s != 0 ? strchr(from, *s) : NULL;
+    if (p != NULL) {
+        if (out) out_char(out, to[p - from]);
+        return 1;
+    }
+    if (*s >= '0' && *s <= '7') {
+        int len = 0, c = 0;
+        for (; len < 3 && s[len] >= '0' && s[len] <= '7'; ++len) c = c * 8 + s[len] - '0';
+        if (out) out_char(out, (char)c);
+        return len;
+    }
+    if (out) out_char(out, '\\');
+    return 0;
+}
+
+static bool printf_number(const char *arg, intmax_t *res) {
+    if (arg[0] == '\'' || arg[0] == '"') {
+        *res = (unsigned char)arg[1];
+        return true;
+    }
+    char *end;
+    errno = 0;
+    *res = strtoimax(arg, &end, 0);
+    return errno == 0 && end != arg && *end == 0;
+}
+
+/*
+ * One pass over the format. With @a out == NULL nothing is printed, and the
+ * pass only checks that everything is supported. Returns the number of used
+ * arguments, or -1 if the format can't be handled here.
+ */
+static int printf_pass(const char *fmt, char **args, int arg_count, struct outbuf *out) {
+    int used = 0;
+    while (*fmt != 0) {
+        if (*fmt == '\\') {
+            int len = printf_escape(++fmt, out);
+            if (len < 0) return -1;
+            fmt += len;
+            continue;
+        }
+        if (*fmt != '%') {
+            if (out) out_char(out, *fmt);
+            ++fmt;
+            continue;
+        }
+        if (fmt[1] == '%') {
+            if (out) out_char(out, '%');
+            fmt += 2;
+            continue;
+        }
+        /* Flags, width and precision. */
+        size_t len = 1 + strspn(fmt + 1, "-+ #0");
+        size_t digits = strspn(fmt + len, "0123456789");
+        if (digits > 2) return -1;
+        len += digits;
+        if (fmt[len] == '.') {
+            digits = strspn(fmt + len + 1, "0123456789");
+            if (digits > 2) return -1;
+            len += 1 + digits;
+        }
+        char conv = fmt[len];
+        if (conv == 0 || strchr("diouxXcs", conv) == NULL) return -1;
+        const char *arg = used < arg_count ? args[used] : NULL;
+        ++used;
+        char spec[16];
+        /* Room for the 'j' length modifier, the conversion and the zero. */
+        if (len + 3 > sizeof(spec)) return -1;
+        memcpy(spec, fmt, len);
+        fmt += len + 1;
+        char buf[256];
+        if (conv == 's') {
+            if (!out) continue;
+            const char *str = arg ? arg : "";
+            spec[len] = 's';
+            spec[len + 1] = 0;
+            /* Let snprintf() compute the size for an arbitrary long string. */
+            int n = snprintf(NULL, 0, spec, str);
+            char *tmp = malloc(n + 1);
+            snprintf(tmp, n + 1, spec, str);
+            out_write(out, tmp, n);
+            free(tmp);
+            continue;
+        }
+        if (conv == 'c') {
+            if (!out) continue;
+            spec[len] = 'c';
+            spec[len + 1] = 0;
+            out_write(out, buf, snprintf(buf, sizeof(buf), spec, arg ? arg[0] : 0));
+            continue;
+        }
+        intmax_t num = 0;
+        if (arg && !printf_number(arg, &num)) return -1;
+        if (!out) continue;
+        spec[len] = 'j';
+        spec[len + 1] = conv;
+        spec[len + 2] = 0;
+        int n = snprintf(buf, sizeof(buf), spec, num);
+        out_write(out, buf, n);
+    }
+    return used;
+}
+
+static int builtin_printf(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)sh;
+    if (cmd->arg_count == 0 || cmd->args[0][0] == '-') return BUILTIN_UNSUPPORTED;
+    const char *fmt = cmd->args[0];
+    char **args = cmd->args + 1;
+    int arg_count = cmd->arg_count - 1;
+    /* Validate everything first, the output must not be started otherwise. */
+    for (int pos = 0;;) {
+        int used = printf_pass(fmt, args + pos, arg_count - pos, NULL);
+        if (used < 0) return BUILTIN_UNSUPPORTED;
+        pos += used;
+        if (used == 0 || pos >= arg_count) break;
+    }
+    /* The format is reused while there are arguments left. */
+    for (int pos = 0;;) {
+        int used = printf_pass(fmt, args + pos, arg_count - pos, out);
+        pos += used;
+        if (used == 0 || pos >= arg_count) break;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int builtin_jobs(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    if (cmd->arg_count != 0) return BUILTIN_UNSUPPORTED;
+    jobs_reap(&sh->jobs);
+    char buf[32];
+    for (struct job *job = sh->jobs.first; job != NULL; job = job->next) {
+        if (job->foreground) continue;
+        out_write(out, buf, snprintf(buf, sizeof(buf), "[%d]  Running\t", job->id));
+        out_str(out, job->text);
+        out_str(out, " &\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Find a job by '%id' or by a pid of any its process. */
+static struct job *job_find(struct job_list *jl, const char *arg) {
+    if (arg[0] == '%') {
+        int id = atoi(arg + 1);
+        for (struct job *job = jl->first; job != NULL; job = job->next) {
+            if (job->id == id && !job->foreground) return job;
+        }
+        return NULL;
+    }
+    return job_pid_find(jl, atoi(arg));
+}
+
+/*
+ * 'wait' without arguments waits for all the background jobs and returns 0.
+ * Otherwise it waits for the given jobs and returns the status of the last
+ * one, or 127 if it is unknown or was already reaped.
+ */
+static int builtin_wait(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)out;
+    struct job_list *jl = &sh->jobs;
+    if (cmd->arg_count == 0) {
+        for (jobs_collect(jl); jobs_have_background(jl); jobs_collect(jl)) jobs_wait_signal(jl);
+        return EXIT_SUCCESS;
+    }
+    int status = EXIT_SUCCESS;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+        struct job *job = job_find(jl, cmd->args[i]);
+        if (job == NULL) {
+            status = 127;
+            continue;
+        }
+        job->waited = true;
+        for (jobs_collect(jl); job->pids_left > 0; jobs_collect(jl)) jobs_wait_signal(jl);
+        status = job->status;
+        job_delete(jl, job);
+    }
+    return status;
+}
+
+enum { COPY_CHUNK = 1 << 20 };
+
+static int copy_rw(int in, int out) {
+    char buf[64 * 1024];
+    for (;;) {
+        ssize_t rc = read(in, buf, sizeof(buf));
+        if (rc == 0) return 0;
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        write_all(out, buf, rc);
+    }
+}
+
+/*
+ * Move all the data from @a in to @a out without bringing it into the user
+ * space when possible: splice() when any of the ends is a pipe,
+ * copy_file_range() between regular files, sendfile() from a regular file
+ * into anything else. The plain read()/write() loop is the last resort.
+ */
+static int fd_copy(int in, int out) {
+    struct stat in_st, out_st;
+    if (fstat(in, &in_st) != 0 || fstat(out, &out_st) != 0) return -1;
+    ssize_t rc;
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        while ((rc = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+            if (rc < 0 && errno != EINTR) break;
+        }
+    } else if (S_ISREG(in_st.st_mode) && S_ISREG(out_st.st_mode)) {
+        while ((rc = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) != 0) {
+            if (rc < 0 && errno != EINTR) break;
+        }
+    } else if (S_ISREG(in_st.st_mode)) {
+        while ((rc = sendfile(out, in, NULL, COPY_CHUNK)) != 0) {
+            if (rc < 0 && errno != EINTR) break;
+        }
+    } else {
+        return copy_rw(in, out);
+    }
+    if (rc == 0) return 0;
+    /* The kernel can't do that for these files, nothing was copied yet. */
+    if (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF)
+        return copy_rw(in, out);
+    return -1;
+}
+
+static void print_file_error(const char *util, const char *file) {
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%s: %s: %s\n", util, file, strerror(errno));
+    write_all(STDERR_FILENO, buf, MIN(n, (int)sizeof(buf) - 1));
+}
+
+static int builtin_cat(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)sh;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+        const char *arg = cmd->args[i];
+        if (arg[0] == '-' && arg[1] != 0) return BUILTIN_UNSUPPORTED;
+    }
+    out_flush(out);
+    int status = EXIT_SUCCESS;
+    for (uint32_t i = 0; i < cmd->arg_count || i == 0; ++i) {
+        const char *file = cmd->arg_count ? cmd->args[i] : "-";
+        int fd = strcmp(file, "-") == 0 ? STDIN_FILENO : open(file, O_RDONLY);
+        if (fd < 0 || fd_copy(fd, out->fd) != 0) {
+            print_file_error("cat", file);
+            status = EXIT_FAILURE;
+        }
+        if (fd > STDIN_FILENO) close(fd);
+    }
+    return status;
+}
+
+/*
+ * Move exactly @a size bytes from the pipe @a in to @a out. On an error
+ * @a left is how many of them are still in the pipe.
+ */
+static int splice_exact(int in, int out, size_t size, size_t *left) {
+    while (size > 0) {
+        ssize_t rc = splice(in, NULL, out, NULL, size, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc < 0 && errno == EINVAL) {
+            /* For example an O_APPEND file on an older kernel. */
+            char buf[64 * 1024];
+            rc = read(in, buf, MIN(size, sizeof(buf)));
+            if (rc > 0 && write_all(out, buf, rc) != 0) {
+                *left = size - rc;
+                return -1;
+            }
+        }
+        if (rc <= 0) {
+            *left = size;
+            return -1;
+        }
+        size -= rc;
+    }
+    return 0;
+}
+
+/* Drop @a size bytes from the pipe @a in. */
+static int pipe_drop(int in, size_t size) {
+    char buf[64 * 1024];
+    while (size > 0) {
+        ssize_t rc = read(in, buf, MIN(size, sizeof(buf)));
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return -1;
+        size -= rc;
+    }
+    return 0;
+}
+
+static int builtin_tee(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    (void)sh;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    uint32_t first = 0;
+    for (; first < cmd->arg_count && cmd->args[first][0] == '-'; ++first) {
+        if (strcmp(cmd->args[first], "-a") != 0) return BUILTIN_UNSUPPORTED;
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+    uint32_t count = cmd->arg_count - first;
+    int fds[count + 1];
+    int status = EXIT_SUCCESS;
+    for (uint32_t i = 0; i < count; ++i) {
+        fds[i] = open(cmd->args[first + i], flags, 0644);
+        if (fds[i] < 0) {
+            print_file_error("tee", cmd->args[first + i]);
+            status = EXIT_FAILURE;
+        }
+    }
+    out_flush(out);
+    struct stat in_st, out_st;
+    bool pipes = fstat(STDIN_FILENO, &in_st) == 0 && S_ISFIFO(in_st.st_mode) &&
+                 fstat(out->fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+    int file = count == 1 ? fds[0] : -1;
+    if (pipes && count <= 1 && file < 0) {
+        /* No file to copy to, so it is just cat. */
+        if (fd_copy(STDIN_FILENO, out->fd) != 0) status = EXIT_FAILURE;
+    } else if (pipes && count == 1) {
+        /*
+         * tee() duplicates the pipe content into the output pipe without
+         * consuming it, then splice() moves the same bytes into the file.
+         */
+        for (;;) {
+            ssize_t rc = tee(STDIN_FILENO, out->fd, COPY_CHUNK, 0);
+            if (rc < 0 && errno == EINTR) continue;
+            if (rc <= 0) break;
+            size_t left;
+            if (splice_exact(STDIN_FILENO, file, rc, &left) == 0) continue;
+            /*
+             * The bytes are in the output already, they must not be tee'd
+             * again. The rest goes only to the output.
+             */
+            print_file_error("tee", cmd->args[first]);
+            status = EXIT_FAILURE;
+            if (pipe_drop(STDIN_FILENO, left) != 0 || fd_copy(STDIN_FILENO, out->fd) != 0)
+                status = EXIT_FAILURE;
+            break;
+        }
+    } else {
+        char buf[64 * 1024];
+        ssize_t rc;
+        while ((rc = read(STDIN_FILENO, buf, sizeof(buf))) != 0) {
+            if (rc < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            write_all(out->fd, buf, rc);
+            for (uint32_t i = 0; i < count; ++i) {
+                if (fds[i] >= 0) write_all(fds[i], buf, rc);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    return status;
+}
+
+static void execute_command_line(const struct command_line *line, int *exit_code, struct shell *sh);
+
+/* Start one line of 'parallel' in a child with the shell's usual machinery. */
+static pid_t parallel_start(const struct command_line *line, int out_fd, struct shell *sh) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0) dup2(null_fd, STDIN_FILENO), close(null_fd);
+    if (out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
+    jobs_forget(&sh->jobs);
+    int exit_code = 0;
+    execute_command_line(line, &exit_code, sh);
+    _exit(exit_code);
+}
+
+/*
+ * 'parallel [-j N] [file]' executes the command lines from the file or stdin,
+ * keeping at most N of them running at once. The children are accounted as
+ * one hidden job and are reaped via the same signalfd as the background jobs.
+ * The exit status is the number of failed lines, at most 101.
+ */
+static int builtin_parallel(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *file = NULL;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+        const char *arg = cmd->args[i];
+        if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) {
+            if (++i == cmd->arg_count) return BUILTIN_UNSUPPORTED;
+            arg = cmd->args[i];
+        } else if (strncmp(arg, "-j", 2) == 0) {
+            arg += 2;
+        } else if (arg[0] != '-' && file == NULL) {
+            file = arg;
+            continue;
+        } else {
+            return BUILTIN_UNSUPPORTED;
+        }
+        char *end;
+        limit = strtol(arg, &end, 10);
+        if (*end != 0 || limit <= 0) return BUILTIN_UNSUPPORTED;
+    }
+    if (limit <= 0) limit = 1;
+    int in_fd = STDIN_FILENO;
+    if (file != NULL && (in_fd = open(file, O_RDONLY)) < 0) {
+        print_file_error("parallel", file);
+        return 255;
+    }
+    out_flush(out);
+
+    struct job_list *jl = &sh->jobs;
+    struct job *batch = job_new(jl, strdup("parallel"));
+    batch->foreground = true;
+    batch->waited = true;
+    struct parser *prs = parser_new();
+    char buf[4096];
+    ssize_t nread;
+    bool eof = false;
+    while (!eof) {
+        nread = read(in_fd, buf, sizeof(buf));
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread <= 0) {
+            /* Let the last line be complete even without a new line. */
+            parser_feed(prs, "\n", 1);
+            eof = true;
+        } else {
+            parser_feed(prs, buf, nread);
+        }
+        struct command_line *ln;
+        while (parser_pop_next(prs, &ln) == PARSER_ERR_NONE && ln) {
+            for (jobs_collect(jl); batch->pids_left >= limit; jobs_collect(jl)) jobs_wait_signal(jl);
+            pid_t pid = parallel_start(ln, out->fd, sh);
+            if (pid > 0) job_add_pid(jl, batch, pid);
+            else batch->failed++;
+            command_line_delete(ln);
+        }
+    }
+    for (jobs_collect(jl); batch->pids_left > 0; jobs_collect(jl)) jobs_wait_signal(jl);
+    parser_delete(prs);
+    if (in_fd != STDIN_FILENO) close(in_fd);
+    int status = MIN(batch->failed, 101);
+    job_delete(jl, batch);
+    return status;
+}
+
+/*
+ * 'hash' prints the command hash table, 'hash -r' forgets all the entries,
+ * 'hash name...' looks the names up and remembers them.
+ */
+static int builtin_hash(const struct command *cmd, struct outbuf *out, struct shell *sh) {
+    struct path_cache *pc = &sh->hash;
+    if (cmd->arg_count == 1 && strcmp(cmd->args[0], "-r") == 0) {
+        path_cache_clear(pc);
+        return EXIT_SUCCESS;
+    }
+    int status = EXIT_SUCCESS;
+    if (cmd->arg_count > 0) {
+        for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+            if (cmd->args[i][0] == '-') return BUILTIN_UNSUPPORTED;
+        }
+        for (uint32_t i = 0; i < cmd->arg_count; ++i) {
+            if (path_cache_find(pc, cmd->args[i], false) != NULL)
+                continue;
+            char buf[512];
+            int n = snprintf(buf, sizeof(buf), "hash: %s: not found\n", cmd->args[i]);
+            write_all(STDERR_FILENO, buf, MIN(n, (int)sizeof(buf) - 1));
+            status = EXIT_FAILURE;
+        }
+        return status;
+    }
+    if (pc->count == 0) {
+        out_str(out, "hash: hash table empty\n");
+        return EXIT_SUCCESS;
+    }
+    out_str(out, "hits\tcommand\n");
+    char buf[32];
+    for (uint32_t i = 0; i < pc->bucket_count; ++i) {
+        for (struct path_entry *e = pc->buckets[i]; e != NULL; e = e->next) {
+            out_write(out, buf, snprintf(buf, sizeof(buf), "%4u\t", e->hits));
+            out_str(out, e->path);
+            out_char(out, '\n');
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+typedef int (*builtin_f)(const struct command *cmd, struct outbuf *out, struct shell *sh);
+
+struct builtin {
+    const char *name;
+    builtin_f func;
+};
+
+static const struct builtin builtins[] = {
+    {"true", builtin_true},
+    {"false", builtin_false},
+    {"echo", builtin_echo},
+    {"pwd", builtin_pwd},
+    {"printf", builtin_printf},
+    {"jobs", builtin_jobs},
+    {"wait", builtin_wait},
+    {"cat", builtin_cat},
+    {"tee", builtin_tee},
+    {"parallel", builtin_parallel},
+    {"hash", builtin_hash},
+    {"exit", builtin_exit},
+};
+
+static const struct builtin *builtin_find(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+        if (strcmp(builtins[i].name, name) == 0) return &builtins[i];
+    }
+    return NULL;
+}
+
+static int builtin_run(const struct builtin *b, const struct command *cmd, int fd, struct shell *sh) {
+    struct outbuf out;
+    out.fd = fd;
+    out.size = 0;
+    int rc = b->func(cmd, &out, sh);
+    out_flush(&out);
+    return rc;
+}
+
+static void build_argv(const struct command *cmd, char **argv) {
+    argv[0] = cmd->exe;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) argv[i+1] = cmd->args[i];
+    argv[cmd->arg_count + 1] = NULL;
+}
+
+static int redirect_flags(enum output_type mode) {
+    return O_WRONLY | O_CREAT | (mode == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND);
+}
+
+static void print_exec_error(const char *exe, int err) {
+    char buf[512];
+    int n = err == ENOENT && strchr(exe, '/') == NULL ?
+            snprintf(buf, sizeof(buf), "mybash: %s: command not found\n", exe) :
+            snprintf(buf, sizeof(buf), "mybash: %s: %s\n", exe, strerror(err));
+    write_all(STDERR_FILENO, buf, MIN(n, (int)sizeof(buf) - 1));
+}
+
+/*
+ * Slow path: a full fork() copies the page tables of the whole shell, so it
+ * is only used when the child can't be described by posix_spawn file actions,
+ * or when the child is a builtin.
+ */
+static pid_t fork_command(const struct builtin *b, const struct command *cmd, int in_fd,
+                          const int *pipe_fds, const char *outfile, enum output_type mode,
+                          struct shell *sh) {
+    /*
+     * Resolve the path in the shell, an entry added by the child would be
+     * lost. A builtin rarely falls back to the utility, so it isn't a hit.
+     */
+    const char *path = path_cache_find(&sh->hash, cmd->exe, b == NULL);
+    if (path != NULL && access(path, X_OK) != 0) {
+        /* The cached file is gone, the child can't evict it from here. */
+        path_cache_forget(&sh->hash, cmd->exe);
+        path = path_cache_find(&sh->hash, cmd->exe, b == NULL);
+    }
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+    if (in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO), close(in_fd);
+    if (pipe_fds) close(pipe_fds[0]), dup2(pipe_fds[1], STDOUT_FILENO), close(pipe_fds[1]);
+    if (outfile) {
+        int fd = open(outfile, redirect_flags(mode), 0644);
+        if (fd >= 0) dup2(fd, STDOUT_FILENO), close(fd);
+    }
+    if (b) {
+        int rc = builtin_run(b, cmd, STDOUT_FILENO, sh);
+        if (rc != BUILTIN_UNSUPPORTED) _exit(rc);
+    }
+    /* Builtins still need SIGCHLD blocked to reap their own children. */
+    sigprocmask(SIG_SETMASK, &sh->jobs.child_sigmask, NULL);
+    char *argv[cmd->arg_count + 2];
+    build_argv(cmd, argv);
+    if (path != NULL) execv(path, argv);
+    /* Not found or the cached file is gone. */
+    execvp(cmd->exe, argv);
+    print_exec_error(cmd->exe, errno);
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * The parent is suspended until a vforked child execs, so an open() which can
+ * block (a FIFO without a reader yet) must not happen inside posix_spawn.
+ * Regular files, /dev/null and ttys open at once.
+ */
+static bool redirect_may_block(const char *outfile) {
+    struct stat st;
+    if (outfile == NULL || stat(outfile, &st) != 0) return false;
+    return S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode);
+}
+
+/*
+ * posix_spawn() doesn't do what execvp() does for a file without #!, so a
+ * script like that is given to /bin/sh here.
+ */
+static int spawn_path(pid_t *pid, const char *path, const posix_spawn_file_actions_t *fa,
+                      const posix_spawnattr_t *attr, const struct command *cmd, char **argv) {
+    int rc = posix_spawn(pid, path, fa, attr, argv, environ);
+    if (rc != ENOEXEC) return rc;
+    char *sh_argv[cmd->arg_count + 3];
+    sh_argv[0] = "sh";
+    sh_argv[1] = (char *)path;
+    for (uint32_t i = 0; i < cmd->arg_count; ++i) sh_argv[i + 2] = cmd->args[i];
+    sh_argv[cmd->arg_count + 2] = NULL;
+    return posix_spawn(pid, "/bin/sh", fa, attr, sh_argv, environ);
+}
+
+/*
+ * Fast path: posix_spawn() is implemented via clone(CLONE_VM | CLONE_VFORK) in
+ * glibc, so its cost does not depend on how big the shell's heap has become.
+ * All the redirections are expressed as file actions executed in the child.
+ * Returns the child pid, or -1 if the command couldn't be started.
+ */
+static pid_t launch_command(const struct builtin *b, const struct command *cmd, int in_fd,
+                            const int *pipe_fds, const char *outfile, enum output_type mode,
+                            struct shell *sh) {
+    if (b) return fork_command(b, cmd, in_fd, pipe_fds, outfile, mode, sh);
+    posix_spawn_file_actions_t fa;
+    if (redirect_may_block(outfile) || posix_spawn_file_actions_init(&fa) != 0)
+        return fork_command(NULL, cmd, in_fd, pipe_fds, outfile, mode, sh);
+    int rc = 0;
+    if (in_fd != STDIN_FILENO) {
+        rc |= posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+        rc |= posix_spawn_file_actions_addclose(&fa, in_fd);
+    }
+    if (pipe_fds) {
+        rc |= posix_spawn_file_actions_addclose(&fa, pipe_fds[0]);
+        rc |= posix_spawn_file_actions_adddup2(&fa, pipe_fds[1], STDOUT_FILENO);
+        rc |= posix_spawn_file_actions_addclose(&fa, pipe_fds[1]);
+    }
+    if (outfile)
+        rc |= posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, outfile, redirect_flags(mode), 0644);
+    if (rc != 0) {
+        posix_spawn_file_actions_destroy(&fa);
+        return fork_command(NULL, cmd, in_fd, pipe_fds, outfile, mode, sh);
+    }
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &sh->jobs.child_sigmask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    char *argv[cmd->arg_count + 2];
+    build_argv(cmd, argv);
+    pid_t pid;
+    const char *path = path_cache_find(&sh->hash, cmd->exe, true);
+    if (path != NULL) {
+        rc = spawn_path(&pid, path, &fa, &attr, cmd, argv);
+        if (rc == ENOENT) {
+            /* The cached file is gone, look it up again. */
+            path_cache_forget(&sh->hash, cmd->exe);
+            path = path_cache_find(&sh->hash, cmd->exe, true);
+            rc = path != NULL ? spawn_path(&pid, path, &fa, &attr, cmd, argv) : ENOENT;
+        }
+    } else if (strchr(cmd->exe, '/') != NULL) {
+        rc = spawn_path(&pid, cmd->exe, &fa, &attr, cmd, argv);
+    } else {
+        rc = ENOENT;
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    if (rc != 0) {
+        print_exec_error(cmd->exe, rc);
+        return -1;
+    }
+    return pid;
+}
+
+/*
+ * Run a builtin right in the shell process. Returns false if the builtin
+ * declined the arguments and the external utility has to be used instead.
+ */
+static bool run_builtin_inplace(const struct builtin *b, const struct command *cmd,
+                                const char *outfile, enum output_type mode, int *status,
+                                struct shell *sh) {
+    int fd = STDOUT_FILENO;
+    if (outfile) {
+        fd = open(outfile, redirect_flags(mode), 0644);
+        if (fd < 0) {
+            *status = EXIT_FAILURE;
+            return true;
+        }
+    }
+    int rc = builtin_run(b, cmd, fd, sh);
+    if (outfile) close(fd);
+    if (rc == BUILTIN_UNSUPPORTED) return false;
+    *status = rc;
+    return true;
+}
+
+static void execute_command_line(const struct command_line *line, int *exit_code, struct shell *sh) {
     struct expr *cur = line->head;
     enum output_type mode = line->out_type;
     char *outfile = line->out_file;
@@ -145,6 +1298,7 @@ static void execute_command_line(const struct command_line *line, int *exit_code
 
     struct pipeline_pids pp;
     pipeline_init(&pp, 16);
+    struct job *job = line->is_background ? job_new(&sh->jobs, command_line_text(line)) : NULL;
 
     int in_fd = STDIN_FILENO;
     bool skip = false;
@@ -165,27 +1319,26 @@ static void execute_command_line(const struct command_line *line, int *exit_code
             struct command *cmd = &cur->cmd;
             bool do_pipe = (cur->next && cur->next->type == EXPR_TYPE_PIPE);
             bool do_file = (!do_pipe && (mode == OUTPUT_TYPE_FILE_NEW || mode == OUTPUT_TYPE_FILE_APPEND) && outfile);
+            const struct builtin *b = builtin_find(cmd->exe);
+            if (b && !do_pipe && in_fd == STDIN_FILENO && !line->is_background) {
+                if (run_builtin_inplace(b, cmd, do_file ? outfile : NULL, mode, &last, sh)) {
+                    *exit_code = last;
+                    cur = cur->next;
+                    continue;
+                }
+                b = NULL;
+            }
             int fds[2];
             if (do_pipe) pipe(fds);
 
-            pid_t pid = fork();
-            if (pid == 0) {
-                if (in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO), close(in_fd);
-                if (do_pipe) close(fds[0]), dup2(fds[1], STDOUT_FILENO), close(fds[1]);
-                if (do_file) {
-                    int flags = O_WRONLY | O_CREAT | (mode == OUTPUT_TYPE_FILE_NEW ? O_TRUNC : O_APPEND);
-                    int fd = open(outfile, flags, 0644);
-                    if (fd >= 0) dup2(fd, STDOUT_FILENO), close(fd);
-                }
-                int argc = cmd->arg_count + 2;
-                char *argv[argc];
-                argv[0] = cmd->exe;
-                for (uint32_t i = 0; i < cmd->arg_count; ++i) argv[i+1] = cmd->args[i];
-                argv[argc-1] = NULL;
-                execvp(cmd->exe, argv);
-                _exit(EXIT_FAILURE);
-            } else if (pid > 0) {
-                handle_parent(pid, line->is_background, do_pipe, &pp, bpl, &last, exit_code);
+            pid_t pid = launch_command(b, cmd, in_fd, do_pipe ? fds : NULL,
+                                       do_file ? outfile : NULL, mode, sh);
+            if (pid > 0) {
+                handle_parent(pid, job, do_pipe, &pp, &sh->jobs, &last, exit_code);
+            } else if (!do_pipe && !line->is_background) {
+                /* Same status as a child failing to exec would have had. */
+                last = EXIT_FAILURE;
+                *exit_code = last;
             }
 
             if (in_fd != STDIN_FILENO) close(in_fd);
@@ -197,12 +1350,14 @@ static void execute_command_line(const struct command_line *line, int *exit_code
 
     for (int i = 0; i < pp.size; ++i) waitpid(pp.pids[i], NULL, 0);
     pipeline_free(&pp);
+    if (job && job->pids_left == 0) job_delete(&sh->jobs, job);
 }
 
 int main(void) {
     struct parser *prs = parser_new();
-    struct bgproc_list bpl;
-    bgproc_init(&bpl);
+    struct shell sh;
+    jobs_init(&sh.jobs);
+    memset(&sh.hash, 0, sizeof(sh.hash));
     char buf[1024];
     int nread, exit_code = 0;
     
@@ -219,14 +1374,15 @@ int main(void) {
                     goto cleanup;
                 }
             }
-            execute_command_line(ln, &exit_code, &bpl);
+            execute_command_line(ln, &exit_code, &sh);
             command_line_delete(ln);
-            bgproc_reap(&bpl);
+            jobs_reap(&sh.jobs);
         }
     }
 
 cleanup:
-    bgproc_free(&bpl);
+    jobs_free(&sh.jobs);
+    path_cache_free(&sh.hash);
     parser_delete(prs);
     return exit_code;
 }
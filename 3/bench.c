@@ -0,0 +1,1120 @@
+#include "userfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Userfs benchmark. A file of the maximal size is written and read back with
+ * small calls, so the cost of finding the block of the current position
+ * dominates when it depends on the file size. Then the call size goes from a
+ * byte to a megabyte, and the file is read by 4KB at random offsets. A file
+ * of text is compressed and read while it is compressed. A file
+ * is grown to the maximal
+ * size with resize and read back while it is still a hole. The vectored and
+ * positional calls are compared with the loops of plain ones doing the same.
+ * A checksum of the file is taken after a read and in the borrowed memory.
+ * A file of the maximal size is cloned and the clone is overwritten. Many
+ * files are resized to random sizes in a storm. Files are created,
+ * filled and deleted in a loop to see the block allocation cost. Then a
+ * namespace of many files is created, reopened and deleted, which measures
+ * the file lookup, and the same calls are repeated for the namespaces from a
+ * thousand to a million files. The same namespace is spread over directories, which are
+ * listed, and a deep path is opened. The memory taken by files of different
+ * sizes is compared to their data size. At last the same work is spread over
+ * a growing number of threads to see how the locks scale. In the end an image file is saved
+ * and opened again.
+ *
+ * ./bench [--json] [image MB]
+ * With --json the results are printed as one JSON document of the name,
+ * value and unit of each result, which is easy to diff between the builds.
+ */
+
+enum {
+	FILE_SIZE = 100 * 1024 * 1024,
+	CALL_SIZE = 4096,
+	NAMESPACE_SIZE = 1000 * 1000,
+	RESIZE_COUNT = 1000,
+	DIR_COUNT = 1000,
+	DIR_DEPTH = 16,
+	DIR_LOOKUPS = 1000 * 1000,
+	CHURN_FILE_SIZE = 4 * 1024 * 1024,
+	CHURN_COUNT = 500,
+	/** Data size of the files of each size in the memory benchmark. */
+	MEMORY_DATA_SIZE = 64 * 1024 * 1024,
+	MEMORY_MAX_FILES = 100 * 1000,
+	/** Buffers of a vectored call. */
+	VECTOR_SIZE = 16,
+	MAX_THREADS = 16,
+	/** Operations of each thread in the scalability benchmark. */
+	THREAD_OPS = 50 * 1000,
+	SHARED_FILE_SIZE = 1024 * 1024,
+	/** Calls of each size in the sequential benchmark, at most. */
+	SEQ_CALLS = 1000 * 1000,
+	SEQ_MAX_CALL_SIZE = 1024 * 1024,
+	RANDOM_READS = 1000 * 1000,
+	/** Random opens of each namespace size. */
+	SCALE_OPS = 100 * 1000,
+	STORM_FILES = 64,
+	STORM_RESIZES = 100 * 1000,
+	STORM_MAX_SIZE = 4 * 1024 * 1024,
+};
+
+static double
+clock_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Print the results as one JSON document instead of the text lines. */
+static bool is_json = false;
+static int result_count = 0;
+
+/**
+ * Every result goes through here. The text is aligned for a human, the JSON
+ * keeps the full precision and the unit, so the runs of different builds can
+ * be compared by a script.
+ */
+static void
+report_value(const char *name, double value, const char *unit, int precision)
+{
+	if (is_json) {
+		printf("%s\n\t\t{\"name\": \"%s\", \"value\": %.9g, "
+		       "\"unit\": \"%s\"}", result_count == 0 ? "" : ",", name,
+		       value, unit);
+	} else {
+		printf("%-16s %10.*f %s\n", name, precision, value, unit);
+	}
+	++result_count;
+	fflush(stdout);
+}
+
+static void
+report(const char *name, size_t bytes, double elapsed)
+{
+	report_value(name, bytes / elapsed / (1 << 20), "MB/s", 1);
+}
+
+static void
+report_ops(const char *name, size_t ops, double elapsed)
+{
+	report_value(name, ops / elapsed, "ops/s", 0);
+}
+
+static void
+report_time(const char *name, double elapsed)
+{
+	report_value(name, elapsed * 1000, "ms", 3);
+}
+
+static void
+report_begin(void)
+{
+	if (!is_json)
+		return;
+	printf("{\n\t\"compiler\": \"%s\",\n\t\"time\": %lld,\n"
+	       "\t\"results\": [", __VERSION__, (long long)time(NULL));
+}
+
+static void
+report_end(int rc)
+{
+	if (is_json)
+		printf("\n\t],\n\t\"ok\": %s\n}\n", rc == 0 ? "true" : "false");
+}
+
+static int
+bench_max_file(void)
+{
+	char *buf = malloc(CALL_SIZE);
+	memset(buf, 'x', CALL_SIZE);
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		goto error;
+
+	double start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += CALL_SIZE) {
+		if (ufs_write(fd, buf, CALL_SIZE) != CALL_SIZE)
+			goto error;
+	}
+	report("write 4KB", FILE_SIZE, clock_sec() - start);
+
+	int rfd = ufs_open("file", 0);
+	if (rfd < 0)
+		goto error;
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += CALL_SIZE) {
+		if (ufs_read(rfd, buf, CALL_SIZE) != CALL_SIZE)
+			goto error;
+	}
+	report("read 4KB", FILE_SIZE, clock_sec() - start);
+
+	/* Rewrite the file from the start with a fresh descriptor. */
+	ufs_close(rfd);
+	rfd = ufs_open("file", 0);
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += CALL_SIZE) {
+		if (ufs_write(rfd, buf, CALL_SIZE) != CALL_SIZE)
+			goto error;
+	}
+	report("overwrite 4KB", FILE_SIZE, clock_sec() - start);
+
+	ufs_close(rfd);
+	ufs_close(fd);
+	ufs_delete("file");
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+/** A fixed seed, so every build reads and resizes at the same offsets. */
+static uint64_t random_state = 88172645463325252ULL;
+
+static uint64_t
+random_next(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+static void
+size_name(char *name, size_t len, const char *prefix, size_t size)
+{
+	if (size >= 1024 * 1024)
+		snprintf(name, len, "%s %zuMB", prefix, size / (1024 * 1024));
+	else if (size >= 1024)
+		snprintf(name, len, "%s %zuKB", prefix, size / 1024);
+	else
+		snprintf(name, len, "%s %zuB", prefix, size);
+}
+
+/**
+ * A file is written and read through with the calls of each size from a
+ * byte to a megabyte. The small calls show the cost of a call itself, the
+ * big ones show the copying. The file is smaller for the small calls, else
+ * they would take minutes.
+ */
+static int
+bench_sequential(void)
+{
+	char name[32];
+	char *buf = malloc(SEQ_MAX_CALL_SIZE);
+	memset(buf, 'x', SEQ_MAX_CALL_SIZE);
+	for (size_t call = 1; call <= SEQ_MAX_CALL_SIZE; call *= 16) {
+		size_t total = call * SEQ_CALLS;
+		if (total > FILE_SIZE)
+			total = FILE_SIZE;
+		int fd = ufs_open("file", UFS_CREATE);
+		if (fd < 0)
+			goto error;
+		double start = clock_sec();
+		for (size_t done = 0; done < total; done += call) {
+			if (ufs_write(fd, buf, call) != (ssize_t)call)
+				goto error;
+		}
+		size_name(name, sizeof(name), "seq write", call);
+		report(name, total, clock_sec() - start);
+
+		int rfd = ufs_open("file", 0);
+		if (rfd < 0)
+			goto error;
+		start = clock_sec();
+		for (size_t done = 0; done < total; done += call) {
+			if (ufs_read(rfd, buf, call) != (ssize_t)call)
+				goto error;
+		}
+		size_name(name, sizeof(name), "seq read", call);
+		report(name, total, clock_sec() - start);
+		ufs_close(rfd);
+		ufs_close(fd);
+		if (ufs_delete("file") != 0)
+			goto error;
+	}
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+/** Aligned 4KB reads at random offsets of a file of the maximal size. */
+static int
+bench_random_read(void)
+{
+	char *buf = malloc(CALL_SIZE);
+	memset(buf, 'x', CALL_SIZE);
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		goto error;
+	for (size_t done = 0; done < FILE_SIZE; done += CALL_SIZE) {
+		if (ufs_write(fd, buf, CALL_SIZE) != CALL_SIZE)
+			goto error;
+	}
+	const size_t call_count = FILE_SIZE / CALL_SIZE;
+	double start = clock_sec();
+	for (int i = 0; i < RANDOM_READS; ++i) {
+		size_t offset = random_next() % call_count * CALL_SIZE;
+		if (ufs_pread(fd, buf, CALL_SIZE, offset) != CALL_SIZE)
+			goto error;
+	}
+	double elapsed = clock_sec() - start;
+	report("random read 4KB", (size_t)RANDOM_READS * CALL_SIZE, elapsed);
+	report_ops("random reads", RANDOM_READS, elapsed);
+	ufs_close(fd);
+	ufs_delete("file");
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+/**
+ * A file of text made of random words is compressed at once, then read by
+ * 4KB at random offsets while all its blocks are still compressed, which is
+ * the latency of the first access to a cold block, and at last read through.
+ */
+static int
+bench_compress(void)
+{
+	static const char *words[] = {"the ", "file ", "block ", "data ",
+		"of ", "a ", "system ", "compressed ", "is ", "read ",
+		"and ", "written ", "cold ", "memory ", "in ", "to "};
+	char *buf = malloc(CALL_SIZE);
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		goto error;
+	for (size_t done = 0; done < FILE_SIZE; done += CALL_SIZE) {
+		size_t len = 0;
+		while (len < CALL_SIZE) {
+			const char *w = words[random_next() % 16];
+			size_t n = strlen(w);
+			if (n > CALL_SIZE - len)
+				n = CALL_SIZE - len;
+			memcpy(buf + len, w, n);
+			len += n;
+		}
+		if (ufs_write(fd, buf, CALL_SIZE) != CALL_SIZE)
+			goto error;
+	}
+	double start = clock_sec();
+	size_t count = ufs_compress_cold(0);
+	report("compress", FILE_SIZE, clock_sec() - start);
+	struct ufs_compress_stat stat;
+	if (count == 0 || ufs_compress_stat(fd, &stat) != 0)
+		goto error;
+	report_value("compress ratio", (double)stat.data_size /
+		     stat.packed_size, "x", 2);
+
+	const size_t call_count = FILE_SIZE / CALL_SIZE;
+	const int cold_reads = 1000;
+	start = clock_sec();
+	for (int i = 0; i < cold_reads; ++i) {
+		size_t offset = random_next() % call_count * CALL_SIZE;
+		if (ufs_pread(fd, buf, CALL_SIZE, offset) != CALL_SIZE)
+			goto error;
+	}
+	report_value("cold read 4KB", (clock_sec() - start) / cold_reads * 1e6,
+		     "us", 2);
+	if (ufs_compress_cold(0) == 0)
+		goto error;
+	int rfd = ufs_open("file", 0);
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += CALL_SIZE) {
+		if (ufs_read(rfd, buf, CALL_SIZE) != CALL_SIZE)
+			goto error;
+	}
+	report("decompress read", FILE_SIZE, clock_sec() - start);
+	ufs_close(rfd);
+	ufs_close(fd);
+	ufs_delete("file");
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+/**
+ * Small buffers, VECTOR_SIZE of them, are read and written by a loop of the
+ * plain calls and by one vectored call. Then the file is read by pread.
+ */
+static int
+bench_vectored(void)
+{
+	char *buf = malloc(CALL_SIZE * VECTOR_SIZE);
+	memset(buf, 'x', CALL_SIZE * VECTOR_SIZE);
+	struct ufs_iovec iov[VECTOR_SIZE];
+	for (int i = 0; i < VECTOR_SIZE; ++i) {
+		iov[i].base = buf + i * CALL_SIZE;
+		iov[i].len = CALL_SIZE;
+	}
+	const size_t step = CALL_SIZE * VECTOR_SIZE;
+	/* Both overwrite the file, so the block allocation is not measured. */
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		goto error;
+	for (size_t done = 0; done < FILE_SIZE; done += step) {
+		if (ufs_writev(fd, iov, VECTOR_SIZE) != (ssize_t)step)
+			goto error;
+	}
+	ufs_close(fd);
+
+	fd = ufs_open("file", 0);
+	double start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += step) {
+		for (int i = 0; i < VECTOR_SIZE; ++i) {
+			if (ufs_write(fd, iov[i].base, CALL_SIZE) != CALL_SIZE)
+				goto error;
+		}
+	}
+	report("write 16x4KB", FILE_SIZE, clock_sec() - start);
+	ufs_close(fd);
+
+	fd = ufs_open("file", 0);
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += step) {
+		if (ufs_writev(fd, iov, VECTOR_SIZE) != (ssize_t)step)
+			goto error;
+	}
+	report("writev 16x4KB", FILE_SIZE, clock_sec() - start);
+	ufs_close(fd);
+
+	fd = ufs_open("file", 0);
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += step) {
+		for (int i = 0; i < VECTOR_SIZE; ++i) {
+			if (ufs_read(fd, iov[i].base, CALL_SIZE) != CALL_SIZE)
+				goto error;
+		}
+	}
+	report("read 16x4KB", FILE_SIZE, clock_sec() - start);
+	ufs_close(fd);
+
+	fd = ufs_open("file", 0);
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += step) {
+		if (ufs_readv(fd, iov, VECTOR_SIZE) != (ssize_t)step)
+			goto error;
+	}
+	report("readv 16x4KB", FILE_SIZE, clock_sec() - start);
+
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += CALL_SIZE) {
+		if (ufs_pread(fd, buf, CALL_SIZE, done) != CALL_SIZE)
+			goto error;
+	}
+	report("pread 4KB", FILE_SIZE, clock_sec() - start);
+
+	ufs_close(fd);
+	ufs_delete("file");
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+static uint64_t
+checksum(uint64_t sum, const char *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i)
+		sum = sum * 31 + (unsigned char)data[i];
+	return sum;
+}
+
+static int
+bench_borrow(void)
+{
+	const size_t call_size = 64 * 1024;
+	char *buf = malloc(call_size);
+	memset(buf, 'x', call_size);
+	int fd = ufs_open("file", UFS_CREATE);
+	for (size_t done = 0; done < FILE_SIZE; done += call_size) {
+		if (ufs_write(fd, buf, call_size) != (ssize_t)call_size)
+			goto error;
+	}
+	ufs_close(fd);
+
+	fd = ufs_open("file", 0);
+	uint64_t sum1 = 0;
+	double start = clock_sec();
+	ssize_t rc;
+	while ((rc = ufs_read(fd, buf, call_size)) > 0)
+		sum1 = checksum(sum1, buf, rc);
+	report("read+sum 64KB", FILE_SIZE, clock_sec() - start);
+	ufs_close(fd);
+
+	fd = ufs_open("file", 0);
+	uint64_t sum2 = 0;
+	start = clock_sec();
+	struct ufs_iovec iov[1];
+	int cnt = 1;
+	while ((rc = ufs_read_borrow(fd, call_size, iov, &cnt)) > 0) {
+		sum2 = checksum(sum2, iov[0].base, iov[0].len);
+		ufs_read_release(fd);
+		cnt = 1;
+	}
+	report("borrow+sum 64KB", FILE_SIZE, clock_sec() - start);
+	ufs_close(fd);
+	ufs_delete("file");
+	free(buf);
+	if (rc < 0 || sum1 != sum2)
+		return -1;
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+/**
+ * A clone shares the blocks, so it is compared with copying the file by
+ * reads and writes. Then the clone is overwritten, which copies the blocks.
+ */
+static int
+bench_clone(void)
+{
+	const size_t call_size = 64 * 1024;
+	char *buf = malloc(call_size);
+	memset(buf, 'x', call_size);
+	int fd = ufs_open("file", UFS_CREATE);
+	for (size_t done = 0; done < FILE_SIZE; done += call_size) {
+		if (ufs_write(fd, buf, call_size) != (ssize_t)call_size)
+			goto error;
+	}
+	ufs_close(fd);
+
+	double start = clock_sec();
+	fd = ufs_open("file", 0);
+	int cfd = ufs_open("copy", UFS_CREATE);
+	for (size_t done = 0; done < FILE_SIZE; done += call_size) {
+		if (ufs_read(fd, buf, call_size) != (ssize_t)call_size ||
+		    ufs_write(cfd, buf, call_size) != (ssize_t)call_size)
+			goto error;
+	}
+	report_time("copy 100MB", clock_sec() - start);
+	ufs_close(cfd);
+	ufs_close(fd);
+	ufs_delete("copy");
+
+	start = clock_sec();
+	if (ufs_clone("file", "copy") != 0)
+		goto error;
+	report_time("clone 100MB", clock_sec() - start);
+
+	cfd = ufs_open("copy", 0);
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += call_size) {
+		if (ufs_write(cfd, buf, call_size) != (ssize_t)call_size)
+			goto error;
+	}
+	report("write clone 64KB", FILE_SIZE, clock_sec() - start);
+	ufs_close(cfd);
+	ufs_delete("copy");
+	ufs_delete("file");
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+static int
+bench_sparse(void)
+{
+	char *buf = malloc(CALL_SIZE);
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		goto error;
+	double start = clock_sec();
+	for (int i = 0; i < RESIZE_COUNT; ++i) {
+		if (ufs_resize(fd, FILE_SIZE) != 0 || ufs_resize(fd, 0) != 0)
+			goto error;
+	}
+	report_ops("resize 0-100MB", RESIZE_COUNT * 2, clock_sec() - start);
+
+	if (ufs_resize(fd, FILE_SIZE) != 0)
+		goto error;
+	start = clock_sec();
+	for (size_t done = 0; done < FILE_SIZE; done += CALL_SIZE) {
+		if (ufs_read(fd, buf, CALL_SIZE) != CALL_SIZE)
+			goto error;
+	}
+	report("read hole 4KB", FILE_SIZE, clock_sec() - start);
+
+	ufs_close(fd);
+	ufs_delete("file");
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+/**
+ * Many files are resized to random sizes in turn, and a page is written at a
+ * random offset of each new size, so the holes are filled and the blocks are
+ * freed and allocated in a mess of different sizes all the time.
+ */
+static int
+bench_resize_storm(void)
+{
+	char name[32];
+	char buf[CALL_SIZE];
+	int fds[STORM_FILES];
+	memset(buf, 'x', sizeof(buf));
+	for (int i = 0; i < STORM_FILES; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		fds[i] = ufs_open(name, UFS_CREATE);
+		if (fds[i] < 0)
+			goto error;
+	}
+	double start = clock_sec();
+	for (int i = 0; i < STORM_RESIZES; ++i) {
+		int fd = fds[random_next() % STORM_FILES];
+		size_t size = CALL_SIZE + random_next() % STORM_MAX_SIZE;
+		size_t offset = random_next() % (size - CALL_SIZE + 1);
+		if (ufs_resize(fd, size) != 0 ||
+		    ufs_pwrite(fd, buf, CALL_SIZE, offset) != CALL_SIZE)
+			goto error;
+	}
+	report_ops("resize storm", STORM_RESIZES, clock_sec() - start);
+	for (int i = 0; i < STORM_FILES; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		ufs_close(fds[i]);
+		if (ufs_delete(name) != 0)
+			goto error;
+	}
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	return -1;
+}
+
+static int
+bench_block_churn(void)
+{
+	const size_t call_size = 64 * 1024;
+	char *buf = malloc(call_size);
+	memset(buf, 'x', call_size);
+	double start = clock_sec();
+	for (int i = 0; i < CHURN_COUNT; ++i) {
+		int fd = ufs_open("file", UFS_CREATE);
+		if (fd < 0)
+			goto error;
+		for (size_t done = 0; done < CHURN_FILE_SIZE; done += call_size) {
+			if (ufs_write(fd, buf, call_size) != (ssize_t)call_size)
+				goto error;
+		}
+		if (ufs_close(fd) != 0 || ufs_delete("file") != 0)
+			goto error;
+	}
+	report("churn 4MB files", (size_t)CHURN_FILE_SIZE * CHURN_COUNT,
+	       clock_sec() - start);
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(buf);
+	return -1;
+}
+
+/**
+ * Churn of NAMESPACE_SIZE files: create them all, open and close each, then
+ * open them all at once, truncate one while the others are open, delete them
+ * while still open, and close them.
+ */
+static int
+bench_namespace(void)
+{
+	char name[32];
+	int *fds = malloc(NAMESPACE_SIZE * sizeof(*fds));
+	double start = clock_sec();
+	for (int i = 0; i < NAMESPACE_SIZE; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0 || ufs_close(fd) != 0)
+			goto error;
+	}
+	report_ops("create", NAMESPACE_SIZE, clock_sec() - start);
+
+	start = clock_sec();
+	for (int i = 0; i < NAMESPACE_SIZE; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		int fd = ufs_open(name, 0);
+		if (fd < 0 || ufs_close(fd) != 0)
+			goto error;
+	}
+	report_ops("open+close", NAMESPACE_SIZE, clock_sec() - start);
+
+	start = clock_sec();
+	for (int i = 0; i < NAMESPACE_SIZE; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		fds[i] = ufs_open(name, 0);
+		if (fds[i] < 0)
+			goto error;
+	}
+	report_ops("open all", NAMESPACE_SIZE, clock_sec() - start);
+
+	start = clock_sec();
+	for (int i = 0; i < RESIZE_COUNT; ++i) {
+		if (ufs_resize(fds[0], 1) != 0 || ufs_resize(fds[0], 0) != 0)
+			goto error;
+	}
+	report_ops("resize 1M fds", RESIZE_COUNT * 2, clock_sec() - start);
+
+	start = clock_sec();
+	for (int i = 0; i < NAMESPACE_SIZE; ++i) {
+		snprintf(name, sizeof(name), "file%d", i);
+		if (ufs_delete(name) != 0)
+			goto error;
+	}
+	report_ops("delete", NAMESPACE_SIZE, clock_sec() - start);
+	start = clock_sec();
+	for (int i = 0; i < NAMESPACE_SIZE; ++i) {
+		if (ufs_close(fds[i]) != 0)
+			goto error;
+	}
+	report_ops("close all", NAMESPACE_SIZE, clock_sec() - start);
+	free(fds);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	free(fds);
+	return -1;
+}
+
+/**
+ * The rates of the namespace calls while the namespace grows. Each size is
+ * created from scratch, then random names are opened and closed, at last
+ * all of them are deleted. A lookup should not depend on the size.
+ */
+static int
+bench_namespace_scale(void)
+{
+	char name[48];
+	for (int size = 1000; size <= NAMESPACE_SIZE; size *= 10) {
+		double start = clock_sec();
+		for (int i = 0; i < size; ++i) {
+			snprintf(name, sizeof(name), "file%d", i);
+			int fd = ufs_open(name, UFS_CREATE);
+			if (fd < 0 || ufs_close(fd) != 0)
+				goto error;
+		}
+		snprintf(name, sizeof(name), "create n=%d", size);
+		report_ops(name, size, clock_sec() - start);
+
+		start = clock_sec();
+		for (int i = 0; i < SCALE_OPS; ++i) {
+			snprintf(name, sizeof(name), "file%d",
+				 (int)(random_next() % size));
+			int fd = ufs_open(name, 0);
+			if (fd < 0 || ufs_close(fd) != 0)
+				goto error;
+		}
+		snprintf(name, sizeof(name), "open+close n=%d", size);
+		report_ops(name, SCALE_OPS, clock_sec() - start);
+
+		start = clock_sec();
+		for (int i = 0; i < size; ++i) {
+			snprintf(name, sizeof(name), "file%d", i);
+			if (ufs_delete(name) != 0)
+				goto error;
+		}
+		snprintf(name, sizeof(name), "delete n=%d", size);
+		report_ops(name, size, clock_sec() - start);
+	}
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	return -1;
+}
+
+/**
+ * A big namespace is spread over directories, and one small directory is
+ * listed and a deep path is opened, which must not depend on the namespace
+ * size.
+ */
+static int
+bench_dirs(void)
+{
+	char name[64];
+	char path[DIR_DEPTH * 4 + 16] = "";
+	double start = clock_sec();
+	for (int i = 0; i < DIR_COUNT; ++i) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		if (ufs_mkdir(name) != 0)
+			goto error;
+	}
+	for (int i = 0; i < NAMESPACE_SIZE; ++i) {
+		snprintf(name, sizeof(name), "dir%d/file%d", i % DIR_COUNT, i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0 || ufs_close(fd) != 0)
+			goto error;
+	}
+	report_ops("create in dirs", NAMESPACE_SIZE, clock_sec() - start);
+
+	start = clock_sec();
+	size_t entries = 0;
+	for (int i = 0; i < DIR_COUNT; ++i) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		struct ufs_dir *dir = ufs_opendir(name);
+		if (dir == NULL)
+			goto error;
+		while (ufs_readdir(dir) != NULL)
+			++entries;
+		ufs_closedir(dir);
+	}
+	report_ops("list entries", entries, clock_sec() - start);
+
+	for (int i = 0; i < DIR_DEPTH; ++i) {
+		strcat(path, i == 0 ? "d" : "/d");
+		if (ufs_mkdir(path) != 0)
+			goto error;
+	}
+	strcat(path, "/file");
+	int fd = ufs_open(path, UFS_CREATE);
+	if (fd < 0 || ufs_close(fd) != 0)
+		goto error;
+	start = clock_sec();
+	for (int i = 0; i < DIR_LOOKUPS; ++i) {
+		fd = ufs_open(path, 0);
+		if (fd < 0 || ufs_close(fd) != 0)
+			goto error;
+	}
+	report_ops("open depth 16", DIR_LOOKUPS, clock_sec() - start);
+
+	ufs_delete(path);
+	for (int i = DIR_DEPTH; i > 0; --i) {
+		*strrchr(path, '/') = 0;
+		if (ufs_rmdir(path) != 0)
+			goto error;
+	}
+	start = clock_sec();
+	for (int i = 0; i < NAMESPACE_SIZE; ++i) {
+		snprintf(name, sizeof(name), "dir%d/file%d", i % DIR_COUNT, i);
+		if (ufs_delete(name) != 0)
+			goto error;
+	}
+	for (int i = 0; i < DIR_COUNT; ++i) {
+		snprintf(name, sizeof(name), "dir%d", i);
+		if (ufs_rmdir(name) != 0)
+			goto error;
+	}
+	report_ops("delete in dirs", NAMESPACE_SIZE, clock_sec() - start);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	return -1;
+}
+
+static size_t
+rss_bytes(void)
+{
+	size_t pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+			resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+/** Fill files of the given size and tell the RSS per byte of their data. */
+static int
+bench_memory_size(size_t size, double *ratio)
+{
+	char name[32];
+	size_t count = MEMORY_DATA_SIZE / size;
+	if (count > MEMORY_MAX_FILES)
+		count = MEMORY_MAX_FILES;
+	char *buf = malloc(size);
+	memset(buf, 'x', size);
+	size_t used = rss_bytes();
+	for (size_t i = 0; i < count; ++i) {
+		snprintf(name, sizeof(name), "file%zu", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0 || ufs_write(fd, buf, size) != (ssize_t)size ||
+		    ufs_close(fd) != 0) {
+			fprintf(stderr, "error %d\n", (int)ufs_errno());
+			free(buf);
+			return -1;
+		}
+	}
+	used = rss_bytes() - used;
+	*ratio = (double)used / (size * count);
+	free(buf);
+	return 0;
+}
+
+/**
+ * RSS taken by the files, including all the metadata, divided by the data
+ * size of the files. Each size is measured in a new process, so the memory
+ * freed by the previous benchmarks can't hide the growth. The child sends
+ * the ratio back through a pipe and the parent reports it.
+ */
+static int
+bench_memory(void)
+{
+	static const size_t sizes[] = {1, 100, 1000, 10000, 100000, 1000000};
+	char name[32];
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		int fds[2];
+		if (pipe(fds) != 0)
+			return -1;
+		fflush(stdout);
+		pid_t pid = fork();
+		if (pid < 0)
+			return -1;
+		if (pid == 0) {
+			close(fds[0]);
+			double ratio;
+			if (bench_memory_size(sizes[i], &ratio) != 0 ||
+			    write(fds[1], &ratio, sizeof(ratio)) !=
+			    sizeof(ratio))
+				_exit(1);
+			_exit(0);
+		}
+		close(fds[1]);
+		double ratio;
+		ssize_t rc = read(fds[0], &ratio, sizeof(ratio));
+		close(fds[0]);
+		int status;
+		if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0 || rc != sizeof(ratio))
+			return -1;
+		snprintf(name, sizeof(name), "memory %zuB", sizes[i]);
+		report_value(name, ratio, "x", 2);
+	}
+	return 0;
+}
+
+struct thread_bench {
+	pthread_t thread;
+	int id;
+	bool is_shared;
+	bool failed;
+};
+
+/**
+ * A private file is created, written, closed and deleted, so the threads
+ * contend only for the namespace and the descriptor table. A shared read
+ * opens the one common file and reads a piece of it.
+ */
+static void *
+thread_bench_f(void *arg)
+{
+	struct thread_bench *b = arg;
+	char name[32];
+	char buf[CALL_SIZE];
+	memset(buf, 'x', sizeof(buf));
+	snprintf(name, sizeof(name), "thread%d", b->id);
+	for (int i = 0; i < THREAD_OPS; ++i) {
+		int fd;
+		if (b->is_shared) {
+			fd = ufs_open("shared", 0);
+			if (fd < 0 || ufs_read(fd, buf, sizeof(buf)) !=
+			    (ssize_t)sizeof(buf) || ufs_close(fd) != 0)
+				goto error;
+			continue;
+		}
+		fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0 || ufs_write(fd, buf, sizeof(buf)) !=
+		    (ssize_t)sizeof(buf) || ufs_close(fd) != 0 ||
+		    ufs_delete(name) != 0)
+			goto error;
+	}
+	return NULL;
+error:
+	b->failed = true;
+	return NULL;
+}
+
+static int
+bench_threads_run(int count, bool is_shared)
+{
+	struct thread_bench benches[MAX_THREADS];
+	double start = clock_sec();
+	for (int i = 0; i < count; ++i) {
+		benches[i].id = i;
+		benches[i].is_shared = is_shared;
+		benches[i].failed = false;
+		if (pthread_create(&benches[i].thread, NULL, thread_bench_f,
+				   &benches[i]) != 0)
+			return -1;
+	}
+	bool failed = false;
+	for (int i = 0; i < count; ++i) {
+		pthread_join(benches[i].thread, NULL);
+		failed = failed || benches[i].failed;
+	}
+	if (failed) {
+		fprintf(stderr, "error %d\n", (int)ufs_errno());
+		return -1;
+	}
+	char name[32];
+	snprintf(name, sizeof(name), "%s x%d", is_shared ? "shared read" :
+		 "private file", count);
+	report_ops(name, (size_t)count * THREAD_OPS, clock_sec() - start);
+	return 0;
+}
+
+static int
+bench_threads(void)
+{
+	char *buf = calloc(1, SHARED_FILE_SIZE);
+	int fd = ufs_open("shared", UFS_CREATE);
+	if (fd < 0 || ufs_write(fd, buf, SHARED_FILE_SIZE) != SHARED_FILE_SIZE ||
+	    ufs_close(fd) != 0) {
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	for (int count = 1; count <= MAX_THREADS; count *= 2) {
+		if (bench_threads_run(count, false) != 0 ||
+		    bench_threads_run(count, true) != 0)
+			return -1;
+	}
+	return ufs_delete("shared");
+}
+
+/**
+ * Fill an image with files of the maximal size and save it, then open it
+ * again. The opening reads only the table of the files, the data is read
+ * from the disk on access, so it is compared with the writing of the same
+ * data again.
+ */
+static int
+bench_image(size_t size_mb)
+{
+	const char *path = "/tmp/ufs_bench_image";
+	const size_t call_size = 64 * 1024;
+	const size_t file_count = (size_mb * 1024 * 1024 + FILE_SIZE - 1) / FILE_SIZE;
+	char name[32];
+	char *buf = malloc(call_size);
+	memset(buf, 'x', call_size);
+	ufs_destroy();
+	unlink(path);
+	if (ufs_image_open(path) != 0)
+		goto error;
+
+	double start = clock_sec();
+	for (size_t i = 0; i < file_count; ++i) {
+		snprintf(name, sizeof(name), "file%zu", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		for (size_t done = 0; done < FILE_SIZE; done += call_size) {
+			if (ufs_write(fd, buf, call_size) != (ssize_t)call_size)
+				goto error;
+		}
+		ufs_close(fd);
+	}
+	if (ufs_sync() != 0)
+		goto error;
+	double elapsed = clock_sec() - start;
+	snprintf(name, sizeof(name), "image write %zuMB",
+		 file_count * FILE_SIZE / (1024 * 1024));
+	report_time(name, elapsed);
+	ufs_destroy();
+
+	/* Try to drop the page cache to see a really cold start. */
+	FILE *f = fopen("/proc/sys/vm/drop_caches", "w");
+	if (f != NULL) {
+		fputs("3", f);
+		fclose(f);
+	}
+	start = clock_sec();
+	if (ufs_image_open(path) != 0)
+		goto error;
+	report_time("image open", clock_sec() - start);
+
+	start = clock_sec();
+	int fd = ufs_open("file0", 0);
+	for (size_t done = 0; done < FILE_SIZE; done += call_size) {
+		if (ufs_read(fd, buf, call_size) != (ssize_t)call_size)
+			goto error;
+	}
+	ufs_close(fd);
+	report("image cold read", FILE_SIZE, clock_sec() - start);
+	ufs_destroy();
+	unlink(path);
+	free(buf);
+	return 0;
+error:
+	fprintf(stderr, "error %d\n", (int)ufs_errno());
+	ufs_destroy();
+	unlink(path);
+	free(buf);
+	return -1;
+}
+
+int
+main(int argc, char **argv)
+{
+	/*
+	 * --json prints all the results as one document to compare the builds.
+	 * The image size in MB can be given, it takes as much disk space.
+	 */
+	size_t image_mb = 1024;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--json") == 0)
+			is_json = true;
+		else
+			image_mb = strtoull(argv[i], NULL, 10);
+	}
+	report_begin();
+	int rc = bench_memory();
+	if (rc == 0)
+		rc = bench_max_file();
+	if (rc == 0)
+		rc = bench_sequential();
+	if (rc == 0)
+		rc = bench_random_read();
+	if (rc == 0)
+		rc = bench_compress();
+	if (rc == 0)
+		rc = bench_vectored();
+	if (rc == 0)
+		rc = bench_borrow();
+	if (rc == 0)
+		rc = bench_clone();
+	if (rc == 0)
+		rc = bench_sparse();
+	if (rc == 0)
+		rc = bench_resize_storm();
+	if (rc == 0)
+		rc = bench_block_churn();
+	if (rc == 0)
+		rc = bench_namespace();
+	if (rc == 0)
+		rc = bench_namespace_scale();
+	if (rc == 0)
+		rc = bench_dirs();
+	if (rc == 0)
+		rc = bench_threads();
+	if (rc == 0)
+		rc = bench_image(image_mb);
+	ufs_destroy();
+	report_end(rc);
+	return rc == 0 ? 0 : 1;
+}
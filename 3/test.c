@@ -1,8 +1,15 @@
 #include "userfs.h"
 #include "unit.h"
+#include "thread_pool.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -70,6 +77,34 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_fd_reuse(void)
+{
+	unit_test_start();
+
+	const int count = 200;
+	int fds[count];
+	for (int i = 0; i < count; ++i)
+		fds[i] = ufs_open("file", UFS_CREATE);
+	bool ok = true;
+	for (int i = 1; i < count && ok; ++i)
+		ok = fds[i] == fds[i - 1] + 1;
+	unit_check(ok, "descriptors go in a row");
+	int base = fds[0];
+	unit_fail_if(ufs_close(fds[130]) != 0);
+	unit_fail_if(ufs_close(fds[5]) != 0);
+	unit_fail_if(ufs_close(fds[70]) != 0);
+	unit_check(ufs_open("file", 0) == base + 5, "the lowest free is taken");
+	unit_check(ufs_open("file", 0) == base + 70, "then the next one");
+	unit_check(ufs_open("file", 0) == base + 130, "and the next");
+	unit_check(ufs_open("file", 0) == base + count, "then a new one");
+	for (int i = 0; i <= count; ++i)
+		unit_fail_if(ufs_close(base + i) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -292,6 +327,74 @@ test_delete(void)
 	unit_test_finish();
 }
 
+static void
+test_stress_names(void)
+{
+	unit_test_start();
+
+	const int count = 20000;
+	char name[16], buf[16];
+	unit_msg("create %d files, the namespace is resized on the way", count);
+	for (int i = 0; i < count; ++i) {
+		int name_len = sprintf(name, "file%d", i) + 1;
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, name, name_len) != name_len);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	unit_msg("delete every other file, keep one of them opened");
+	int ghost = ufs_open("file0", 0);
+	unit_fail_if(ghost == -1);
+	for (int i = 0; i < count; i += 2) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_msg("the deleted are gone, the rest keep their data");
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		int name_len = sprintf(name, "file%d", i) + 1;
+		int fd = ufs_open(name, 0);
+		if (i % 2 == 0) {
+			ok = fd == -1 && ufs_errno() == UFS_ERR_NO_FILE;
+			continue;
+		}
+		ok = fd != -1 && ufs_read(fd, buf, sizeof(buf)) == name_len &&
+		     memcmp(buf, name, name_len) == 0 && ufs_close(fd) == 0;
+	}
+	unit_check(ok, "lookups are correct");
+	unit_check(ufs_read(ghost, buf, sizeof(buf)) == 6 &&
+		   strcmp(buf, "file0") == 0, "the deleted opened file lives");
+	int fd = ufs_open("file0", UFS_CREATE);
+	unit_check(fd != -1 && ufs_read(fd, buf, sizeof(buf)) == 0,
+		   "its name is free for a new file");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(ghost) != 0);
+	unit_fail_if(ufs_delete("file0") != 0);
+	for (int i = 1; i < count; i += 2) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+
+	unit_msg("delete the files already moved by a resize in progress");
+	ok = true;
+	for (int i = 0; i < 4 * count && ok; ++i) {
+		sprintf(name, "file%d", i);
+		fd = ufs_open(name, UFS_CREATE);
+		ok = fd != -1 && ufs_close(fd) == 0;
+		if (ok && i % 7 == 0) {
+			sprintf(name, "file%d", i / 2);
+			ok = ufs_delete(name) == 0 && ufs_open(name, 0) == -1;
+		}
+	}
+	unit_check(ok, "the deleted are not found");
+	for (int i = 0; i < 4 * count; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+
+	unit_test_finish();
+}
+
 static void
 test_max_file_size(void)
 {
@@ -469,6 +572,904 @@ test_resize(void)
 #endif
 }
 
+static void
+test_sparse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+
+	const size_t size = 10 * 1024 * 1024;
+	char *buf = malloc(size);
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_resize(fd, size) == 0, "grow to 10MB");
+	memset(buf, 'x', size);
+	unit_check(ufs_read(fd, buf, size) == (ssize_t)size, "read it");
+	bool ok = true;
+	for (size_t i = 0; i < size && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "the hole is zeros");
+
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_read(fd2, buf, size / 2 + 3) != (ssize_t)(size / 2 + 3));
+	unit_check(ufs_write(fd2, "abc", 3) == 3, "write into the middle");
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(ufs_read(fd2, buf, size) != (ssize_t)size);
+	unit_check(buf[size / 2 + 2] == 0 && buf[size / 2 + 6] == 0 &&
+		   memcmp(buf + size / 2 + 3, "abc", 3) == 0,
+		   "the data is there, zeros around it");
+
+	unit_check(ufs_resize(fd, size / 2 + 4) == 0, "shrink into the data");
+	unit_check(ufs_resize(fd, size) == 0, "and grow back");
+	unit_fail_if(ufs_close(fd2) != 0);
+	fd2 = ufs_open("file", 0);
+	unit_fail_if(ufs_read(fd2, buf, size) != (ssize_t)size);
+	unit_check(memcmp(buf + size / 2 + 3, "a\0\0", 3) == 0,
+		   "the cut data does not come back");
+
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(buf);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_small_appends(void)
+{
+	unit_test_start();
+
+	/* Cross all the block size classes and a block border. */
+	const int size = 70 * 1024;
+	char *ref = malloc(size), *buf = malloc(size);
+	for (int i = 0; i < size; ++i)
+		ref[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	bool ok = true;
+	for (int done = 0, step = 1; done < size && ok; done += step, ++step) {
+		if (step > size - done)
+			step = size - done;
+		ok = ufs_write(fd, ref + done, step) == step;
+	}
+	unit_check(ok, "append with growing pieces");
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(ufs_read(fd2, buf, size) == size &&
+		   memcmp(buf, ref, size) == 0, "read it all back");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(ref);
+	free(buf);
+
+	unit_test_finish();
+}
+
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "0123456789", 10) != 10);
+	unit_check(ufs_pwrite(fd, "ab", 2, 3) == 2, "pwrite");
+	char buf[100];
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 2) == 8, "pread");
+	unit_check(memcmp(buf, "2ab56789", 8) == 0, "data is written at offset");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 10) == 0, "pread at EOF");
+	unit_check(ufs_write(fd, "x", 1) == 1, "position is not moved by them");
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), 0) != 11);
+	unit_check(memcmp(buf, "012ab56789x", 11) == 0, "write continues at 10");
+
+	unit_check(ufs_pwrite(fd, "end", 3, 100000) == 3,
+		   "pwrite behind the end");
+	char *big = malloc(100003);
+	unit_fail_if(ufs_pread(fd, big, 100003, 0) != 100003);
+	bool ok = memcmp(big + 100000, "end", 3) == 0;
+	for (int i = 11; i < 100000 && ok; ++i)
+		ok = big[i] == 0;
+	unit_check(ok, "makes a hole");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	/* Vectors crossing the block border, with empty buffers among them. */
+	const int size = 70000;
+	for (int i = 0; i < size; ++i)
+		big[i] = 'a' + i % 26;
+	struct ufs_iovec wv[] = {
+		{big, 10}, {big + 10, 0}, {big + 10, 65000}, {big + 65010, 4990},
+	};
+	fd = ufs_open("file", UFS_CREATE);
+	unit_check(ufs_writev(fd, wv, 4) == size, "writev");
+	unit_check(ufs_writev(fd, wv, 0) == 0, "empty writev");
+	unit_fail_if(ufs_close(fd) != 0);
+	char *back = malloc(size);
+	struct ufs_iovec rv[] = {
+		{back, 65535}, {back + 65535, 0}, {back + 65535, 2}, {back + 65537, 10000},
+	};
+	fd = ufs_open("file", 0);
+	unit_check(ufs_readv(fd, rv, 4) == size, "readv");
+	unit_check(memcmp(big, back, size) == 0, "data is the same");
+	unit_check(ufs_readv(fd, rv, 4) == 0, "readv at EOF");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(back);
+	free(big);
+
+	unit_check(ufs_pread(fd, buf, 1, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "pread of a closed fd");
+#if NEED_OPEN_FLAGS
+	fd = ufs_open("file", UFS_CREATE | UFS_READ_ONLY);
+	unit_check(ufs_pwrite(fd, "a", 1, 0) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "pwrite of read only");
+	unit_check(ufs_writev(fd, wv, 1) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_PERMISSION, "writev of read only");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+#endif
+
+	unit_test_finish();
+}
+
+static void
+test_borrow(void)
+{
+	unit_test_start();
+
+	const int size = 100000;
+	char *buf = malloc(size);
+	for (int i = 0; i < size; ++i)
+		buf[i] = 'a' + i % 26;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, buf, size) != size);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	fd = ufs_open("file", 0);
+	struct ufs_iovec iov[4];
+	int cnt = 4;
+	unit_check(ufs_read_borrow(fd, 1000000, iov, &cnt) == size,
+		   "borrow the whole file");
+	unit_check(cnt == 2 && iov[0].len == 65536 &&
+		   iov[1].len == (size_t)size - 65536, "by blocks");
+	unit_check(memcmp(iov[0].base, buf, iov[0].len) == 0 &&
+		   memcmp(iov[1].base, buf + 65536, iov[1].len) == 0,
+		   "data is the same");
+	cnt = 4;
+	unit_check(ufs_read_borrow(fd, 10, iov, &cnt) == 0 && cnt == 0,
+		   "the position moved to EOF");
+	unit_check(ufs_close(fd) == -1 && ufs_errno() == UFS_ERR_BUSY,
+		   "can't close with a borrow");
+	unit_check(ufs_read_release(fd) == 0, "release");
+	unit_check(ufs_read_release(fd) == -1, "only once");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	/* One buffer, then a hole behind a small block. */
+	fd = ufs_open("file", 0);
+	cnt = 1;
+	unit_check(ufs_read_borrow(fd, size, iov, &cnt) == 65536 && cnt == 1,
+		   "borrow is limited by the buffer count");
+	unit_fail_if(ufs_read_release(fd) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	unit_fail_if(ufs_pwrite(fd, "z", 1, 3 * 65536) != 1);
+	int rfd = ufs_open("file", 0);
+	cnt = 4;
+	unit_check(ufs_read_borrow(rfd, 2 * 65536, iov, &cnt) == 2 * 65536 &&
+		   cnt == 2, "borrow a small block and a hole");
+	bool ok = memcmp(iov[0].base, "abc", 3) == 0;
+	for (int i = 3; i < 65536 && ok; ++i)
+		ok = ((char *)iov[0].base)[i] == 0;
+	for (int i = 0; i < 65536 && ok; ++i)
+		ok = ((char *)iov[1].base)[i] == 0;
+	unit_check(ok, "zeros behind the data and in the hole");
+	unit_fail_if(ufs_write(fd, buf, 60000) != 60000);
+	unit_check(memcmp((char *)iov[0].base + 3, buf, 60000) == 0,
+		   "a write to the borrowed block is visible");
+#if NEED_RESIZE
+	unit_check(ufs_resize(fd, 10) == -1 && ufs_errno() == UFS_ERR_BUSY,
+		   "can't truncate under a borrow");
+	unit_check(ufs_resize(fd, 4 * 65536) == 0, "can grow");
+#endif
+	unit_fail_if(ufs_read_release(rfd) != 0);
+#if NEED_RESIZE
+	unit_check(ufs_resize(fd, 10) == 0, "truncate after the release");
+#endif
+	unit_fail_if(ufs_close(rfd) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	free(buf);
+
+	unit_test_finish();
+}
+
+static bool
+file_equals(const char *name, const char *data, int size)
+{
+	char *buf = malloc(size + 1);
+	int fd = ufs_open(name, 0);
+	bool ok = fd != -1 && ufs_read(fd, buf, size + 1) == size &&
+		  memcmp(buf, data, size) == 0;
+	ufs_close(fd);
+	free(buf);
+	return ok;
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	const int size = 200000;
+	char *data = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("src", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_clone("src", "dst") == 0, "clone");
+	unit_check(file_equals("dst", data, size), "the copy is the same");
+
+	fd = ufs_open("dst", 0);
+	unit_fail_if(ufs_pwrite(fd, "X", 1, 70000) != 1);
+	unit_check(file_equals("src", data, size), "a write to the copy does "
+		   "not change the source");
+	/* A write from a block start copies only the rest of the block. */
+	unit_fail_if(ufs_pwrite(fd, data + 131072, 10, 131072) != 10);
+	data[70000] = 'X';
+	unit_check(file_equals("dst", data, size), "the copy keeps the rest");
+	data[70000] = 'a' + 70000 % 26;
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("src", 0);
+	unit_fail_if(ufs_pwrite(fd, "Y", 1, 10) != 1);
+	unit_fail_if(ufs_close(fd) != 0);
+	data[70000] = 'X';
+	unit_check(file_equals("dst", data, size), "and vice versa");
+#if NEED_RESIZE
+	fd = ufs_open("dst", 0);
+	unit_fail_if(ufs_resize(fd, 100) != 0);
+	unit_fail_if(ufs_resize(fd, size) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	data[70000] = 'a' + 70000 % 26;
+	data[10] = 'Y';
+	unit_check(file_equals("src", data, size), "truncation of the copy "
+		   "does not cut the source");
+#endif
+	unit_fail_if(ufs_delete("src") != 0);
+
+	/* Replace a file opened behind the new size. */
+	fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_check(ufs_clone("dst", "big") == 0, "clone over a file");
+	unit_check(ufs_write(fd, "end", 3) == 3, "its descriptor works");
+	char buf[8];
+	unit_check(ufs_pread(fd, buf, sizeof(buf), size - 2) == 5 &&
+		   memcmp(buf + 2, "end", 3) == 0,
+		   "and is moved to the new end");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_clone("missing", "x") == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "clone of a missing file");
+	unit_fail_if(ufs_delete("dst") != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_snapshot(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("a", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "aaa", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("b", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "bbb", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	struct ufs_snapshot *snap = ufs_snapshot();
+	unit_check(snap != NULL, "snapshot");
+
+	fd = ufs_open("a", 0);
+	unit_fail_if(ufs_write(fd, "xxxx", 4) != 4);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+	int cfd = ufs_open("c", UFS_CREATE);
+	unit_fail_if(ufs_write(cfd, "ccc", 3) != 3);
+
+	for (int i = 0; i < 2; ++i) {
+		unit_check(ufs_restore(snap) == 0, "restore");
+		unit_check(file_equals("a", "aaa", 3), "a changed file is back");
+		unit_check(file_equals("b", "bbb", 3), "a deleted one too");
+		unit_check(ufs_open("c", 0) == -1, "a new one is gone");
+		fd = ufs_open("a", 0);
+		unit_fail_if(ufs_write(fd, "zz", 2) != 2);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	char buf[4];
+	unit_check(ufs_pread(cfd, buf, sizeof(buf), 0) == 3 &&
+		   memcmp(buf, "ccc", 3) == 0, "but its descriptor works");
+	unit_fail_if(ufs_close(cfd) != 0);
+	ufs_snapshot_delete(snap);
+	unit_check(file_equals("a", "zza", 3), "files survive the snapshot");
+	unit_fail_if(ufs_delete("a") != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+
+	unit_test_finish();
+}
+
+/** Count the entries of the directory, -1 if it can't be opened. */
+static int
+dir_count(const char *path, const char *name, bool *is_dir)
+{
+	struct ufs_dir *dir = ufs_opendir(path);
+	if (dir == NULL)
+		return -1;
+	int count = 0;
+	const struct ufs_dirent *e;
+	while ((e = ufs_readdir(dir)) != NULL) {
+		++count;
+		if (name != NULL && strcmp(e->name, name) == 0)
+			*is_dir = e->is_dir;
+	}
+	ufs_closedir(dir);
+	return count;
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_mkdir("d") == 0, "mkdir");
+	unit_check(ufs_mkdir("d") == -1 && ufs_errno() == UFS_ERR_EXISTS,
+		   "mkdir of an existing one");
+	unit_check(ufs_mkdir("x/y") == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "mkdir without a parent");
+	int fd = ufs_open("x/f", UFS_CREATE);
+	unit_check(fd == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "no file without a parent");
+	unit_check(ufs_open("/f", UFS_CREATE) == -1 &&
+		   ufs_open("d/", UFS_CREATE) == -1 &&
+		   ufs_open("d//f", UFS_CREATE) == -1, "no empty parts in a path");
+	fd = ufs_open("d/f", UFS_CREATE);
+	unit_check(fd != -1, "a file in a directory");
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_open("d/f/g", UFS_CREATE) == -1 &&
+		   ufs_errno() == UFS_ERR_NOT_DIR, "a file is not a directory");
+	unit_check(ufs_open("d", 0) == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "a directory is not opened as a file");
+	unit_check(ufs_delete("d") == -1 && ufs_errno() == UFS_ERR_IS_DIR,
+		   "nor deleted as one");
+	unit_check(ufs_rmdir("d/f") == -1 && ufs_errno() == UFS_ERR_NOT_DIR,
+		   "rmdir of a file");
+	unit_fail_if(ufs_mkdir("d/sub") != 0);
+	unit_check(ufs_rmdir("d") == -1 && ufs_errno() == UFS_ERR_NOT_EMPTY,
+		   "rmdir of a not empty one");
+
+	enum { COUNT = 100 };
+	char name[32];
+	for (int i = 0; i < COUNT; ++i) {
+		sprintf(name, "d/sub/file%d", i);
+		fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	bool is_dir = false;
+	unit_check(dir_count("d", "sub", &is_dir) == 2 && is_dir, "list");
+	is_dir = true;
+	unit_check(dir_count("d/sub", "file7", &is_dir) == COUNT && !is_dir,
+		   "list a big one");
+	is_dir = false;
+	unit_check(dir_count("/", "d", &is_dir) > 0 && is_dir, "list the root");
+	unit_check(ufs_opendir("d/f") == NULL && ufs_errno() == UFS_ERR_NOT_DIR,
+		   "a file is not listed");
+
+	/* The restored directories come with their entries. */
+	struct ufs_snapshot *snap = ufs_snapshot();
+	for (int i = 0; i < COUNT; ++i) {
+		sprintf(name, "d/sub/file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(dir_count("d/sub", NULL, NULL) == 0, "all deleted");
+	unit_check(ufs_rmdir("d/sub") == 0, "rmdir");
+	unit_check(ufs_opendir("d/sub") == NULL &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "it is gone");
+	unit_check(ufs_restore(snap) == 0, "restore");
+	ufs_snapshot_delete(snap);
+	unit_check(dir_count("d/sub", NULL, NULL) == COUNT, "restored");
+	unit_check(file_equals("d/f", "abc", 3), "with the data");
+
+	for (int i = 0; i < COUNT; ++i) {
+		sprintf(name, "d/sub/file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_fail_if(ufs_rmdir("d/sub") != 0);
+	unit_fail_if(ufs_delete("d/f") != 0);
+	unit_check(ufs_rmdir("d") == 0, "rmdir of an emptied one");
+	unit_check(ufs_mkdir("d") == 0 && dir_count("d", NULL, NULL) == 0,
+		   "a new one is empty");
+	unit_fail_if(ufs_rmdir("d") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_block_reuse(void)
+{
+#if NEED_RESIZE
+	unit_test_start();
+
+	const int size = 1024 * 1024;
+	char *buf = malloc(size);
+	for (int limit = 0; limit <= 4; limit += 4) {
+		unit_msg("block cache limit %d", limit);
+		ufs_set_block_cache_limit(limit);
+		memset(buf, 'x', size);
+		int fd = ufs_open("dirty", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, buf, size) != size);
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("dirty") != 0);
+
+		/* Fill only the end of a block, it is allocated whole. */
+		fd = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_resize(fd, size) != 0);
+		unit_fail_if(ufs_read(fd, buf, 60000) != 60000);
+		unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+		unit_fail_if(ufs_close(fd) != 0);
+		fd = ufs_open("file", 0);
+		unit_fail_if(ufs_read(fd, buf, size) != size);
+		bool ok = memcmp(buf + 60000, "abc", 3) == 0;
+		for (int i = 0; i < size && ok; ++i)
+			ok = buf[i] == 0 || (i >= 60000 && i < 60003);
+		unit_check(ok, "a reused block has no old data");
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("file") != 0);
+
+		/* Write a part of a block which is allocated whole. */
+		fd = ufs_open("dirty", UFS_CREATE);
+		memset(buf, 'x', size);
+		unit_fail_if(ufs_write(fd, buf, size) != size);
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("dirty") != 0);
+		fd = ufs_open("file", UFS_CREATE);
+		unit_fail_if(ufs_write(fd, buf, 40000) != 40000);
+		unit_fail_if(ufs_resize(fd, 65536) != 0);
+		unit_fail_if(ufs_close(fd) != 0);
+		fd = ufs_open("file", 0);
+		unit_fail_if(ufs_read(fd, buf, size) != 65536);
+		ok = true;
+		for (int i = 40000; i < 65536 && ok; ++i)
+			ok = buf[i] == 0;
+		unit_check(ok, "so is a partially written one");
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("file") != 0);
+	}
+	ufs_set_block_cache_limit(256);
+	free(buf);
+
+	unit_test_finish();
+#endif
+}
+
+enum {
+	THREAD_COUNT = 8,
+	THREAD_ITERATIONS = 200,
+	THREAD_APPEND_SIZE = 100,
+};
+
+static int shared_fd;
+
+static void *
+thread_worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	char name[32], data[THREAD_APPEND_SIZE], buf[THREAD_APPEND_SIZE];
+	snprintf(name, sizeof(name), "thread%d", id);
+	memset(data, 'a' + id, sizeof(data));
+	for (int i = 0; i < THREAD_ITERATIONS; ++i) {
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1 || ufs_write(fd, data, sizeof(data)) != sizeof(data))
+			return (void *)1;
+		if (ufs_close(fd) != 0 || (fd = ufs_open(name, 0)) == -1)
+			return (void *)1;
+		if (ufs_read(fd, buf, sizeof(buf)) != sizeof(buf) ||
+		    memcmp(buf, data, sizeof(buf)) != 0)
+			return (void *)1;
+		if (ufs_close(fd) != 0 || ufs_delete(name) != 0)
+			return (void *)1;
+		/* The calls on one descriptor never interleave. */
+		if (ufs_write(shared_fd, data, sizeof(data)) != sizeof(data))
+			return (void *)1;
+		/* The error is per thread. */
+		if (ufs_open("missing", 0) != -1 || ufs_errno() != UFS_ERR_NO_FILE)
+			return (void *)1;
+	}
+	return NULL;
+}
+
+struct reader_ctx {
+	int fd;
+	int size;
+	int reads;
+	bool failed;
+};
+
+static void *
+reader_f(void *arg)
+{
+	struct reader_ctx *ctx = arg;
+	char *buf = malloc(ctx->size);
+	while (true) {
+		ssize_t rc = ufs_pread(ctx->fd, buf, ctx->size, 0);
+		if (rc == -1) {
+			ctx->failed = ufs_errno() != UFS_ERR_NO_FILE;
+			break;
+		}
+		if (rc != ctx->size) {
+			ctx->failed = true;
+			break;
+		}
+		__atomic_add_fetch(&ctx->reads, 1, __ATOMIC_RELAXED);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	shared_fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(shared_fd == -1);
+	pthread_t threads[THREAD_COUNT];
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		unit_fail_if(pthread_create(&threads[i], NULL, thread_worker,
+					    (void *)(intptr_t)i) != 0);
+	}
+	int ok = 0;
+	for (int i = 0; i < THREAD_COUNT; ++i) {
+		void *rc;
+		unit_fail_if(pthread_join(threads[i], &rc) != 0);
+		ok += rc == NULL;
+	}
+	unit_check(ok == THREAD_COUNT, "files of each thread are intact");
+
+	const int size = THREAD_COUNT * THREAD_ITERATIONS * THREAD_APPEND_SIZE;
+	char *buf = malloc(size + 1);
+	int fd = ufs_open("shared", 0);
+	unit_check(ufs_read(fd, buf, size + 1) == size,
+		   "no append to the shared descriptor is lost");
+	bool is_whole = true;
+	for (int i = 0; i < size && is_whole; i += THREAD_APPEND_SIZE) {
+		for (int j = 1; j < THREAD_APPEND_SIZE && is_whole; ++j)
+			is_whole = buf[i + j] == buf[i];
+	}
+	unit_check(is_whole, "the appends do not mix");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(shared_fd) != 0);
+	unit_fail_if(ufs_delete("shared") != 0);
+	free(buf);
+
+	unit_msg("the descriptors are opened and closed under long reads");
+	const int big_size = 1024 * 1024;
+	buf = calloc(1, big_size);
+	struct reader_ctx reader = {0};
+	reader.size = big_size;
+	reader.fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(reader.fd == -1);
+	unit_fail_if(ufs_write(reader.fd, buf, big_size) != big_size);
+	pthread_t thread;
+	unit_fail_if(pthread_create(&thread, NULL, reader_f, &reader) != 0);
+	while (__atomic_load_n(&reader.reads, __ATOMIC_RELAXED) == 0)
+		sched_yield();
+	ok = 0;
+	for (int i = 0; i < 100; ++i) {
+		fd = ufs_open("small", UFS_CREATE);
+		ok += fd != -1 && ufs_close(fd) == 0;
+	}
+	unit_check(ok == 100, "other files are opened and closed");
+	unit_check(ufs_close(reader.fd) == 0, "close under a read");
+	unit_fail_if(pthread_join(thread, NULL) != 0);
+	unit_check(!reader.failed, "the reads end with no descriptor");
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	free(buf);
+
+	unit_test_finish();
+}
+
+static void *
+blocker_f(void *arg)
+{
+	pthread_mutex_lock(arg);
+	pthread_mutex_unlock(arg);
+	return NULL;
+}
+
+static void
+test_async(void)
+{
+	unit_test_start();
+
+	struct thread_pool *pool;
+	unit_fail_if(thread_pool_new(1, &pool) != 0);
+	/* Hold the only thread so the calls stay queued for a while. */
+	pthread_mutex_t blocker_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct thread_task *blocker;
+	pthread_mutex_lock(&blocker_lock);
+	unit_fail_if(thread_task_new(&blocker, blocker_f, &blocker_lock) != 0);
+	unit_fail_if(thread_pool_push_task(pool, blocker) != 0);
+	unit_check(ufs_write_async(pool, 100500, "a", 1) == NULL &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "no async call on a bad fd");
+
+	/* The calls on a descriptor go in order, so the chunks do. */
+	enum { COUNT = 200, CHUNK = 1000 };
+	char *data = malloc(COUNT * CHUNK);
+	for (int i = 0; i < COUNT * CHUNK; ++i)
+		data[i] = 'a' + i / CHUNK % 26;
+	struct ufs_async *ops[COUNT];
+	int fd = ufs_open("file", UFS_CREATE);
+	for (int i = 0; i < COUNT; ++i)
+		ops[i] = ufs_write_async(pool, fd, data + i * CHUNK, CHUNK);
+	unit_check(ufs_close(fd) == -1 && ufs_errno() == UFS_ERR_BUSY,
+		   "can't close with not joined calls");
+	pthread_mutex_unlock(&blocker_lock);
+	unit_fail_if(thread_task_join(blocker, NULL) != 0);
+	unit_fail_if(thread_task_delete(blocker) != 0);
+	bool ok = true;
+	for (int i = COUNT - 1; i >= 0; --i)
+		ok = ok && ops[i] != NULL && ufs_async_join(ops[i]) == CHUNK;
+	unit_check(ok, "async writes");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(file_equals("file", data, COUNT * CHUNK), "in order");
+
+	char *buf = malloc(COUNT * CHUNK);
+	fd = ufs_open("file", 0);
+	for (int i = 0; i < COUNT; ++i)
+		ops[i] = ufs_read_async(pool, fd, buf + i * CHUNK, CHUNK);
+	while (!ufs_async_is_done(ops[COUNT - 1]))
+		sched_yield();
+	for (int i = 0; i < COUNT; ++i)
+		ok = ok && ufs_async_join(ops[i]) == CHUNK;
+	unit_check(ok && memcmp(buf, data, COUNT * CHUNK) == 0, "async reads");
+	unit_fail_if(ufs_close(fd) != 0);
+
+	struct ufs_async *op = ufs_delete_async(pool, "file");
+	unit_check(ufs_async_join(op) == 0, "async delete");
+	op = ufs_delete_async(pool, "file");
+	unit_check(ufs_async_join(op) == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "its error");
+	unit_fail_if(thread_pool_delete(pool) != 0);
+	free(buf);
+	free(data);
+
+	unit_test_finish();
+}
+
+struct compress_race_ctx {
+	bool is_stopped;
+	int failed;
+};
+
+static void *
+compress_race_f(void *arg)
+{
+	struct compress_race_ctx *ctx = arg;
+	while (!__atomic_load_n(&ctx->is_stopped, __ATOMIC_RELAXED))
+		ufs_compress_cold(0);
+	return NULL;
+}
+
+static void *
+create_race_f(void *arg)
+{
+	struct compress_race_ctx *ctx = arg;
+	for (int i = 0; i < 2000; ++i) {
+		int fd = ufs_open("race", UFS_CREATE);
+		if (fd == -1 || ufs_close(fd) != 0) {
+			__atomic_add_fetch(&ctx->failed, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (ufs_delete("race") != 0 && ufs_errno() != UFS_ERR_NO_FILE)
+			__atomic_add_fetch(&ctx->failed, 1, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static void
+test_compress(void)
+{
+	unit_test_start();
+
+	/* Text which compresses well, and a block of noise which does not. */
+	const int size = 300000;
+	const int noise = 100000;
+	char *data = malloc(size + noise);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26 + (i % 1000 == 0);
+	srand(1);
+	for (int i = size; i < size + noise; ++i)
+		data[i] = rand();
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, size + noise) != size + noise);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	struct ufs_compress_stat stat, total;
+	unit_check(ufs_compress_cold(1000) == 0, "fresh blocks are not cold");
+	int count = ufs_compress_cold(0);
+	unit_check(count > 0, "compressed");
+	fd = ufs_open("file", 0);
+	unit_fail_if(ufs_compress_stat(fd, &stat) != 0);
+	ufs_compress_stat_total(&total);
+	unit_check(stat.block_count == (size_t)count &&
+		   stat.packed_size * 4 < stat.data_size, "the text is small");
+	unit_check(stat.data_size < (size_t)size + noise, "the noise is not");
+	unit_check(total.block_count == stat.block_count &&
+		   total.packed_size == stat.packed_size, "total is the same");
+	unit_check(ufs_compress_cold(0) == 0, "the noise is not tried again");
+
+	/* The clone shares the compressed blocks and unpacks its own. */
+	unit_check(ufs_clone("file", "copy") == 0, "clone");
+	unit_check(file_equals("copy", data, size + noise), "the copy reads");
+	ufs_compress_stat_total(&total);
+	unit_check(total.block_count == stat.block_count, "the source is "
+		   "still compressed");
+	unit_check(ufs_pwrite(fd, "X", 1, 70000) == 1, "write");
+	unit_fail_if(ufs_compress_stat(fd, &stat) != 0);
+	unit_check(stat.block_count == (size_t)count - 1, "the written block "
+		   "is plain");
+	data[70000] = 'X';
+	unit_check(file_equals("file", data, size + noise), "the write is "
+		   "there");
+	unit_fail_if(ufs_compress_stat(fd, &stat) != 0);
+	unit_check(stat.block_count == 0, "and the read ones");
+	unit_check(ufs_compress_stat(-1, &stat) == -1 &&
+		   ufs_errno() == UFS_ERR_NO_FILE, "stat of a bad descriptor");
+
+	struct ufs_iovec iov[2];
+	int cnt = 2;
+	unit_fail_if(ufs_compress_cold(0) == 0);
+	unit_check(ufs_read_borrow(fd, 100000, iov, &cnt) == 100000 &&
+		   memcmp(iov[0].base, data, iov[0].len) == 0 &&
+		   memcmp(iov[1].base, data + iov[0].len, iov[1].len) == 0,
+		   "borrow of the compressed blocks");
+	unit_check(ufs_compress_cold(0) == 0, "borrowed file is not touched");
+	unit_fail_if(ufs_read_release(fd) != 0);
+#if NEED_RESIZE
+	unit_fail_if(ufs_compress_cold(0) == 0);
+	unit_check(ufs_resize(fd, 150000) == 0, "shrink into a compressed "
+		   "block");
+	unit_check(ufs_resize(fd, size) == 0, "and grow back");
+	memset(data + 150000, 0, size - 150000);
+	unit_check(file_equals("file", data, size), "the tail is zeros");
+#endif
+	unit_fail_if(ufs_close(fd) != 0);
+
+	unit_check(ufs_compress_start(0) == 0, "start in the background");
+	unit_check(ufs_compress_start(0) == -1 &&
+		   ufs_errno() == UFS_ERR_BUSY, "only once");
+	for (int i = 0; i < 500; ++i) {
+		ufs_compress_stat_total(&total);
+		if (total.block_count > stat.block_count)
+			break;
+		usleep(10000);
+	}
+	unit_check(total.block_count > stat.block_count, "the copy is "
+		   "compressed too");
+	ufs_compress_stop();
+	ufs_compress_stop();
+	unit_fail_if(ufs_delete("file") != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	unit_msg("the compressor walks the files created on one name");
+	struct compress_race_ctx ctx = {0};
+	pthread_t compressor, creators[4];
+	unit_fail_if(pthread_create(&compressor, NULL, compress_race_f,
+				    &ctx) != 0);
+	for (int i = 0; i < 4; ++i) {
+		unit_fail_if(pthread_create(&creators[i], NULL, create_race_f,
+					    &ctx) != 0);
+	}
+	for (int i = 0; i < 4; ++i)
+		unit_fail_if(pthread_join(creators[i], NULL) != 0);
+	__atomic_store_n(&ctx.is_stopped, true, __ATOMIC_RELAXED);
+	unit_fail_if(pthread_join(compressor, NULL) != 0);
+	unit_check(ctx.failed == 0, "the creates do not fail");
+	ufs_compress_stat_total(&total);
+	unit_check(total.block_count == 0 && total.packed_size == 0,
+		   "all freed");
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_image(void)
+{
+	unit_test_start();
+
+	/* Start from the empty file system, the image takes it whole. */
+	ufs_destroy();
+	unit_check(ufs_sync() == -1 && ufs_errno() == UFS_ERR_NO_FILE,
+		   "no sync without an image");
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/ufs_test_image_%d", (int)getpid());
+	unlink(path);
+	unit_check(ufs_image_open(path) == 0, "open a new image");
+
+	/* Big enough to take a few slab regions of the image. */
+	const int size = 5 * 1024 * 1024 + 100;
+	char *data = malloc(size);
+	for (int i = 0; i < size; ++i)
+		data[i] = 'a' + i % 26;
+	int fd = ufs_open("a", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, data, size) != size);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_clone("a", "b") != 0);
+	fd = ufs_open("hole", UFS_CREATE);
+	unit_fail_if(ufs_pwrite(fd, "end", 3, size) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_mkdir("dir") != 0);
+	fd = ufs_open("dir/file", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_sync() == 0, "sync");
+
+	/* The changes after the checkpoint are lost without a sync. */
+	fd = ufs_open("a", 0);
+	unit_fail_if(ufs_write(fd, "xxx", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("lost", UFS_CREATE);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_image_open(path) == -1 && ufs_errno() == UFS_ERR_BUSY,
+		   "one image at a time");
+	ufs_destroy();
+
+	unit_check(ufs_image_open(path) == 0, "open the image again");
+	unit_check(file_equals("a", data, size), "a file is loaded");
+	unit_check(file_equals("b", data, size), "its clone too");
+	unit_check(ufs_open("lost", 0) == -1, "not synced file is not there");
+	char *buf = calloc(size + 3, 1);
+	memcpy(buf + size, "end", 3);
+	unit_check(file_equals("hole", buf, size + 3), "a hole reads zeros");
+	unit_check(dir_count("dir", NULL, NULL) == 1 &&
+		   file_equals("dir/file", "abc", 3), "directories are loaded");
+
+	/* Change the loaded files, the clones must stay apart. */
+	fd = ufs_open("b", 0);
+	unit_fail_if(ufs_write(fd, "bbb", 3) != 3);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("hole") != 0);
+	unit_check(ufs_sync() == 0, "sync again");
+	ufs_destroy();
+	unit_check(ufs_image_open(path) == 0, "open the image once more");
+	unit_check(file_equals("a", data, size), "a clone is not changed");
+	memcpy(data, "bbb", 3);
+	unit_check(file_equals("b", data, size), "the changed one is saved");
+	unit_check(ufs_open("hole", 0) == -1, "a deleted file is gone");
+	ufs_destroy();
+
+	unlink(path);
+	free(buf);
+	free(data);
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -490,9 +1491,23 @@ main(int argc, char **argv)
 	test_io();
 	test_delete();
 	test_stress_open();
+	test_fd_reuse();
+	test_stress_names();
+	test_small_appends();
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_sparse();
+	test_positional_io();
+	test_borrow();
+	test_clone();
+	test_snapshot();
+	test_dirs();
+	test_block_reuse();
+	test_threads();
+	test_async();
+	test_compress();
+	test_image();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
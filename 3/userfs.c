@@ -1,511 +1,3407 @@
 #include "userfs.h"
+#include "thread_pool.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define BLOCK_SIZE (64 * 1024)
 #define MAX_FILE_SIZE (100 * 1024 * 1024)
+#define MAX_BLOCK_COUNT ((MAX_FILE_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE)
+/** The smallest size class of a block. */
+#define MIN_BLOCK_CAPACITY 16
+#define SLAB_REGION_SLOTS 32
+#define DEFAULT_BLOCK_CACHE_LIMIT 256
+#define NAME_TABLE_MIN_CAPACITY 16
+/** How many old slots are moved to the new array by each table update. */
+#define NAME_TABLE_MIGRATE_STEP 16
+/** The namespace is split by name hash, each part has its own lock. */
+#define NAME_SHARD_COUNT 16
 
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
 
+/**
+ * A block covers BLOCK_SIZE bytes of a file but allocates only a power of
+ * two prefix of them which has ever been written. The rest reads as zeros.
+ * So a small file takes less than twice its size, and the full blocks of a
+ * big one are just BLOCK_SIZE each.
+ *
+ * Clones and snapshots share the blocks. A shared block is never changed,
+ * a file copies it on the first change and drops its reference.
+ */
 struct block {
-    char* memory;
-    struct block* next;
-    struct block* prev;
+    size_t capacity;
+    /** Slab region of a full block, NULL for a smaller one from malloc. */
+    struct slab_region* region;
+    /** Files and snapshots having the block. */
+    size_t refs;
+    /** Compressor epoch of the last access, see block_touch(). */
+    uint32_t touched;
+    /**
+     * Size of the compressed data in the memory, 0 for a plain block. The
+     * capacity is then the size of the data once decompressed. A compressed
+     * block is never changed, the first access replaces it with a plain one.
+     */
+    uint32_t packed_size;
+    char memory[];
 };
 
+#define SLAB_SLOT_SIZE ((sizeof(struct block) + BLOCK_SIZE + 63) & ~(size_t)63)
+/** Aligned so the regions of an image file can be mapped at their offsets. */
+#define SLAB_REGION_SIZE ((SLAB_SLOT_SIZE * SLAB_REGION_SLOTS + 65535) & ~(size_t)65535)
+
+/**
+ * Full blocks are carved from big mmap regions instead of malloc. A freed
+ * one goes to the block cache first, which hands it out again without any
+ * allocator work. When the cache is full, the block returns to the free
+ * list of its region, and the region is unmapped once all its slots are
+ * free.
+ */
+struct slab_region {
+    char* base;
+    /** Slots handed out at least once. The rest is untouched memory. */
+    size_t carved;
+    /** Slots taken by the files or lying in the block cache. */
+    size_t used;
+    struct block* free_list;
+    struct slab_region* next;
+    struct slab_region* prev;
+    /** Number of the region in the image file. */
+    size_t index;
+};
+
+/** The regions with free slots go before the full ones. */
+static struct slab_region* slab_head = NULL;
+static struct slab_region* slab_tail = NULL;
+
+/** Protects the regions and the block cache. */
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Image file the slab regions are mapped from, see ufs_image_open(). It is
+ * -1 when they are anonymous memory.
+ */
+static int image_fd = -1;
+
+static struct block* block_cache = NULL;
+static size_t block_cache_count = 0;
+static size_t block_cache_limit = DEFAULT_BLOCK_CACHE_LIMIT;
+
+/**
+ * Seconds since the compressor was first started, plus one. Each access to
+ * a block stores it in the block, so the compressor sees how long the block
+ * is untouched. It is 0 while the compressor never ran, and then the blocks
+ * are not written to at all.
+ */
+static uint32_t compress_now = 0;
+/** Marks a cold block which did not compress well, until it is touched. */
+#define BLOCK_INCOMPRESSIBLE UINT32_MAX
+
+/** All the compressed blocks, each one counted once however shared. */
+static struct ufs_compress_stat compress_total;
+
+/**
+ * The file lock protects the blocks, the size and the positions of the
+ * descriptors opened on the file. Readers share it, writers and resize take
+ * it exclusively.
+ */
 struct file {
-    struct block* block_list;
-    struct block* last_block;
+    pthread_rwlock_t lock;
+    /** Blocks by their index in the file, so any of them is found in O(1). */
+    struct block** blocks;
+    size_t block_count;
+    size_t block_capacity;
+    /**
+     * One reference per opened descriptor plus one while the file is in the
+     * namespace. The last one frees the file.
+     */
     int refs;
     char* name;
+    size_t name_hash;
     struct file* next;
     struct file* prev;
     size_t size;
-    bool deleted;
+    /**
+     * Ranges given out by ufs_read_borrow() and not released yet. While
+     * there are any, the file can't shrink and its borrowed blocks don't
+     * move.
+     */
+    int borrows;
+    /** Descriptors opened on the file. */
+    struct filedesc* descs;
+    /**
+     * Entries of a directory, NULL for a regular file. They are split by
+     * the shards of their names, and each part is under the lock of its
+     * shard like the namespace itself.
+     */
+    struct name_table* children;
+    /** Directory of the file while it is in the namespace. */
+    struct file* parent;
 };
 
 static struct file* file_list = NULL;
+static pthread_mutex_t file_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Open addressing hash table of the files by names. Only the files which
+ * are not deleted are there. When the table grows, the old array is kept and
+ * its entries are moved to the new one a few at a time on each update, so
+ * no single call pays for rehashing the whole namespace. Until then lookups
+ * check both arrays.
+ */
+struct name_table {
+    struct file** slots;
+    size_t capacity;
+    /** Live entries and tombstones in the new array. */
+    size_t used;
+    /** Live entries in both arrays. */
+    size_t count;
+    struct file** old_slots;
+    size_t old_capacity;
+    size_t old_pos;
+};
+
+/**
+ * A part of the namespace. Lookups of different names mostly hit different
+ * shards, and lookups in one shard share its lock.
+ */
+struct name_shard {
+    pthread_rwlock_t lock;
+    struct name_table table;
+};
+
+static struct name_shard name_shards[NAME_SHARD_COUNT] = {
+    [0 ... NAME_SHARD_COUNT - 1] = {.lock = PTHREAD_RWLOCK_INITIALIZER},
+};
+static struct file name_tombstone;
+#define NAME_TOMBSTONE (&name_tombstone)
+
+/**
+ * The root directory is not in the namespace and is never freed. Other
+ * files are found by the whole path, the directories are needed only to
+ * list them and to check that a new file has a place to go.
+ */
+static struct name_table root_children[NAME_SHARD_COUNT];
+static struct file root_dir = {
+    .refs = 1,
+    .name = "",
+    .children = root_children,
+};
 
+/**
+ * The position lock serializes the calls on one descriptor, so they move its
+ * position one after another. The lock order is the descriptor table, the
+ * position lock, the file lock. A call pins the descriptor with a reference
+ * and doesn't keep the table locked, so a close is deferred to the last call.
+ */
 struct filedesc {
+    pthread_mutex_t pos_lock;
+    /** One of the table and one of each call in progress. */
+    int refs;
+    /** Set by close under the position lock and async_lock. */
+    bool is_closed;
     struct file* file;
     size_t pos;
     int flags;
+    /** Borrows made through the descriptor. */
+    int borrows;
+    /** Links in the list of the file descriptors, under the file lock. */
+    struct filedesc* file_next;
+    struct filedesc* file_prev;
+    /** Asynchronous calls in the order to run them, under async_lock. */
+    struct ufs_async* async_head;
+    struct ufs_async* async_tail;
 };
 
+/** Protects the queues of the asynchronous calls in the descriptors. */
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Borrowed holes point here. */
+static const char zero_block[BLOCK_SIZE];
+
 static struct filedesc** file_descriptors = NULL;
 static int file_descriptor_count = 0;
 static int file_descriptor_capacity = 0;
+/**
+ * Free descriptor numbers. A map bit is set for a free descriptor and a
+ * summary bit for a map word with any free one, so the lowest free
+ * descriptor is found by a couple of ctz instead of a scan of the table.
+ */
+static uint64_t* fd_free_map = NULL;
+static uint64_t* fd_free_summary = NULL;
+/** Taken for writing only to install or remove a descriptor. */
+static pthread_rwlock_t file_descriptors_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 static void set_error(enum ufs_error_code error) {
     ufs_error_code = error;
 }
 
-static struct file* find_file(const char* filename) {
-    for (struct file* f = file_list; f != NULL; f = f->next) {
-        if (!f->deleted && strcmp(f->name, filename) == 0) {
+/** Hash of the first @a len bytes of the name. */
+static size_t name_hash_n(const char* name, size_t len) {
+    size_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static size_t name_hash(const char* name) {
+    return name_hash_n(name, strlen(name));
+}
+
+static struct file** name_slots_find(struct file** slots, size_t capacity,
+                                     const char* name, size_t len, size_t hash) {
+    if (capacity == 0) {
+        return NULL;
+    }
+    size_t mask = capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct file* f = slots[i];
+        if (f == NULL) {
+            return NULL;
+        }
+        if (f != NAME_TOMBSTONE && f->name_hash == hash && strncmp(f->name, name, len) == 0 &&
+            f->name[len] == 0) {
+            return &slots[i];
+        }
+    }
+}
+
+/** Returns true if an empty slot was taken, false if a tombstone. */
+static bool name_slots_insert(struct file** slots, size_t capacity, struct file* file) {
+    size_t mask = capacity - 1;
+    for (size_t i = file->name_hash & mask;; i = (i + 1) & mask) {
+        if (slots[i] == NULL || slots[i] == NAME_TOMBSTONE) {
+            bool was_empty = slots[i] == NULL;
+            slots[i] = file;
+            return was_empty;
+        }
+    }
+}
+
+static void name_table_migrate(struct name_table* t, size_t steps) {
+    if (t->old_slots == NULL) {
+        return;
+    }
+    for (; steps > 0 && t->old_pos < t->old_capacity; steps--, t->old_pos++) {
+        struct file* f = t->old_slots[t->old_pos];
+        if (f == NULL || f == NAME_TOMBSTONE) {
+            continue;
+        }
+        if (name_slots_insert(t->slots, t->capacity, f)) {
+            t->used++;
+        }
+        /* Else a lookup would find it there after it is deleted. */
+        t->old_slots[t->old_pos] = NAME_TOMBSTONE;
+    }
+    if (t->old_pos == t->old_capacity) {
+        free(t->old_slots);
+        t->old_slots = NULL;
+        t->old_capacity = 0;
+        t->old_pos = 0;
+    }
+}
+
+/** Find the file named by the first @a len bytes of @a name. */
+static struct file* name_table_find_n(const struct name_table* t, const char* name,
+                                      size_t len, size_t hash) {
+    struct file** slot = name_slots_find(t->slots, t->capacity, name, len, hash);
+    if (slot == NULL) {
+        slot = name_slots_find(t->old_slots, t->old_capacity, name, len, hash);
+    }
+    return slot != NULL ? *slot : NULL;
+}
+
+static struct file* name_table_find(const struct name_table* t, const char* name,
+                                    size_t hash) {
+    return name_table_find_n(t, name, strlen(name), hash);
+}
+
+/** Make sure one more entry fits into the new array under 3/4 load. */
+static int name_table_reserve(struct name_table* t) {
+    if ((t->used + 1) * 4 <= t->capacity * 3) {
+        return 0;
+    }
+    /* The new array filled up before the old one was moved. Rare. */
+    name_table_migrate(t, SIZE_MAX);
+    if ((t->used + 1) * 4 <= t->capacity * 3) {
+        return 0;
+    }
+    size_t new_capacity = NAME_TABLE_MIN_CAPACITY;
+    while (new_capacity < (t->count + 1) * 2) {
+        new_capacity *= 2;
+    }
+    struct file** new_slots = calloc(new_capacity, sizeof(*new_slots));
+    if (!new_slots) {
+        return -1;
+    }
+    t->old_slots = t->slots;
+    t->old_capacity = t->capacity;
+    t->old_pos = 0;
+    t->slots = new_slots;
+    t->capacity = new_capacity;
+    t->used = 0;
+    return 0;
+}
+
+static int name_table_insert(struct name_table* t, struct file* file) {
+    if (name_table_reserve(t) < 0) {
+        return -1;
+    }
+    name_table_migrate(t, NAME_TABLE_MIGRATE_STEP);
+    if (name_slots_insert(t->slots, t->capacity, file)) {
+        t->used++;
+    }
+    t->count++;
+    return 0;
+}
+
+static void name_table_remove(struct name_table* t, struct file* file) {
+    size_t len = strlen(file->name);
+    struct file** slot = name_slots_find(t->slots, t->capacity, file->name, len, file->name_hash);
+    if (slot == NULL) {
+        slot = name_slots_find(t->old_slots, t->old_capacity, file->name, len, file->name_hash);
+    }
+    *slot = NAME_TOMBSTONE;
+    t->count--;
+    name_table_migrate(t, NAME_TABLE_MIGRATE_STEP);
+}
+
+/**
+ * Next file of the table from the iterator @a pos, which starts at 0. NULL
+ * when there are no more.
+ */
+static struct file* name_table_next(const struct name_table* t, size_t* pos) {
+    for (; *pos < t->capacity + t->old_capacity; (*pos)++) {
+        struct file* f = *pos < t->capacity ? t->slots[*pos] : t->old_slots[*pos - t->capacity];
+        if (f != NULL && f != NAME_TOMBSTONE) {
+            (*pos)++;
             return f;
         }
     }
-    return NULL;
+    return NULL;
+}
+
+static void name_table_destroy(struct name_table* t) {
+    free(t->slots);
+    free(t->old_slots);
+    memset(t, 0, sizeof(*t));
+}
+
+static size_t name_shard_index(size_t hash) {
+    /* The low bits select the slot inside the table already. */
+    return (hash >> 32) % NAME_SHARD_COUNT;
+}
+
+static struct name_shard* name_shard_of(size_t hash) {
+    return &name_shards[name_shard_index(hash)];
+}
+
+static void name_shards_lock_all(bool is_write) {
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        if (is_write) {
+            pthread_rwlock_wrlock(&name_shards[i].lock);
+        } else {
+            pthread_rwlock_rdlock(&name_shards[i].lock);
+        }
+    }
+}
+
+static void name_shards_unlock_all(void) {
+    for (int i = NAME_SHARD_COUNT - 1; i >= 0; i--) {
+        pthread_rwlock_unlock(&name_shards[i].lock);
+    }
+}
+
+/**
+ * Lock the shard of a name for writing and the shard of its directory for
+ * reading. The shards are always locked in their order.
+ */
+static void name_shards_lock_pair(struct name_shard* shard, struct name_shard* dir_shard) {
+    if (dir_shard == NULL || dir_shard == shard) {
+        pthread_rwlock_wrlock(&shard->lock);
+    } else if (dir_shard < shard) {
+        pthread_rwlock_rdlock(&dir_shard->lock);
+        pthread_rwlock_wrlock(&shard->lock);
+    } else {
+        pthread_rwlock_wrlock(&shard->lock);
+        pthread_rwlock_rdlock(&dir_shard->lock);
+    }
+}
+
+static void name_shards_unlock_pair(struct name_shard* shard, struct name_shard* dir_shard) {
+    pthread_rwlock_unlock(&shard->lock);
+    if (dir_shard != NULL && dir_shard != shard) {
+        pthread_rwlock_unlock(&dir_shard->lock);
+    }
+}
+
+static int image_add_region(struct slab_region* r);
+
+static size_t block_capacity_for(size_t size) {
+    /* Only the slab blocks are in the image file. */
+    if (image_fd >= 0) {
+        return BLOCK_SIZE;
+    }
+    size_t capacity = MIN_BLOCK_CAPACITY;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+    return MIN(capacity, (size_t)BLOCK_SIZE);
+}
+
+static struct block** block_next(struct block* blk) {
+    /* A free block keeps the free list link in its data. */
+    return (struct block**)blk->memory;
+}
+
+static bool slab_region_is_full(const struct slab_region* r) {
+    return r->carved == SLAB_REGION_SLOTS && r->free_list == NULL;
+}
+
+static void slab_region_unlink(struct slab_region* r) {
+    if (r->prev != NULL) {
+        r->prev->next = r->next;
+    } else {
+        slab_head = r->next;
+    }
+    if (r->next != NULL) {
+        r->next->prev = r->prev;
+    } else {
+        slab_tail = r->prev;
+    }
+}
+
+static void slab_region_push_head(struct slab_region* r) {
+    r->prev = NULL;
+    r->next = slab_head;
+    if (slab_head != NULL) {
+        slab_head->prev = r;
+    } else {
+        slab_tail = r;
+    }
+    slab_head = r;
+}
+
+static void slab_region_push_tail(struct slab_region* r) {
+    r->next = NULL;
+    r->prev = slab_tail;
+    if (slab_tail != NULL) {
+        slab_tail->next = r;
+    } else {
+        slab_head = r;
+    }
+    slab_tail = r;
+}
+
+static struct slab_region* slab_region_new(void) {
+    struct slab_region* r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+    if (image_fd >= 0) {
+        if (image_add_region(r) < 0) {
+            free(r);
+            return NULL;
+        }
+    } else {
+        r->base = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r->base == MAP_FAILED) {
+            free(r);
+            return NULL;
+        }
+    }
+    slab_region_push_head(r);
+    return r;
+}
+
+/**
+ * Take a full block. @a is_zero tells if its data is known to be zeros,
+ * which is so for the slots never used before.
+ */
+static struct block* slab_alloc(bool* is_zero) {
+    struct block* blk;
+    *is_zero = false;
+    pthread_mutex_lock(&slab_lock);
+    if (block_cache != NULL) {
+        blk = block_cache;
+        block_cache = *block_next(blk);
+        block_cache_count--;
+        pthread_mutex_unlock(&slab_lock);
+        return blk;
+    }
+    struct slab_region* r = slab_head;
+    if (r == NULL || slab_region_is_full(r)) {
+        r = slab_region_new();
+        if (!r) {
+            pthread_mutex_unlock(&slab_lock);
+            return NULL;
+        }
+    }
+    if (r->free_list != NULL) {
+        blk = r->free_list;
+        r->free_list = *block_next(blk);
+    } else {
+        blk = (struct block*)(r->base + r->carved++ * SLAB_SLOT_SIZE);
+        blk->capacity = BLOCK_SIZE;
+        blk->region = r;
+        blk->packed_size = 0;
+        *is_zero = true;
+    }
+    r->used++;
+    if (slab_region_is_full(r)) {
+        slab_region_unlink(r);
+        slab_region_push_tail(r);
+    }
+    pthread_mutex_unlock(&slab_lock);
+    return blk;
+}
+
+static void slab_release(struct block* blk) {
+    struct slab_region* r = blk->region;
+    *block_next(blk) = r->free_list;
+    r->free_list = blk;
+    r->used--;
+    slab_region_unlink(r);
+    /* The regions of the image file stay until it is closed. */
+    if (r->used == 0 && image_fd < 0) {
+        munmap(r->base, SLAB_REGION_SIZE);
+        free(r);
+        return;
+    }
+    slab_region_push_head(r);
+}
+
+static void slab_free(struct block* blk) {
+    pthread_mutex_lock(&slab_lock);
+    if (block_cache_count < block_cache_limit) {
+        *block_next(blk) = block_cache;
+        block_cache = blk;
+        block_cache_count++;
+    } else {
+        slab_release(blk);
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
+
+void ufs_set_block_cache_limit(size_t count) {
+    pthread_mutex_lock(&slab_lock);
+    block_cache_limit = count;
+    while (block_cache_count > block_cache_limit) {
+        struct block* blk = block_cache;
+        block_cache = *block_next(blk);
+        block_cache_count--;
+        slab_release(blk);
+    }
+    pthread_mutex_unlock(&slab_lock);
+}
+
+/**
+ * Compression codec of the LZ4 block format. A sequence is a token with the
+ * lengths of the literals and of the match in its halves, the literals, a 2
+ * byte offset of the match and the longer lengths in bytes of 255 and the
+ * rest. The last sequence has only the literals. The blocks are 64KB at
+ * most, so any offset in them fits the 2 bytes.
+ */
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+/** The format wants the last bytes to be literals. */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static uint32_t lz_read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static size_t lz_hash(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/** Put the rest of a length which did not fit the token. NULL if no space. */
+static unsigned char* lz_put_length(unsigned char* op, const unsigned char* end, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op == end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == end) {
+        return NULL;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/** Put a sequence of the literals and a match, or just the last literals. */
+static unsigned char* lz_put_sequence(unsigned char* op, const unsigned char* end,
+                                      const unsigned char* literals, size_t literal_len,
+                                      size_t offset, size_t match_len) {
+    if (op == end) {
+        return NULL;
+    }
+    unsigned char* token = op++;
+    *token = (unsigned char)(MIN(literal_len, (size_t)15) << 4);
+    if (literal_len >= 15 && !(op = lz_put_length(op, end, literal_len - 15))) {
+        return NULL;
+    }
+    if ((size_t)(end - op) < literal_len) {
+        return NULL;
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (match_len == 0) {
+        return op;
+    }
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    match_len -= LZ_MIN_MATCH;
+    *token |= MIN(match_len, (size_t)15);
+    if (match_len >= 15 && !(op = lz_put_length(op, end, match_len - 15))) {
+        return NULL;
+    }
+    return op;
+}
+
+/**
+ * Compress @a size bytes into at most @a capacity. Matches are found by a
+ * hash of 4 bytes, and the misses make the steps longer, so the data which
+ * does not compress is passed quickly. Returns 0 if the result does not fit.
+ */
+static size_t lz_compress(const char* src, size_t size, char* dst, size_t capacity) {
+    const unsigned char* base = (const unsigned char*)src;
+    const unsigned char* ip = base;
+    const unsigned char* anchor = base;
+    const unsigned char* src_end = base + size;
+    unsigned char* op = (unsigned char*)dst;
+    const unsigned char* end = op + capacity;
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    if (size > LZ_MATCH_LIMIT) {
+        const unsigned char* limit = src_end - LZ_MATCH_LIMIT;
+        const unsigned char* match_limit = src_end - LZ_LAST_LITERALS;
+        size_t misses = 0;
+        ip++;
+        while (ip <= limit) {
+            uint32_t seq = lz_read32(ip);
+            size_t h = lz_hash(seq);
+            const unsigned char* ref = base + table[h];
+            table[h] = (uint16_t)(ip - base);
+            if (ref >= ip || lz_read32(ref) != seq) {
+                ip += 1 + (misses++ >> 5);
+                continue;
+            }
+            misses = 0;
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char* match_end = ip + LZ_MIN_MATCH;
+            size_t distance = ip - ref;
+            while (match_end + 8 <= match_limit) {
+                uint64_t a, b;
+                memcpy(&a, match_end, sizeof(a));
+                memcpy(&b, match_end - distance, sizeof(b));
+                if (a != b) {
+                    match_end += __builtin_ctzll(a ^ b) / 8;
+                    break;
+                }
+                match_end += 8;
+            }
+            while (match_end < match_limit && *match_end == match_end[-distance]) {
+                match_end++;
+            }
+            op = lz_put_sequence(op, end, anchor, ip - anchor, ip - ref, match_end - ip);
+            if (!op) {
+                return 0;
+            }
+            ip = anchor = match_end;
+            if (ip <= limit) {
+                table[lz_hash(lz_read32(ip - 2))] = (uint16_t)(ip - 2 - base);
+            }
+        }
+    }
+    op = lz_put_sequence(op, end, anchor, src_end - anchor, 0, 0);
+    return op ? (size_t)(op - (unsigned char*)dst) : 0;
+}
+
+static bool lz_get_length(const unsigned char** ip, const unsigned char* end, size_t* len) {
+    unsigned char b;
+    do {
+        if (*ip == end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/** Decompress exactly @a dst_size bytes, false if the data is broken. */
+static bool lz_decompress(const char* src, size_t size, char* dst, size_t dst_size) {
+    const unsigned char* ip = (const unsigned char*)src;
+    const unsigned char* end = ip + size;
+    char* op = dst;
+    char* dst_end = dst + dst_size;
+    while (ip < end) {
+        unsigned token = *ip++;
+        size_t len = token >> 4;
+        if (len == 15 && !lz_get_length(&ip, end, &len)) {
+            return false;
+        }
+        if (len > (size_t)(end - ip) || len > (size_t)(dst_end - op)) {
+            return false;
+        }
+        /* Most of the copies are short, a fixed size one is faster. */
+        if (len <= 16 && end - ip >= 16 && dst_end - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, len);
+        }
+        ip += len;
+        op += len;
+        if (ip == end) {
+            break;
+        }
+        if (end - ip < 2) {
+            return false;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        len = token & 15;
+        if (len == 15 && !lz_get_length(&ip, end, &len)) {
+            return false;
+        }
+        len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || len > (size_t)(dst_end - op)) {
+            return false;
+        }
+        const char* match = op - offset;
+        if (offset >= 16 && (size_t)(dst_end - op) >= len + 16) {
+            for (size_t i = 0; i < len; i += 16) {
+                memcpy(op + i, match + i, 16);
+            }
+            op += len;
+            continue;
+        }
+        /* The copied part doubles each time, so short offsets repeat fast. */
+        while (len > 0) {
+            size_t part = MIN(len, (size_t)(op - match));
+            memcpy(op, match, part);
+            op += part;
+            len -= part;
+        }
+    }
+    return op == dst_end;
+}
+
+static uint32_t block_epoch(void) {
+    return __atomic_load_n(&compress_now, __ATOMIC_RELAXED);
+}
+
+/**
+ * Remember the block is used now. Readers sharing the file lock store the
+ * same value, and nothing is written while the compressor never ran.
+ */
+static void block_touch(struct block* blk) {
+    uint32_t now = block_epoch();
+    if (__atomic_load_n(&blk->touched, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&blk->touched, now, __ATOMIC_RELAXED);
+    }
+}
+
+static bool block_is_packed(const struct block* blk) {
+    return blk->packed_size != 0;
+}
+
+/**
+ * Create a block for the first @a size bytes. The data is zeroed except the
+ * first @a size bytes if @a is_overwritten says the caller fills them right
+ * away.
+ */
+static struct block* create_block(size_t size, bool is_overwritten) {
+    size_t capacity = block_capacity_for(size);
+    size_t dirty_from = is_overwritten ? size : 0;
+    struct block* blk;
+    if (capacity == BLOCK_SIZE) {
+        bool is_zero;
+        blk = slab_alloc(&is_zero);
+        if (blk != NULL && !is_zero) {
+            memset(blk->memory + dirty_from, 0, BLOCK_SIZE - dirty_from);
+        }
+        if (blk != NULL) {
+            blk->refs = 1;
+            blk->touched = block_epoch();
+        }
+        return blk;
+    }
+    if (!is_overwritten) {
+        /* Fresh pages from calloc are zero already and are not touched. */
+        blk = calloc(1, sizeof(struct block) + capacity);
+    } else {
+        blk = malloc(sizeof(struct block) + capacity);
+        if (blk != NULL) {
+            memset(blk->memory + dirty_from, 0, capacity - dirty_from);
+        }
+    }
+    if (!blk) {
+        return NULL;
+    }
+    blk->capacity = capacity;
+    blk->region = NULL;
+    blk->refs = 1;
+    blk->touched = block_epoch();
+    blk->packed_size = 0;
+    return blk;
+}
+
+/**
+ * Make the first @a size bytes of the block allocated. The block can move,
+ * the new one is returned.
+ */
+static struct block* grow_block(struct block* blk, size_t size) {
+    if (size <= blk->capacity) {
+        return blk;
+    }
+    size_t capacity = block_capacity_for(size);
+    if (capacity == BLOCK_SIZE) {
+        bool is_zero;
+        struct block* res = slab_alloc(&is_zero);
+        if (!res) {
+            return NULL;
+        }
+        memcpy(res->memory, blk->memory, blk->capacity);
+        if (!is_zero) {
+            memset(res->memory + blk->capacity, 0, BLOCK_SIZE - blk->capacity);
+        }
+        res->refs = 1;
+        res->touched = blk->touched;
+        free(blk);
+        return res;
+    }
+    struct block* res = realloc(blk, sizeof(struct block) + capacity);
+    if (!res) {
+        return NULL;
+    }
+    memset(res->memory + res->capacity, 0, capacity - res->capacity);
+    res->capacity = capacity;
+    return res;
+}
+
+/** Drop the allocated bytes from @a size on, the block can move. */
+static struct block* cut_block(struct block* blk, size_t size) {
+    size_t capacity = block_capacity_for(size);
+    if (capacity < blk->capacity && blk->region != NULL) {
+        struct block* res = malloc(sizeof(struct block) + capacity);
+        if (res != NULL) {
+            memcpy(res->memory, blk->memory, capacity);
+            res->capacity = capacity;
+            res->region = NULL;
+            res->refs = 1;
+            res->touched = blk->touched;
+            res->packed_size = 0;
+            slab_free(blk);
+            blk = res;
+        }
+    } else if (capacity < blk->capacity) {
+        struct block* res = realloc(blk, sizeof(struct block) + capacity);
+        if (res != NULL) {
+            blk = res;
+            blk->capacity = capacity;
+        }
+    }
+    if (size < blk->capacity) {
+        memset(blk->memory + size, 0, blk->capacity - size);
+    }
+    return blk;
+}
+
+static bool block_is_shared(struct block* blk) {
+    return __atomic_load_n(&blk->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+static struct block* ref_block(struct block* blk) {
+    if (blk != NULL) {
+        __atomic_add_fetch(&blk->refs, 1, __ATOMIC_RELAXED);
+    }
+    return blk;
+}
+
+/** Drop a reference to the block, the last one frees it. */
+static void free_block(struct block* blk) {
+    if (blk == NULL || __atomic_sub_fetch(&blk->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (blk->region != NULL) {
+        slab_free(blk);
+        return;
+    }
+    if (block_is_packed(blk)) {
+        __atomic_sub_fetch(&compress_total.block_count, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&compress_total.data_size, blk->capacity, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&compress_total.packed_size, blk->packed_size, __ATOMIC_RELAXED);
+    }
+    free(blk);
+}
+
+/**
+ * Compress the block if it gets at least an eighth smaller. The compressed
+ * one is returned, or NULL when it does not pay off or no memory.
+ */
+static struct block* pack_block(struct block* blk, char* buf) {
+    size_t size = lz_compress(blk->memory, blk->capacity, buf, blk->capacity - blk->capacity / 8);
+    if (size == 0) {
+        return NULL;
+    }
+    struct block* res = malloc(sizeof(struct block) + size);
+    if (!res) {
+        return NULL;
+    }
+    memcpy(res->memory, buf, size);
+    res->capacity = blk->capacity;
+    res->region = NULL;
+    res->refs = 1;
+    res->touched = blk->touched;
+    res->packed_size = size;
+    __atomic_add_fetch(&compress_total.block_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&compress_total.data_size, res->capacity, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&compress_total.packed_size, size, __ATOMIC_RELAXED);
+    free_block(blk);
+    return res;
+}
+
+/**
+ * A plain private copy of a compressed block with at least @a size bytes
+ * allocated. The reference to the compressed one is dropped, other files
+ * can still share it.
+ */
+static struct block* unpack_block(struct block* blk, size_t size) {
+    size = MAX(size, blk->capacity);
+    struct block* res = create_block(size, true);
+    if (!res) {
+        return NULL;
+    }
+    if (!lz_decompress(blk->memory, blk->packed_size, res->memory, blk->capacity)) {
+        free_block(res);
+        return NULL;
+    }
+    memset(res->memory + blk->capacity, 0, size - blk->capacity);
+    free_block(blk);
+    return res;
+}
+
+/**
+ * A private copy of the first @a size bytes of the block. The first
+ * @a filled bytes are not copied, the caller fills them right away.
+ */
+static struct block* copy_block(const struct block* blk, size_t size, size_t filled) {
+    size_t copy_from = filled;
+    size_t copy_to = MIN(size, blk->capacity);
+    struct block* res = create_block(size, true);
+    if (!res) {
+        return NULL;
+    }
+    if (copy_from < copy_to) {
+        memcpy(res->memory + copy_from, blk->memory + copy_from, copy_to - copy_from);
+    }
+    size_t zero_from = MAX(copy_from, copy_to);
+    memset(res->memory + zero_from, 0, size - zero_from);
+    return res;
+}
+
+/**
+ * Make the first @a size bytes of the block allocated and the block private
+ * to the file, so it can be changed. The new block is returned.
+ */
+static struct block* own_block(struct block* blk, size_t size, bool is_overwritten) {
+    if (block_is_packed(blk)) {
+        return unpack_block(blk, size);
+    }
+    if (!block_is_shared(blk)) {
+        return grow_block(blk, size);
+    }
+    struct block* res = copy_block(blk, MAX(size, blk->capacity), is_overwritten ? size : 0);
+    if (res != NULL) {
+        free_block(blk);
+    }
+    return res;
+}
+
+static int reserve_blocks(struct file* file, size_t count) {
+    if (count <= file->block_capacity) {
+        return 0;
+    }
+    size_t new_capacity = file->block_capacity == 0 ? 4 : file->block_capacity * 2;
+    while (new_capacity < count) {
+        new_capacity *= 2;
+    }
+    new_capacity = MIN(new_capacity, (size_t)MAX_BLOCK_COUNT);
+    struct block** new_blocks = realloc(file->blocks, new_capacity * sizeof(*new_blocks));
+    if (!new_blocks) {
+        return -1;
+    }
+    file->blocks = new_blocks;
+    file->block_capacity = new_capacity;
+    return 0;
+}
+
+/**
+ * Grow the file with a hole. Its blocks stay NULL and read as zeros until
+ * something is written there.
+ */
+static int extend_file(struct file* file, size_t new_size) {
+    if (new_size <= file->size) {
+        return 0;
+    }
+    
+    size_t needed_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (reserve_blocks(file, needed_blocks) < 0) {
+        return -1;
+    }
+    
+    while (file->block_count < needed_blocks) {
+        file->blocks[file->block_count++] = NULL;
+    }
+    
+    file->size = new_size;
+    return 0;
+}
+
+static void truncate_blocks(struct file* file, size_t block_count) {
+    while (file->block_count > block_count) {
+        free_block(file->blocks[--file->block_count]);
+    }
+}
+
+/**
+ * Drop the data behind the new size. The tail of the last kept block is
+ * zeroed or freed, so the bytes behind the file size are always zero and a
+ * later growth does not expose the old data. Fails only when the last block
+ * is shared and can't be copied, then nothing is changed.
+ */
+static int shrink_file(struct file* file, size_t new_size) {
+    size_t offset = new_size % BLOCK_SIZE;
+    struct block** last = &file->blocks[new_size / BLOCK_SIZE];
+    if (offset != 0 && *last != NULL && block_is_packed(*last)) {
+        struct block* plain = unpack_block(*last, 0);
+        if (!plain) {
+            return -1;
+        }
+        *last = plain;
+    }
+    if (offset != 0 && *last != NULL && block_is_shared(*last)) {
+        struct block* copy = copy_block(*last, offset, 0);
+        if (!copy) {
+            return -1;
+        }
+        free_block(*last);
+        *last = copy;
+    }
+    truncate_blocks(file, (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (offset != 0 && *last != NULL) {
+        *last = cut_block(*last, offset);
+    }
+    file->size = new_size;
+    return 0;
+}
+
+/**
+ * Allocate the bytes of the range [begin, end) in the blocks, creating the
+ * ones which are holes and copying the shared ones.
+ */
+static int materialize_blocks(struct file* file, size_t begin, size_t end) {
+    if (begin >= end) {
+        return 0;
+    }
+    for (size_t i = begin / BLOCK_SIZE; i <= (end - 1) / BLOCK_SIZE; i++) {
+        size_t size = MIN(end - i * BLOCK_SIZE, (size_t)BLOCK_SIZE);
+        bool is_overwritten = begin <= i * BLOCK_SIZE;
+        struct block* blk = file->blocks[i];
+        blk = blk == NULL ? create_block(size, is_overwritten) : own_block(blk, size, is_overwritten);
+        if (blk == NULL) {
+            return -1;
+        }
+        file->blocks[i] = blk;
+    }
+    return 0;
+}
+
+static struct block* get_block(struct file* file, size_t block_index) {
+    if (block_index >= file->block_count) {
+        return NULL;
+    }
+    return file->blocks[block_index];
+}
+
+static bool file_is_dir(const struct file* file) {
+    return file->children != NULL;
+}
+
+static void dir_free_children(struct file* file) {
+    if (file->children != NULL) {
+        for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+            name_table_destroy(&file->children[i]);
+        }
+        free(file->children);
+    }
+}
+
+/** Unlink the file from the file list and free it with all its blocks. */
+static void free_file(struct file* file) {
+    pthread_mutex_lock(&file_list_lock);
+    if (file->prev != NULL) {
+        file->prev->next = file->next;
+    } else {
+        file_list = file->next;
+    }
+
+    if (file->next != NULL) {
+        file->next->prev = file->prev;
+    }
+    pthread_mutex_unlock(&file_list_lock);
+
+    truncate_blocks(file, 0);
+    dir_free_children(file);
+    pthread_rwlock_destroy(&file->lock);
+    free(file->blocks);
+    free(file->name);
+    free(file);
+}
+
+static void file_ref(struct file* file) {
+    __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+}
+
+static void file_unref(struct file* file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free_file(file);
+    }
+}
+
+/** Create a file which is not in the namespace yet, with @a refs references. */
+static struct file* create_file(const char* filename, size_t hash, int refs) {
+    struct file* file = malloc(sizeof(struct file));
+    if (!file) {
+        return NULL;
+    }
+
+    file->name = strdup(filename);
+    if (!file->name) {
+        free(file);
+        return NULL;
+    }
+    file->name_hash = hash;
+
+    pthread_rwlock_init(&file->lock, NULL);
+    file->blocks = NULL;
+    file->block_count = 0;
+    file->block_capacity = 0;
+    file->refs = refs;
+    file->size = 0;
+    file->borrows = 0;
+    file->descs = NULL;
+    file->children = NULL;
+    file->parent = NULL;
+    file->prev = NULL;
+
+    pthread_mutex_lock(&file_list_lock);
+    file->next = file_list;
+    if (file_list != NULL) {
+        file_list->prev = file;
+    }
+    file_list = file;
+    pthread_mutex_unlock(&file_list_lock);
+    return file;
+}
+
+static struct file* create_dir(const char* path, size_t hash, int refs) {
+    /* The file is in the list at once, so nothing can fail after that. */
+    struct name_table* children = calloc(NAME_SHARD_COUNT, sizeof(*children));
+    if (!children) {
+        return NULL;
+    }
+    struct file* dir = create_file(path, hash, refs);
+    if (!dir) {
+        free(children);
+        return NULL;
+    }
+    dir->children = children;
+    return dir;
+}
+
+/** Length of the directory part of the path, 0 for a file of the root. */
+static size_t path_dir_len(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash != NULL ? (size_t)(slash - path) : 0;
+}
+
+static const char* path_base(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+/** A new path can't have empty parts, so each name has one spelling. */
+static bool path_is_valid(const char* path) {
+    if (path[0] == 0 || path[0] == '/') {
+        return false;
+    }
+    for (; *path != 0; path++) {
+        if (*path == '/' && (path[1] == '/' || path[1] == 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/** Find the file by name, referenced for the caller. */
+static struct file* namespace_find(const char* path) {
+    size_t hash = name_hash(path);
+    struct name_shard* shard = name_shard_of(hash);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    struct file* file = name_table_find(&shard->table, path, hash);
+    if (file != NULL) {
+        file_ref(file);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (!file) {
+        set_error(UFS_ERR_NO_FILE);
+    }
+    return file;
+}
+
+/**
+ * Put the new file into the namespace and into its directory. The shard of
+ * the directory stays locked meanwhile, so it can't be removed. If the name
+ * is taken, the existing file is returned referenced instead. NULL on an
+ * error.
+ */
+static struct file* namespace_add(struct file* file) {
+    size_t index = name_shard_index(file->name_hash);
+    struct name_shard* shard = &name_shards[index];
+    size_t dir_len = path_dir_len(file->name);
+    size_t dir_hash = name_hash_n(file->name, dir_len);
+    struct name_shard* dir_shard = dir_len > 0 ? name_shard_of(dir_hash) : NULL;
+
+    name_shards_lock_pair(shard, dir_shard);
+    struct file* dir = &root_dir;
+    if (dir_shard != NULL) {
+        dir = name_table_find_n(&dir_shard->table, file->name, dir_len, dir_hash);
+    }
+    /* Could be created by another thread meanwhile. */
+    struct file* res = name_table_find(&shard->table, file->name, file->name_hash);
+    if (res != NULL) {
+        file_ref(res);
+    } else if (dir == NULL || !file_is_dir(dir)) {
+        set_error(dir == NULL ? UFS_ERR_NO_FILE : UFS_ERR_NOT_DIR);
+    } else if (name_table_insert(&shard->table, file) < 0) {
+        set_error(UFS_ERR_NO_MEM);
+    } else if (name_table_insert(&dir->children[index], file) < 0) {
+        name_table_remove(&shard->table, file);
+        set_error(UFS_ERR_NO_MEM);
+    } else {
+        file->parent = dir;
+        res = file;
+    }
+    name_shards_unlock_pair(shard, dir_shard);
+    return res;
+}
+
+/** Take the file out of the namespace, its shard is locked for writing. */
+static void namespace_remove(struct name_shard* shard, struct file* file) {
+    name_table_remove(&shard->table, file);
+    name_table_remove(&file->parent->children[shard - name_shards], file);
+}
+
+/**
+ * Find the file by name or create it if allowed. The returned file is
+ * referenced for the caller.
+ */
+static struct file* open_file(const char* filename, bool create) {
+    struct file* file = namespace_find(filename);
+    if (!file && create) {
+        if (!path_is_valid(filename)) {
+            return NULL;
+        }
+        /* One reference for the name and one for the caller. */
+        struct file* new_file = create_file(filename, name_hash(filename), 2);
+        if (!new_file) {
+            set_error(UFS_ERR_NO_MEM);
+            return NULL;
+        }
+        file = namespace_add(new_file);
+        if (file != new_file) {
+            /* The compressor may hold it, so only the references are dropped. */
+            file_unref(new_file);
+            file_unref(new_file);
+        }
+    }
+    if (file != NULL && file_is_dir(file)) {
+        file_unref(file);
+        set_error(UFS_ERR_IS_DIR);
+        return NULL;
+    }
+    return file;
+}
+
+static void file_link_desc(struct file* file, struct filedesc* desc) {
+    pthread_rwlock_wrlock(&file->lock);
+    desc->file_prev = NULL;
+    desc->file_next = file->descs;
+    if (file->descs != NULL) {
+        file->descs->file_prev = desc;
+    }
+    file->descs = desc;
+    pthread_rwlock_unlock(&file->lock);
+}
+
+static void file_unlink_desc(struct file* file, struct filedesc* desc) {
+    pthread_rwlock_wrlock(&file->lock);
+    if (desc->file_prev != NULL) {
+        desc->file_prev->file_next = desc->file_next;
+    } else {
+        file->descs = desc->file_next;
+    }
+    if (desc->file_next != NULL) {
+        desc->file_next->file_prev = desc->file_prev;
+    }
+    pthread_rwlock_unlock(&file->lock);
+}
+
+/**
+ * Get the descriptor for a call which does not move its position. It is
+ * pinned until desc_put(), the table is locked only for the lookup.
+ */
+static struct filedesc* desc_get(int fd) {
+    pthread_rwlock_rdlock(&file_descriptors_lock);
+    if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
+        pthread_rwlock_unlock(&file_descriptors_lock);
+        set_error(UFS_ERR_NO_FILE);
+        return NULL;
+    }
+    struct filedesc* desc = file_descriptors[fd];
+    __atomic_add_fetch(&desc->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&file_descriptors_lock);
+    return desc;
+}
+
+static void desc_free(struct filedesc* desc) {
+    file_unlink_desc(desc->file, desc);
+    file_unref(desc->file);
+    pthread_mutex_destroy(&desc->pos_lock);
+    free(desc);
+}
+
+/** The last reference frees a closed descriptor. */
+static void desc_put(struct filedesc* desc) {
+    if (__atomic_sub_fetch(&desc->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        desc_free(desc);
+    }
+}
+
+/** Same as desc_get(), but the position is locked too until desc_release(). */
+static struct filedesc* desc_acquire(int fd) {
+    struct filedesc* desc = desc_get(fd);
+    if (desc == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&desc->pos_lock);
+    if (desc->is_closed) {
+        /* Closed while this call waited for the position. */
+        pthread_mutex_unlock(&desc->pos_lock);
+        desc_put(desc);
+        set_error(UFS_ERR_NO_FILE);
+        return NULL;
+    }
+    return desc;
+}
+
+static void desc_release(struct filedesc* desc) {
+    pthread_mutex_unlock(&desc->pos_lock);
+    desc_put(desc);
+}
+
+/** Check that the descriptor was opened with one of the @a access flags. */
+static int desc_check_access(const struct filedesc* desc, int access) {
+#if NEED_OPEN_FLAGS
+    if (!(desc->flags & access)) {
+        set_error(UFS_ERR_NO_PERMISSION);
+        return -1;
+    }
+#else
+    (void)desc;
+    (void)access;
+#endif
+    return 0;
+}
+
+static void fd_put(int fd) {
+    int word = fd / 64;
+    fd_free_map[word] |= 1ULL << (fd % 64);
+    fd_free_summary[word / 64] |= 1ULL << (word % 64);
+}
+
+/** Take the lowest free descriptor number, -1 if there are none. */
+static int fd_take(void) {
+    int words = file_descriptor_capacity / 64;
+    for (int i = 0; i * 64 < words; i++) {
+        if (fd_free_summary[i] == 0) {
+            continue;
+        }
+        int word = i * 64 + __builtin_ctzll(fd_free_summary[i]);
+        int fd = word * 64 + __builtin_ctzll(fd_free_map[word]);
+        fd_free_map[word] &= fd_free_map[word] - 1;
+        if (fd_free_map[word] == 0) {
+            fd_free_summary[i] &= ~(1ULL << (word % 64));
+        }
+        return fd;
+    }
+    return -1;
+}
+
+static int fd_grow(void) {
+    int new_capacity = file_descriptor_capacity == 0 ? 64 : file_descriptor_capacity * 2;
+    int old_words = file_descriptor_capacity / 64;
+    int new_words = new_capacity / 64;
+    struct filedesc** new_arr = realloc(file_descriptors, new_capacity * sizeof(*file_descriptors));
+    if (!new_arr) {
+        return -1;
+    }
+    file_descriptors = new_arr;
+    uint64_t* new_map = realloc(fd_free_map, new_words * sizeof(*new_map));
+    if (!new_map) {
+        return -1;
+    }
+    fd_free_map = new_map;
+    uint64_t* new_summary = realloc(fd_free_summary, (new_words + 63) / 64 * sizeof(*new_summary));
+    if (!new_summary) {
+        return -1;
+    }
+    fd_free_summary = new_summary;
+
+    for (int i = (old_words + 63) / 64; i < (new_words + 63) / 64; i++) {
+        fd_free_summary[i] = 0;
+    }
+    for (int i = file_descriptor_capacity; i < new_capacity; i++) {
+        file_descriptors[i] = NULL;
+    }
+    for (int i = old_words; i < new_words; i++) {
+        fd_free_map[i] = ~0ULL;
+        fd_free_summary[i / 64] |= 1ULL << (i % 64);
+    }
+    file_descriptor_capacity = new_capacity;
+    return 0;
+}
+
+enum ufs_error_code ufs_errno() {
+    return ufs_error_code;
+}
+
+int ufs_open(const char* filename, int flags) {
+    struct filedesc* desc = malloc(sizeof(struct filedesc));
+    if (!desc) {
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+
+    struct file* file = open_file(filename, (flags & UFS_CREATE) != 0);
+    if (!file) {
+        free(desc);
+        return -1;
+    }
+
+    int access_flags = flags & (UFS_READ_ONLY | UFS_WRITE_ONLY | UFS_READ_WRITE);
+    if (access_flags == 0) {
+        access_flags = UFS_READ_WRITE;
+    }
+
+    pthread_mutex_init(&desc->pos_lock, NULL);
+    desc->refs = 1;
+    desc->is_closed = false;
+    desc->file = file;
+    desc->pos = 0;
+    desc->flags = access_flags;
+    desc->borrows = 0;
+    desc->async_head = NULL;
+    desc->async_tail = NULL;
+
+    /* Resize can see the descriptor before it is installed, it is at 0. */
+    file_link_desc(file, desc);
+
+    pthread_rwlock_wrlock(&file_descriptors_lock);
+    int fd = fd_take();
+    if (fd == -1 && fd_grow() == 0) {
+        fd = fd_take();
+    }
+    if (fd == -1) {
+        pthread_rwlock_unlock(&file_descriptors_lock);
+        /* A just created file stays, it could be opened by others already. */
+        file_unlink_desc(file, desc);
+        pthread_mutex_destroy(&desc->pos_lock);
+        free(desc);
+        file_unref(file);
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+
+    file_descriptors[fd] = desc;
+    file_descriptor_count++;
+    pthread_rwlock_unlock(&file_descriptors_lock);
+
+    return fd;
+}
+
+/** Position in a vector of user buffers. */
+struct iov_cursor {
+    const struct ufs_iovec* iov;
+    size_t offset;
+};
+
+/** Total length of the buffers, saturated at SIZE_MAX. */
+static size_t iov_total(const struct ufs_iovec* iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].len > SIZE_MAX - total) {
+            return SIZE_MAX;
+        }
+        total += iov[i].len;
+    }
+    return total;
+}
+
+/**
+ * Copy @a size bytes to the buffers under the cursor and move it. A NULL
+ * @a src copies zeros.
+ */
+static void iov_copy_out(struct iov_cursor* c, const char* src, size_t size) {
+    while (size > 0) {
+        size_t n = MIN(size, c->iov->len - c->offset);
+        char* dst = (char*)c->iov->base + c->offset;
+        if (src != NULL) {
+            memcpy(dst, src, n);
+            src += n;
+        } else {
+            memset(dst, 0, n);
+        }
+        size -= n;
+        c->offset += n;
+        if (c->offset == c->iov->len) {
+            c->iov++;
+            c->offset = 0;
+        }
+    }
+}
+
+/** Copy @a size bytes from the buffers under the cursor and move it. */
+static void iov_copy_in(struct iov_cursor* c, char* dst, size_t size) {
+    while (size > 0) {
+        size_t n = MIN(size, c->iov->len - c->offset);
+        memcpy(dst, (const char*)c->iov->base + c->offset, n);
+        dst += n;
+        size -= n;
+        c->offset += n;
+        if (c->offset == c->iov->len) {
+            c->iov++;
+            c->offset = 0;
+        }
+    }
+}
+
+/**
+ * Write the buffers at @a pos. The blocks are walked once, each one is
+ * filled from as many buffers as cover it.
+ */
+static ssize_t file_write_at(struct file* file, size_t pos, const struct ufs_iovec* iov,
+                             int iovcnt) {
+    size_t size = iov_total(iov, iovcnt);
+    if (size > MAX_FILE_SIZE || pos > MAX_FILE_SIZE - size) {
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+
+    size_t old_size = file->size;
+    size_t new_size = pos + size;
+    if (new_size > file->size) {
+        if (extend_file(file, new_size) < 0) {
+            set_error(UFS_ERR_NO_MEM);
+            return -1;
+        }
+    }
+    if (materialize_blocks(file, pos, new_size) < 0) {
+        /* The blocks behind the old size are new, so this can't fail. */
+        if (file->size != old_size) {
+            shrink_file(file, old_size);
+        }
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+
+    struct iov_cursor cursor = {iov, 0};
+    size_t bytes_written = 0;
+    size_t current_pos = pos;
+
+    while (bytes_written < size) {
+        size_t block_index = current_pos / BLOCK_SIZE;
+        size_t offset = current_pos % BLOCK_SIZE;
+
+        struct block* blk = get_block(file, block_index);
+        size_t to_write = MIN(BLOCK_SIZE - offset, size - bytes_written);
+        block_touch(blk);
+        iov_copy_in(&cursor, blk->memory + offset, to_write);
+        bytes_written += to_write;
+        current_pos += to_write;
+    }
+
+    return bytes_written;
+}
+
+/** Index of the block after the last one of the file in [pos, pos + size). */
+static size_t file_range_end(const struct file* file, size_t pos, size_t size) {
+    if (pos >= file->size) {
+        return 0;
+    }
+    return (pos + MIN(size, file->size - pos) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static bool file_range_is_packed(const struct file* file, size_t pos, size_t size) {
+    if (__atomic_load_n(&compress_total.block_count, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+    size_t end = file_range_end(file, pos, size);
+    for (size_t i = pos / BLOCK_SIZE; i < end; i++) {
+        if (file->blocks[i] != NULL && block_is_packed(file->blocks[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Lock the file for a read of [pos, pos + size). Normally the lock is
+ * shared, but the compressed blocks of the range are replaced with plain ones
+ * first, so then the lock is exclusive until the read ends.
+ */
+static int file_lock_read(struct file* file, size_t pos, size_t size) {
+    pthread_rwlock_rdlock(&file->lock);
+    if (!file_range_is_packed(file, pos, size)) {
+        return 0;
+    }
+    pthread_rwlock_unlock(&file->lock);
+    pthread_rwlock_wrlock(&file->lock);
+    size_t end = file_range_end(file, pos, size);
+    for (size_t i = pos / BLOCK_SIZE; i < end; i++) {
+        struct block* blk = file->blocks[i];
+        if (blk != NULL && block_is_packed(blk)) {
+            blk = unpack_block(blk, 0);
+            if (!blk) {
+                pthread_rwlock_unlock(&file->lock);
+                set_error(UFS_ERR_NO_MEM);
+                return -1;
+            }
+            file->blocks[i] = blk;
+        }
+    }
+    return 0;
+}
+
+/** Read into the buffers from @a pos, walking the blocks once. */
+static ssize_t file_read_at(struct file* file, size_t pos, const struct ufs_iovec* iov,
+                            int iovcnt) {
+    if (pos >= file->size) {
+        return 0;
+    }
+
+    size_t bytes_to_read = MIN(iov_total(iov, iovcnt), file->size - pos);
+    struct iov_cursor cursor = {iov, 0};
+    size_t bytes_read = 0;
+    size_t current_pos = pos;
+
+    while (bytes_read < bytes_to_read) {
+        size_t block_index = current_pos / BLOCK_SIZE;
+        size_t offset = current_pos % BLOCK_SIZE;
+
+        struct block* blk = get_block(file, block_index);
+        size_t to_read = MIN(BLOCK_SIZE - offset, bytes_to_read - bytes_read);
+        /* Holes and the unallocated tails of the blocks are zeros. */
+        size_t stored = 0;
+        if (blk != NULL) {
+            block_touch(blk);
+        }
+        if (blk != NULL && offset < blk->capacity) {
+            stored = MIN(to_read, blk->capacity - offset);
+            iov_copy_out(&cursor, blk->memory + offset, stored);
+        }
+        iov_copy_out(&cursor, NULL, to_read - stored);
+        bytes_read += to_read;
+        current_pos += to_read;
+    }
+
+    return bytes_read;
+}
+
+ssize_t ufs_writev(int fd, const struct ufs_iovec* iov, int iovcnt) {
+    struct filedesc* desc = desc_acquire(fd);
+    if (!desc) {
+        return -1;
+    }
+    if (desc_check_access(desc, UFS_WRITE_ONLY | UFS_READ_WRITE) < 0) {
+        desc_release(desc);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&desc->file->lock);
+    ssize_t rc = file_write_at(desc->file, desc->pos, iov, iovcnt);
+    if (rc > 0) {
+        desc->pos += rc;
+    }
+    pthread_rwlock_unlock(&desc->file->lock);
+    desc_release(desc);
+    return rc;
+}
+
+ssize_t ufs_write(int fd, const char* buf, size_t size) {
+    struct ufs_iovec iov = {(void*)buf, size};
+    return ufs_writev(fd, &iov, 1);
+}
+
+ssize_t ufs_pwrite(int fd, const char* buf, size_t size, size_t offset) {
+    struct filedesc* desc = desc_get(fd);
+    if (!desc) {
+        return -1;
+    }
+    if (desc_check_access(desc, UFS_WRITE_ONLY | UFS_READ_WRITE) < 0) {
+        desc_put(desc);
+        return -1;
+    }
+
+    struct ufs_iovec iov = {(void*)buf, size};
+    pthread_rwlock_wrlock(&desc->file->lock);
+    ssize_t rc = file_write_at(desc->file, offset, &iov, 1);
+    pthread_rwlock_unlock(&desc->file->lock);
+    desc_put(desc);
+    return rc;
+}
+
+ssize_t ufs_readv(int fd, const struct ufs_iovec* iov, int iovcnt) {
+    struct filedesc* desc = desc_acquire(fd);
+    if (!desc) {
+        return -1;
+    }
+    if (desc_check_access(desc, UFS_READ_ONLY | UFS_READ_WRITE) < 0) {
+        desc_release(desc);
+        return -1;
+    }
+
+    if (file_lock_read(desc->file, desc->pos, iov_total(iov, iovcnt)) < 0) {
+        desc_release(desc);
+        return -1;
+    }
+    ssize_t rc = file_read_at(desc->file, desc->pos, iov, iovcnt);
+    desc->pos += rc;
+    pthread_rwlock_unlock(&desc->file->lock);
+    desc_release(desc);
+    return rc;
+}
+
+ssize_t ufs_read(int fd, char* buf, size_t size) {
+    struct ufs_iovec iov = {buf, size};
+    return ufs_readv(fd, &iov, 1);
+}
+
+ssize_t ufs_pread(int fd, char* buf, size_t size, size_t offset) {
+    struct filedesc* desc = desc_get(fd);
+    if (!desc) {
+        return -1;
+    }
+    if (desc_check_access(desc, UFS_READ_ONLY | UFS_READ_WRITE) < 0) {
+        desc_put(desc);
+        return -1;
+    }
+
+    /* Only the file is locked, so the reads of one descriptor run in parallel. */
+    struct ufs_iovec iov = {buf, size};
+    if (file_lock_read(desc->file, offset, size) < 0) {
+        desc_put(desc);
+        return -1;
+    }
+    ssize_t rc = file_read_at(desc->file, offset, &iov, 1);
+    pthread_rwlock_unlock(&desc->file->lock);
+    desc_put(desc);
+    return rc;
+}
+
+/**
+ * Borrow the blocks of the range [pos, pos + size) into at most @a *cnt
+ * buffers. A partially allocated or a shared block is replaced with a full
+ * private one first, so the later writes never move it.
+ */
+static ssize_t file_borrow_at(struct file* file, size_t pos, size_t size,
+                              struct ufs_iovec* out, int* cnt) {
+    size_t bytes_to_read = pos < file->size ? MIN(size, file->size - pos) : 0;
+    size_t bytes_read = 0;
+    size_t current_pos = pos;
+    int count = 0;
+
+    while (bytes_read < bytes_to_read && count < *cnt) {
+        size_t block_index = current_pos / BLOCK_SIZE;
+        size_t offset = current_pos % BLOCK_SIZE;
+
+        struct block* blk = get_block(file, block_index);
+        size_t to_read = MIN(BLOCK_SIZE - offset, bytes_to_read - bytes_read);
+        const char* memory = zero_block;
+        if (blk != NULL) {
+            blk = own_block(blk, BLOCK_SIZE, false);
+            if (blk == NULL) {
+                set_error(UFS_ERR_NO_MEM);
+                return -1;
+            }
+            file->blocks[block_index] = blk;
+            block_touch(blk);
+            memory = blk->memory;
+        }
+        out[count].base = (void*)(memory + offset);
+        out[count].len = to_read;
+        count++;
+        bytes_read += to_read;
+        current_pos += to_read;
+    }
+
+    *cnt = count;
+    return bytes_read;
+}
+
+ssize_t ufs_read_borrow(int fd, size_t size, struct ufs_iovec* out, int* cnt) {
+    struct filedesc* desc = desc_acquire(fd);
+    if (!desc) {
+        return -1;
+    }
+    if (desc_check_access(desc, UFS_READ_ONLY | UFS_READ_WRITE) < 0) {
+        desc_release(desc);
+        return -1;
+    }
+
+    /* Exclusive, because the blocks can be grown. */
+    pthread_rwlock_wrlock(&desc->file->lock);
+    ssize_t rc = file_borrow_at(desc->file, desc->pos, size, out, cnt);
+    if (rc > 0) {
+        desc->pos += rc;
+        desc->file->borrows++;
+        desc->borrows++;
+    }
+    pthread_rwlock_unlock(&desc->file->lock);
+    desc_release(desc);
+    return rc;
+}
+
+int ufs_read_release(int fd) {
+    struct filedesc* desc = desc_acquire(fd);
+    if (!desc) {
+        return -1;
+    }
+    if (desc->borrows == 0) {
+        desc_release(desc);
+        set_error(UFS_ERR_NO_FILE);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&desc->file->lock);
+    desc->file->borrows--;
+    desc->borrows--;
+    pthread_rwlock_unlock(&desc->file->lock);
+    desc_release(desc);
+    return 0;
+}
+
+int ufs_close(int fd) {
+    /* Wait for the position without the table locked. */
+    struct filedesc* desc = desc_acquire(fd);
+    if (!desc) {
+        return -1;
+    }
+    pthread_mutex_lock(&async_lock);
+    /* The borrowed memory would be freed under the borrower. */
+    bool is_busy = desc->borrows > 0 || desc->async_head != NULL;
+    desc->is_closed = !is_busy;
+    pthread_mutex_unlock(&async_lock);
+    pthread_mutex_unlock(&desc->pos_lock);
+    if (is_busy) {
+        desc_put(desc);
+        set_error(UFS_ERR_BUSY);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&file_descriptors_lock);
+    file_descriptors[fd] = NULL;
+    file_descriptor_count--;
+    fd_put(fd);
+    pthread_rwlock_unlock(&file_descriptors_lock);
+
+    /* The table's reference. The calls still running drop the rest. */
+    desc_put(desc);
+    desc_put(desc);
+    return 0;
+}
+
+int ufs_delete(const char* filename) {
+    size_t hash = name_hash(filename);
+    struct name_shard* shard = name_shard_of(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    struct file* file = name_table_find(&shard->table, filename, hash);
+    bool is_dir = file != NULL && file_is_dir(file);
+    if (file != NULL && !is_dir) {
+        namespace_remove(shard, file);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (file == NULL || is_dir) {
+        set_error(file == NULL ? UFS_ERR_NO_FILE : UFS_ERR_IS_DIR);
+        return -1;
+    }
+
+    /* The opened descriptors keep the file alive. */
+    file_unref(file);
+    return 0;
+}
+
+int ufs_mkdir(const char* path) {
+    if (!path_is_valid(path)) {
+        set_error(UFS_ERR_NO_FILE);
+        return -1;
+    }
+    struct file* dir = create_dir(path, name_hash(path), 1);
+    if (!dir) {
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    struct file* res = namespace_add(dir);
+    if (res == dir) {
+        return 0;
+    }
+    file_unref(dir);
+    if (res != NULL) {
+        file_unref(res);
+        set_error(UFS_ERR_EXISTS);
+    }
+    return -1;
+}
+
+static bool dir_is_empty(const struct file* dir) {
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        if (dir->children[i].count > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int ufs_rmdir(const char* path) {
+    size_t hash = name_hash(path);
+    struct name_shard* shard = name_shard_of(hash);
+    /* The entries are added and removed under the locks of their own shards. */
+    name_shards_lock_all(true);
+    struct file* dir = name_table_find(&shard->table, path, hash);
+    int rc = -1;
+    if (!dir) {
+        set_error(UFS_ERR_NO_FILE);
+    } else if (!file_is_dir(dir)) {
+        set_error(UFS_ERR_NOT_DIR);
+    } else if (!dir_is_empty(dir)) {
+        set_error(UFS_ERR_NOT_EMPTY);
+    } else {
+        namespace_remove(shard, dir);
+        rc = 0;
+    }
+    name_shards_unlock_all();
+    if (rc == 0) {
+        file_unref(dir);
+    }
+    return rc;
+}
+
+struct ufs_dir {
+    struct ufs_dirent* entries;
+    size_t count;
+    size_t pos;
+};
+
+void ufs_closedir(struct ufs_dir* d) {
+    for (size_t i = 0; i < d->count; i++) {
+        free((char*)d->entries[i].name);
+    }
+    free(d->entries);
+    free(d);
+}
+
+/** Copy the entries of the directory from one part of it. */
+static int dir_list_part(struct ufs_dir* d, const struct name_table* t) {
+    if (t->count == 0) {
+        return 0;
+    }
+    struct ufs_dirent* entries = realloc(d->entries, (d->count + t->count) * sizeof(*entries));
+    if (!entries) {
+        return -1;
+    }
+    d->entries = entries;
+    size_t pos = 0;
+    struct file* file;
+    while ((file = name_table_next(t, &pos)) != NULL) {
+        struct ufs_dirent* e = &d->entries[d->count];
+        e->name = strdup(path_base(file->name));
+        e->is_dir = file_is_dir(file);
+        if (!e->name) {
+            return -1;
+        }
+        d->count++;
+    }
+    return 0;
+}
+
+struct ufs_dir* ufs_opendir(const char* path) {
+    struct file* dir = &root_dir;
+    if (path[0] != 0 && strcmp(path, "/") != 0) {
+        dir = namespace_find(path);
+        if (!dir) {
+            return NULL;
+        }
+    } else {
+        file_ref(dir);
+    }
+    struct ufs_dir* d = NULL;
+    if (!file_is_dir(dir)) {
+        set_error(UFS_ERR_NOT_DIR);
+    } else if ((d = calloc(1, sizeof(*d))) == NULL) {
+        set_error(UFS_ERR_NO_MEM);
+    } else {
+        /* Each part is copied under its own lock, the reference keeps the directory. */
+        for (int i = 0; i < NAME_SHARD_COUNT && d != NULL; i++) {
+            pthread_rwlock_rdlock(&name_shards[i].lock);
+            int rc = dir_list_part(d, &dir->children[i]);
+            pthread_rwlock_unlock(&name_shards[i].lock);
+            if (rc < 0) {
+                ufs_closedir(d);
+                d = NULL;
+                set_error(UFS_ERR_NO_MEM);
+            }
+        }
+    }
+    file_unref(dir);
+    return d;
+}
+
+const struct ufs_dirent* ufs_readdir(struct ufs_dir* d) {
+    return d->pos < d->count ? &d->entries[d->pos++] : NULL;
+}
+
+enum ufs_async_type {
+    UFS_ASYNC_WRITE,
+    UFS_ASYNC_READ,
+    UFS_ASYNC_DELETE,
+};
+
+struct ufs_async {
+    enum ufs_async_type type;
+    int fd;
+    /** Descriptor of the call, NULL for a delete. */
+    struct filedesc* desc;
+    char* buf;
+    size_t size;
+    char* filename;
+    struct thread_pool* pool;
+    struct thread_task* task;
+    /** The task was pushed to the pool, so it is joined there too. */
+    bool is_pushed;
+    bool is_done;
+    ssize_t result;
+    enum ufs_error_code error;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /** Next call on the same descriptor. */
+    struct ufs_async* next;
+};
+
+static void async_run_one(struct ufs_async* op) {
+    switch (op->type) {
+    case UFS_ASYNC_WRITE:
+        op->result = ufs_write(op->fd, op->buf, op->size);
+        break;
+    case UFS_ASYNC_READ:
+        op->result = ufs_read(op->fd, op->buf, op->size);
+        break;
+    case UFS_ASYNC_DELETE:
+        op->result = ufs_delete(op->filename);
+        break;
+    }
+    op->error = op->result < 0 ? ufs_errno() : UFS_ERR_NO_ERR;
+}
+
+static void async_complete(struct ufs_async* op) {
+    pthread_mutex_lock(&op->lock);
+    op->is_done = true;
+    pthread_cond_broadcast(&op->cond);
+    pthread_mutex_unlock(&op->lock);
+}
+
+/**
+ * Run the call and start the next one on the descriptor. The next task is
+ * pushed only now, so the calls on a descriptor never run in parallel. When
+ * the pool is full it is run right here instead.
+ */
+static void* async_task_f(void* arg) {
+    struct ufs_async* op = arg;
+    while (op != NULL) {
+        async_run_one(op);
+        struct ufs_async* next = NULL;
+        if (op->desc != NULL) {
+            pthread_mutex_lock(&async_lock);
+            struct filedesc* desc = op->desc;
+            desc->async_head = op->next;
+            if (desc->async_head == NULL) {
+                desc->async_tail = NULL;
+            } else {
+                next = desc->async_head;
+                if (thread_pool_push_task(next->pool, next->task) == 0) {
+                    next->is_pushed = true;
+                    next = NULL;
+                }
+            }
+            pthread_mutex_unlock(&async_lock);
+        }
+        async_complete(op);
+        op = next;
+    }
+    return NULL;
+}
+
+static struct ufs_async* async_new(struct thread_pool* pool, enum ufs_async_type type) {
+    struct ufs_async* op = calloc(1, sizeof(*op));
+    if (!op) {
+        set_error(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    if (thread_task_new(&op->task, async_task_f, op) != 0) {
+        free(op);
+        set_error(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    op->type = type;
+    op->pool = pool;
+    pthread_mutex_init(&op->lock, NULL);
+    pthread_cond_init(&op->cond, NULL);
+    return op;
+}
+
+static void async_free(struct ufs_async* op) {
+    thread_task_delete(op->task);
+    pthread_mutex_destroy(&op->lock);
+    pthread_cond_destroy(&op->cond);
+    free(op->filename);
+    free(op);
+}
+
+static struct ufs_async* async_submit_fd(struct thread_pool* pool, enum ufs_async_type type,
+                                         int fd, char* buf, size_t size) {
+    struct ufs_async* op = async_new(pool, type);
+    if (!op) {
+        return NULL;
+    }
+    op->fd = fd;
+    op->buf = buf;
+    op->size = size;
+
+    /* The descriptor can't be closed while it has calls in the queue. */
+    struct filedesc* desc = desc_get(fd);
+    if (!desc) {
+        async_free(op);
+        return NULL;
+    }
+    op->desc = desc;
+    pthread_mutex_lock(&async_lock);
+    if (desc->is_closed) {
+        pthread_mutex_unlock(&async_lock);
+        desc_put(desc);
+        async_free(op);
+        set_error(UFS_ERR_NO_FILE);
+        return NULL;
+    }
+    if (desc->async_tail != NULL) {
+        /* Pushed by the previous call when it is finished. */
+        desc->async_tail->next = op;
+        desc->async_tail = op;
+    } else if (thread_pool_push_task(pool, op->task) == 0) {
+        op->is_pushed = true;
+        desc->async_head = op;
+        desc->async_tail = op;
+    } else {
+        pthread_mutex_unlock(&async_lock);
+        desc_put(desc);
+        async_free(op);
+        set_error(UFS_ERR_BUSY);
+        return NULL;
+    }
+    pthread_mutex_unlock(&async_lock);
+    desc_put(desc);
+    return op;
+}
+
+struct ufs_async* ufs_write_async(struct thread_pool* pool, int fd, const char* buf,
+                                  size_t size) {
+    return async_submit_fd(pool, UFS_ASYNC_WRITE, fd, (char*)buf, size);
+}
+
+struct ufs_async* ufs_read_async(struct thread_pool* pool, int fd, char* buf, size_t size) {
+    return async_submit_fd(pool, UFS_ASYNC_READ, fd, buf, size);
+}
+
+struct ufs_async* ufs_delete_async(struct thread_pool* pool, const char* filename) {
+    struct ufs_async* op = async_new(pool, UFS_ASYNC_DELETE);
+    if (!op) {
+        return NULL;
+    }
+    op->filename = strdup(filename);
+    if (!op->filename) {
+        async_free(op);
+        set_error(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    if (thread_pool_push_task(pool, op->task) != 0) {
+        async_free(op);
+        set_error(UFS_ERR_BUSY);
+        return NULL;
+    }
+    op->is_pushed = true;
+    return op;
+}
+
+bool ufs_async_is_done(struct ufs_async* op) {
+    pthread_mutex_lock(&op->lock);
+    bool is_done = op->is_done;
+    pthread_mutex_unlock(&op->lock);
+    return is_done;
+}
+
+ssize_t ufs_async_join(struct ufs_async* op) {
+    pthread_mutex_lock(&op->lock);
+    while (!op->is_done) {
+        pthread_cond_wait(&op->cond, &op->lock);
+    }
+    pthread_mutex_unlock(&op->lock);
+    /* The pool counts the task as running until it returns. */
+    if (op->is_pushed) {
+        thread_task_join(op->task, NULL);
+    }
+    ssize_t result = op->result;
+    set_error(op->error);
+    async_free(op);
+    return result;
+}
+
+/**
+ * Take the blocks of the file for a clone or a snapshot. They are shared,
+ * unless the file has borrowed ranges. The borrowed blocks must stay private
+ * to it, so then all of them are copied, except the compressed ones which
+ * are never borrowed.
+ */
+static struct block** file_share_blocks(struct file* file) {
+    if (file->block_count == 0) {
+        return NULL;
+    }
+    struct block** blocks = malloc(file->block_count * sizeof(*blocks));
+    if (!blocks) {
+        return NULL;
+    }
+    for (size_t i = 0; i < file->block_count; i++) {
+        struct block* blk = file->blocks[i];
+        if (blk == NULL || file->borrows == 0 || block_is_packed(blk)) {
+            blocks[i] = ref_block(blk);
+            continue;
+        }
+        blocks[i] = copy_block(blk, blk->capacity, 0);
+        if (!blocks[i]) {
+            while (i > 0) {
+                free_block(blocks[--i]);
+            }
+            free(blocks);
+            return NULL;
+        }
+    }
+    return blocks;
+}
+
+/** Replace the data of the file with the blocks, taking their references. */
+static void file_set_blocks(struct file* file, struct block** blocks, size_t block_count,
+                            size_t size) {
+    truncate_blocks(file, 0);
+    free(file->blocks);
+    file->blocks = blocks;
+    file->block_count = block_count;
+    file->block_capacity = block_count;
+    file->size = size;
+    for (struct filedesc* d = file->descs; d != NULL; d = d->file_next) {
+        if (d->pos > size) {
+            d->pos = size;
+        }
+    }
+}
+
+static int file_clone(struct file* dst, struct file* src) {
+    if (dst->borrows > 0) {
+        set_error(UFS_ERR_BUSY);
+        return -1;
+    }
+    struct block** blocks = file_share_blocks(src);
+    if (!blocks && src->block_count > 0) {
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    file_set_blocks(dst, blocks, src->block_count, src->size);
+    return 0;
+}
+
+int ufs_clone(const char* src_name, const char* dst_name) {
+    struct file* src = open_file(src_name, false);
+    if (!src) {
+        return -1;
+    }
+    struct file* dst = open_file(dst_name, true);
+    if (!dst) {
+        file_unref(src);
+        return -1;
+    }
+
+    int rc = 0;
+    if (src != dst) {
+        /* Two files are locked by address, so the clones back and forth can't deadlock. */
+        if (src < dst) {
+            pthread_rwlock_rdlock(&src->lock);
+            pthread_rwlock_wrlock(&dst->lock);
+        } else {
+            pthread_rwlock_wrlock(&dst->lock);
+            pthread_rwlock_rdlock(&src->lock);
+        }
+        rc = file_clone(dst, src);
+        pthread_rwlock_unlock(&src->lock);
+        pthread_rwlock_unlock(&dst->lock);
+    }
+    file_unref(dst);
+    file_unref(src);
+    return rc;
+}
+
+/** Blocks smaller than this are not worth compressing. */
+#define COMPRESS_MIN_SIZE 1024
+
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t compress_thread;
+static bool compress_is_running = false;
+static bool compress_is_stopping = false;
+static unsigned compress_cold_sec = 0;
+
+/** Serializes the passes, protects the buffer and the clock base. */
+static pthread_mutex_t compress_pass_lock = PTHREAD_MUTEX_INITIALIZER;
+static char compress_buf[BLOCK_SIZE];
+static time_t compress_base = 0;
+
+/** Move the epoch of the accesses to the current second. */
+static uint32_t compress_tick(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (compress_now == 0) {
+        compress_base = ts.tv_sec;
+    }
+    uint32_t now = 1 + (uint32_t)(ts.tv_sec - compress_base);
+    __atomic_store_n(&compress_now, now, __ATOMIC_RELAXED);
+    return now;
+}
+
+/**
+ * Cold blocks are private to one file, so the pointer to them can be
+ * replaced. A block untouched since the compressor started is cold when the
+ * compressor runs long enough.
+ */
+static bool block_is_cold(struct block* blk, uint32_t now, unsigned cold_sec) {
+    return !block_is_packed(blk) && !block_is_shared(blk) &&
+           blk->touched != BLOCK_INCOMPRESSIBLE && blk->capacity >= COMPRESS_MIN_SIZE &&
+           now - blk->touched >= cold_sec;
+}
+
+/** Reference the file unless its last reference is already dropped. */
+static bool file_try_ref(struct file* file) {
+    int refs = __atomic_load_n(&file->refs, __ATOMIC_RELAXED);
+    while (refs > 0 && !__atomic_compare_exchange_n(&file->refs, &refs, refs + 1, false,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    }
+    return refs > 0;
+}
+
+/**
+ * Compress the cold blocks of the file. The lock is taken for each block and
+ * only if it is free, so a busy file is skipped and an access waits for one
+ * block at most. The files with borrowed ranges are skipped too.
+ */
+static size_t compress_file(struct file* file, uint32_t now, unsigned cold_sec) {
+    size_t count = 0;
+    for (size_t i = 0;; i++) {
+        if (pthread_rwlock_trywrlock(&file->lock) != 0) {
+            return count;
+        }
+        if (i >= file->block_count || file->borrows > 0) {
+            pthread_rwlock_unlock(&file->lock);
+            return count;
+        }
+        struct block* blk = file->blocks[i];
+        if (blk != NULL && block_is_cold(blk, now, cold_sec)) {
+            struct block* res = pack_block(blk, compress_buf);
+            if (res != NULL) {
+                file->blocks[i] = res;
+                count++;
+            } else {
+                blk->touched = BLOCK_INCOMPRESSIBLE;
+            }
+        }
+        pthread_rwlock_unlock(&file->lock);
+    }
+}
+
+/** The first file from @a file on which is still alive, referenced. */
+static struct file* compress_next_file(struct file* file) {
+    while (file != NULL && !file_try_ref(file)) {
+        file = file->next;
+    }
+    return file;
+}
+
+size_t ufs_compress_cold(unsigned cold_sec) {
+    pthread_mutex_lock(&compress_pass_lock);
+    /* The image keeps only the full plain blocks. */
+    if (image_fd >= 0) {
+        pthread_mutex_unlock(&compress_pass_lock);
+        return 0;
+    }
+    uint32_t now = compress_tick();
+    size_t count = 0;
+    pthread_mutex_lock(&file_list_lock);
+    struct file* file = compress_next_file(file_list);
+    pthread_mutex_unlock(&file_list_lock);
+    while (file != NULL) {
+        count += compress_file(file, now, cold_sec);
+        /* The referenced file stays in the list, so its link is valid. */
+        pthread_mutex_lock(&file_list_lock);
+        struct file* next = compress_next_file(file->next);
+        pthread_mutex_unlock(&file_list_lock);
+        file_unref(file);
+        file = next;
+    }
+    pthread_mutex_unlock(&compress_pass_lock);
+    return count;
+}
+
+static void* compress_thread_f(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&compress_lock);
+    while (!compress_is_stopping) {
+        unsigned cold_sec = compress_cold_sec;
+        pthread_mutex_unlock(&compress_lock);
+        ufs_compress_cold(cold_sec);
+        pthread_mutex_lock(&compress_lock);
+        if (compress_is_stopping) {
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec++;
+        pthread_cond_timedwait(&compress_cond, &compress_lock, &deadline);
+    }
+    pthread_mutex_unlock(&compress_lock);
+    return NULL;
+}
+
+int ufs_compress_start(unsigned cold_sec) {
+    pthread_mutex_lock(&compress_lock);
+    if (compress_is_running) {
+        pthread_mutex_unlock(&compress_lock);
+        set_error(UFS_ERR_BUSY);
+        return -1;
+    }
+    compress_cold_sec = cold_sec;
+    compress_is_stopping = false;
+    if (pthread_create(&compress_thread, NULL, compress_thread_f, NULL) != 0) {
+        pthread_mutex_unlock(&compress_lock);
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    compress_is_running = true;
+    pthread_mutex_unlock(&compress_lock);
+    return 0;
+}
+
+void ufs_compress_stop(void) {
+    pthread_mutex_lock(&compress_lock);
+    if (!compress_is_running) {
+        pthread_mutex_unlock(&compress_lock);
+        return;
+    }
+    compress_is_stopping = true;
+    pthread_cond_signal(&compress_cond);
+    pthread_mutex_unlock(&compress_lock);
+    pthread_join(compress_thread, NULL);
+    pthread_mutex_lock(&compress_lock);
+    compress_is_running = false;
+    pthread_mutex_unlock(&compress_lock);
+}
+
+int ufs_compress_stat(int fd, struct ufs_compress_stat* stat) {
+    struct filedesc* desc = desc_get(fd);
+    if (!desc) {
+        return -1;
+    }
+    memset(stat, 0, sizeof(*stat));
+    struct file* file = desc->file;
+    pthread_rwlock_rdlock(&file->lock);
+    for (size_t i = 0; i < file->block_count; i++) {
+        struct block* blk = file->blocks[i];
+        if (blk != NULL && block_is_packed(blk)) {
+            stat->block_count++;
+            stat->data_size += blk->capacity;
+            stat->packed_size += blk->packed_size;
+        }
+    }
+    pthread_rwlock_unlock(&file->lock);
+    desc_put(desc);
+    return 0;
+}
+
+void ufs_compress_stat_total(struct ufs_compress_stat* stat) {
+    stat->block_count = __atomic_load_n(&compress_total.block_count, __ATOMIC_RELAXED);
+    stat->data_size = __atomic_load_n(&compress_total.data_size, __ATOMIC_RELAXED);
+    stat->packed_size = __atomic_load_n(&compress_total.packed_size, __ATOMIC_RELAXED);
+}
+
+struct ufs_snapshot_file {
+    char* name;
+    bool is_dir;
+    size_t size;
+    size_t block_count;
+    struct block** blocks;
+};
+
+struct ufs_snapshot {
+    struct ufs_snapshot_file* files;
+    size_t count;
+};
+
+void ufs_snapshot_delete(struct ufs_snapshot* snapshot) {
+    for (size_t i = 0; i < snapshot->count; i++) {
+        struct ufs_snapshot_file* f = &snapshot->files[i];
+        for (size_t j = 0; j < f->block_count; j++) {
+            free_block(f->blocks[j]);
+        }
+        free(f->blocks);
+        free(f->name);
+    }
+    free(snapshot->files);
+    free(snapshot);
+}
+
+/**
+ * Take references to all the files of the namespace. The shards are locked
+ * all at once, so each file comes along with its directory.
+ */
+static int namespace_collect(struct file*** files, size_t* count) {
+    *files = NULL;
+    *count = 0;
+    name_shards_lock_all(false);
+    size_t total = 0;
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        total += name_shards[i].table.count;
+    }
+    if (total > 0 && (*files = malloc(total * sizeof(**files))) == NULL) {
+        name_shards_unlock_all();
+        return -1;
+    }
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        size_t pos = 0;
+        struct file* file;
+        while ((file = name_table_next(&name_shards[i].table, &pos)) != NULL) {
+            file_ref(file);
+            (*files)[(*count)++] = file;
+        }
+    }
+    name_shards_unlock_all();
+    return 0;
+}
+
+struct ufs_snapshot* ufs_snapshot(void) {
+    struct file** files;
+    size_t count;
+    if (namespace_collect(&files, &count) < 0) {
+        set_error(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    struct ufs_snapshot* snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot != NULL && count > 0) {
+        snapshot->files = calloc(count, sizeof(*snapshot->files));
+    }
+
+    bool failed = snapshot == NULL || (count > 0 && snapshot->files == NULL);
+    for (size_t i = 0; i < count; i++) {
+        struct file* file = files[i];
+        if (!failed) {
+            struct ufs_snapshot_file* f = &snapshot->files[snapshot->count];
+            pthread_rwlock_rdlock(&file->lock);
+            f->name = strdup(file->name);
+            f->is_dir = file_is_dir(file);
+            f->blocks = file_share_blocks(file);
+            f->block_count = file->block_count;
+            f->size = file->size;
+            pthread_rwlock_unlock(&file->lock);
+            /* Counted even if failed, so the delete frees whatever is taken. */
+            snapshot->count++;
+            failed = f->name == NULL || (f->blocks == NULL && f->block_count > 0);
+            if (f->blocks == NULL) {
+                f->block_count = 0;
+            }
+        }
+        file_unref(file);
+    }
+    free(files);
+
+    if (failed) {
+        if (snapshot != NULL) {
+            ufs_snapshot_delete(snapshot);
+        }
+        set_error(UFS_ERR_NO_MEM);
+        return NULL;
+    }
+    return snapshot;
+}
+
+/** Put each file of the new namespace into its directory. */
+static int namespace_link(struct name_table* tables, struct name_table* root) {
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        size_t pos = 0;
+        struct file* file;
+        while ((file = name_table_next(&tables[i], &pos)) != NULL) {
+            size_t dir_len = path_dir_len(file->name);
+            struct file* dir = &root_dir;
+            struct name_table* children = root;
+            if (dir_len > 0) {
+                size_t hash = name_hash_n(file->name, dir_len);
+                dir = name_table_find_n(&tables[name_shard_index(hash)], file->name, dir_len,
+                                        hash);
+                if (dir == NULL || !file_is_dir(dir)) {
+                    set_error(UFS_ERR_NO_FILE);
+                    return -1;
+                }
+                children = dir->children;
+            }
+            if (name_table_insert(&children[i], file) < 0) {
+                set_error(UFS_ERR_NO_MEM);
+                return -1;
+            }
+            file->parent = dir;
+        }
+    }
+    return 0;
+}
+
+static void namespace_tables_free(struct name_table* tables, struct name_table* root) {
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        size_t pos = 0;
+        struct file* file;
+        while ((file = name_table_next(&tables[i], &pos)) != NULL) {
+            file_unref(file);
+        }
+        name_table_destroy(&tables[i]);
+        name_table_destroy(&root[i]);
+    }
+}
+
+int ufs_restore(const struct ufs_snapshot* snapshot) {
+    /*
+     * The new namespace is built aside and swapped in at once under all the
+     * shard locks, so a lookup sees either the old files or the restored.
+     */
+    struct name_table tables[NAME_SHARD_COUNT];
+    struct name_table root[NAME_SHARD_COUNT];
+    memset(tables, 0, sizeof(tables));
+    memset(root, 0, sizeof(root));
+    size_t done = 0;
+    for (; done < snapshot->count; done++) {
+        const struct ufs_snapshot_file* f = &snapshot->files[done];
+        size_t hash = name_hash(f->name);
+        struct block** blocks = NULL;
+        if (f->block_count > 0) {
+            blocks = malloc(f->block_count * sizeof(*blocks));
+            if (!blocks) {
+                break;
+            }
+        }
+        struct file* file = f->is_dir ? create_dir(f->name, hash, 1) : create_file(f->name, hash, 1);
+        if (!file) {
+            free(blocks);
+            break;
+        }
+        for (size_t i = 0; i < f->block_count; i++) {
+            blocks[i] = ref_block(f->blocks[i]);
+        }
+        file_set_blocks(file, blocks, f->block_count, f->size);
+        if (name_table_insert(&tables[name_shard_index(hash)], file) < 0) {
+            file_unref(file);
+            break;
+        }
+    }
+    if (done < snapshot->count) {
+        namespace_tables_free(tables, root);
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+    if (namespace_link(tables, root) < 0) {
+        namespace_tables_free(tables, root);
+        return -1;
+    }
+
+    name_shards_lock_all(true);
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        struct name_table old = name_shards[i].table;
+        name_shards[i].table = tables[i];
+        tables[i] = old;
+        old = root_children[i];
+        root_children[i] = root[i];
+        root[i] = old;
+    }
+    name_shards_unlock_all();
+
+    /* The replaced files live on while they have opened descriptors. */
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        size_t pos = 0;
+        struct file* file;
+        while ((file = name_table_next(&tables[i], &pos)) != NULL) {
+            file_unref(file);
+        }
+        name_table_destroy(&tables[i]);
+        name_table_destroy(&root[i]);
+    }
+    return 0;
+}
+
+/**
+ * The image file starts with two header slots. A checkpoint writes the
+ * header to the slot of its generation, so the previous header stays valid
+ * until the new one is completely on the disk, and the load takes the valid
+ * one of the newest generation. The slab regions go behind the headers.
+ *
+ * The metadata of a checkpoint is a table of the files stored in a chain of
+ * slab blocks: a count of files, then per file the name length, the type,
+ * the name, the size, the block count and the slot numbers of the blocks.
+ *
+ * The checkpoint keeps references to its blocks, so any later change copies
+ * a block to another slot and the data of the checkpoint stays intact until
+ * the next one replaces it.
+ */
+#define IMAGE_MAGIC 0x32454741494d4655ULL
+#define IMAGE_HEADER_SIZE 4096
+#define IMAGE_DATA_OFFSET (64 * 1024)
+#define IMAGE_NO_SLOT UINT32_MAX
+#define IMAGE_TYPE_FILE 0
+#define IMAGE_TYPE_DIR 1
+/** Metadata bytes in a block, the rest is the number of the next one. */
+#define IMAGE_META_PER_BLOCK (BLOCK_SIZE - sizeof(uint32_t))
+
+struct image_header {
+    uint64_t magic;
+    uint64_t generation;
+    uint64_t slot_size;
+    uint64_t region_count;
+    uint64_t meta_size;
+    uint64_t meta_slot;
+    uint64_t checksum;
+};
+
+static struct slab_region** image_regions = NULL;
+static size_t image_region_count = 0;
+static size_t image_region_capacity = 0;
+static uint64_t image_generation = 0;
+/** The last checkpoint and the blocks of its metadata. */
+static struct ufs_snapshot* image_checkpoint = NULL;
+static struct block** image_meta_blocks = NULL;
+static size_t image_meta_block_count = 0;
+static pthread_mutex_t image_sync_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t image_header_checksum(const struct image_header* h) {
+    uint64_t sum = 14695981039346656037ULL;
+    const unsigned char* p = (const unsigned char*)h;
+    for (size_t i = 0; i < offsetof(struct image_header, checksum); i++) {
+        sum = (sum ^ p[i]) * 1099511628211ULL;
+    }
+    return sum;
+}
+
+/** Map the region at the index of the image file. */
+static int image_map_region(struct slab_region* r) {
+    if (image_region_count == image_region_capacity) {
+        size_t new_capacity = image_region_capacity == 0 ? 16 : image_region_capacity * 2;
+        struct slab_region** new_regions =
+            realloc(image_regions, new_capacity * sizeof(*new_regions));
+        if (!new_regions) {
+            return -1;
+        }
+        image_regions = new_regions;
+        image_region_capacity = new_capacity;
+    }
+    size_t index = image_region_count;
+    r->base = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd,
+                   IMAGE_DATA_OFFSET + index * SLAB_REGION_SIZE);
+    if (r->base == MAP_FAILED) {
+        return -1;
+    }
+    r->index = index;
+    image_regions[image_region_count++] = r;
+    return 0;
+}
+
+/** Extend the image file by a region and map it. Called under the slab lock. */
+static int image_add_region(struct slab_region* r) {
+    /* The new part of the file reads as zeros, like anonymous memory. */
+    if (ftruncate(image_fd, IMAGE_DATA_OFFSET + (image_region_count + 1) * SLAB_REGION_SIZE) < 0) {
+        return -1;
+    }
+    return image_map_region(r);
+}
+
+static uint32_t image_slot_of(const struct block* blk) {
+    const struct slab_region* r = blk->region;
+    return r->index * SLAB_REGION_SLOTS + ((const char*)blk - r->base) / SLAB_SLOT_SIZE;
+}
+
+static struct block* image_block_at(uint32_t slot) {
+    struct slab_region* r = image_regions[slot / SLAB_REGION_SLOTS];
+    return (struct block*)(r->base + slot % SLAB_REGION_SLOTS * SLAB_SLOT_SIZE);
+}
+
+static uint32_t* image_meta_next(struct block* blk) {
+    return (uint32_t*)(blk->memory + IMAGE_META_PER_BLOCK);
+}
+
+static void image_free_meta(struct block** blocks, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free_block(blocks[i]);
+    }
+    free(blocks);
+}
+
+/** Serialize the file table of the snapshot. */
+static char* image_meta_build(const struct ufs_snapshot* snapshot, size_t* size) {
+    *size = sizeof(uint64_t);
+    for (size_t i = 0; i < snapshot->count; i++) {
+        const struct ufs_snapshot_file* f = &snapshot->files[i];
+        *size += 2 * sizeof(uint32_t) + strlen(f->name) + 2 * sizeof(uint64_t) +
+                 f->block_count * sizeof(uint32_t);
+    }
+    char* meta = malloc(*size);
+    if (!meta) {
+        return NULL;
+    }
+    char* pos = meta;
+    uint64_t count = snapshot->count;
+    memcpy(pos, &count, sizeof(count));
+    pos += sizeof(count);
+    for (size_t i = 0; i < snapshot->count; i++) {
+        const struct ufs_snapshot_file* f = &snapshot->files[i];
+        uint32_t name_len = strlen(f->name);
+        uint32_t type = f->is_dir ? IMAGE_TYPE_DIR : IMAGE_TYPE_FILE;
+        uint64_t file_size = f->size;
+        uint64_t block_count = f->block_count;
+        memcpy(pos, &name_len, sizeof(name_len));
+        pos += sizeof(name_len);
+        memcpy(pos, &type, sizeof(type));
+        pos += sizeof(type);
+        memcpy(pos, f->name, name_len);
+        pos += name_len;
+        memcpy(pos, &file_size, sizeof(file_size));
+        pos += sizeof(file_size);
+        memcpy(pos, &block_count, sizeof(block_count));
+        pos += sizeof(block_count);
+        for (size_t j = 0; j < f->block_count; j++) {
+            uint32_t slot = f->blocks[j] != NULL ? image_slot_of(f->blocks[j]) : IMAGE_NO_SLOT;
+            memcpy(pos, &slot, sizeof(slot));
+            pos += sizeof(slot);
+        }
+    }
+    return meta;
 }
 
-static struct block* create_block() {
-    struct block* blk = malloc(sizeof(struct block));
-    if (!blk) {
+/** Store the metadata in a chain of new blocks. */
+static struct block** image_meta_store(const char* meta, size_t size, size_t* count) {
+    *count = (size + IMAGE_META_PER_BLOCK - 1) / IMAGE_META_PER_BLOCK;
+    struct block** blocks = calloc(*count, sizeof(*blocks));
+    if (!blocks) {
         return NULL;
     }
-    
-    blk->memory = malloc(BLOCK_SIZE);
-    if (!blk->memory) {
-        free(blk);
-        return NULL;
+    for (size_t i = 0; i < *count; i++) {
+        blocks[i] = create_block(BLOCK_SIZE, true);
+        if (!blocks[i]) {
+            image_free_meta(blocks, i);
+            return NULL;
+        }
     }
-    memset(blk->memory, 0, BLOCK_SIZE);
-    blk->next = NULL;
-    blk->prev = NULL;
-    return blk;
+    for (size_t i = 0; i < *count; i++) {
+        size_t offset = i * IMAGE_META_PER_BLOCK;
+        memcpy(blocks[i]->memory, meta + offset, MIN(size - offset, IMAGE_META_PER_BLOCK));
+        *image_meta_next(blocks[i]) = i + 1 < *count ? image_slot_of(blocks[i + 1]) : IMAGE_NO_SLOT;
+    }
+    return blocks;
 }
 
-static int extend_file(struct file* file, size_t new_size) {
-    if (new_size <= file->size) {
-        return 0;
-    }
-    
-    size_t current_blocks = (file->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    size_t needed_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    size_t blocks_to_add = needed_blocks - current_blocks;
-    
-    for (size_t i = 0; i < blocks_to_add; i++) {
-        struct block* blk = create_block();
-        if (!blk) {
+/** Write the dirty pages of the regions and then the header. */
+static int image_commit(const struct image_header* header) {
+    pthread_mutex_lock(&slab_lock);
+    size_t count = image_region_count;
+    pthread_mutex_unlock(&slab_lock);
+    /* The regions are never unmapped while the image is open. */
+    for (size_t i = 0; i < count; i++) {
+        if (msync(image_regions[i]->base, SLAB_REGION_SIZE, MS_SYNC) < 0) {
             return -1;
         }
-        
-        if (file->last_block) {
-            file->last_block->next = blk;
-            blk->prev = file->last_block;
-        } else {
-            file->block_list = blk;
-        }
-        file->last_block = blk;
     }
-    
-    file->size = new_size;
+    off_t offset = header->generation % 2 * IMAGE_HEADER_SIZE;
+    if (pwrite(image_fd, header, sizeof(*header), offset) != (ssize_t)sizeof(*header) ||
+        fdatasync(image_fd) < 0) {
+        return -1;
+    }
     return 0;
 }
 
-static struct block* get_block(struct file* file, size_t block_index) {
-    struct block* blk = file->block_list;
-    for (size_t i = 0; i < block_index && blk != NULL; i++) {
-        blk = blk->next;
+int ufs_sync(void) {
+    if (image_fd < 0) {
+        set_error(UFS_ERR_NO_FILE);
+        return -1;
+    }
+    pthread_mutex_lock(&image_sync_lock);
+    struct ufs_snapshot* snapshot = ufs_snapshot();
+    if (!snapshot) {
+        pthread_mutex_unlock(&image_sync_lock);
+        return -1;
+    }
+    size_t meta_size;
+    size_t meta_count = 0;
+    struct block** meta_blocks = NULL;
+    char* meta = image_meta_build(snapshot, &meta_size);
+    if (meta != NULL) {
+        meta_blocks = image_meta_store(meta, meta_size, &meta_count);
+        free(meta);
+    }
+    if (!meta_blocks) {
+        ufs_snapshot_delete(snapshot);
+        pthread_mutex_unlock(&image_sync_lock);
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
+    }
+
+    struct image_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = IMAGE_MAGIC;
+    header.generation = image_generation + 1;
+    header.slot_size = SLAB_SLOT_SIZE;
+    pthread_mutex_lock(&slab_lock);
+    header.region_count = image_region_count;
+    pthread_mutex_unlock(&slab_lock);
+    header.meta_size = meta_size;
+    header.meta_slot = image_slot_of(meta_blocks[0]);
+    header.checksum = image_header_checksum(&header);
+    if (image_commit(&header) < 0) {
+        image_free_meta(meta_blocks, meta_count);
+        ufs_snapshot_delete(snapshot);
+        pthread_mutex_unlock(&image_sync_lock);
+        set_error(UFS_ERR_IO);
+        return -1;
+    }
+
+    /* The old checkpoint is not needed anymore, its blocks can be reused. */
+    if (image_checkpoint != NULL) {
+        ufs_snapshot_delete(image_checkpoint);
+    }
+    image_free_meta(image_meta_blocks, image_meta_block_count);
+    image_checkpoint = snapshot;
+    image_meta_blocks = meta_blocks;
+    image_meta_block_count = meta_count;
+    image_generation = header.generation;
+    pthread_mutex_unlock(&image_sync_lock);
+    return 0;
+}
+
+/** Take the block of a slot referenced by the metadata. */
+static struct block* image_load_block(uint32_t slot, const struct image_header* header,
+                                      bool* is_loaded) {
+    if (slot >= header->region_count * SLAB_REGION_SLOTS) {
+        return NULL;
+    }
+    struct block* blk = image_block_at(slot);
+    if (is_loaded[slot]) {
+        blk->refs++;
+        return blk;
     }
+    is_loaded[slot] = true;
+    blk->capacity = BLOCK_SIZE;
+    blk->region = image_regions[slot / SLAB_REGION_SLOTS];
+    blk->refs = 1;
+    blk->touched = 0;
+    blk->packed_size = 0;
+    blk->region->used++;
     return blk;
 }
 
-enum ufs_error_code ufs_errno() {
-    return ufs_error_code;
+/** Read the chained metadata of the checkpoint into memory. */
+static char* image_load_meta(const struct image_header* header, bool* is_loaded) {
+    size_t count = (header->meta_size + IMAGE_META_PER_BLOCK - 1) / IMAGE_META_PER_BLOCK;
+    char* meta = malloc(header->meta_size);
+    image_meta_blocks = calloc(count, sizeof(*image_meta_blocks));
+    if (!meta || !image_meta_blocks) {
+        free(meta);
+        return NULL;
+    }
+    uint32_t slot = header->meta_slot;
+    for (size_t i = 0; i < count; i++) {
+        /* A loop in the chain is caught by the slot loaded twice. */
+        if (slot >= header->region_count * SLAB_REGION_SLOTS || is_loaded[slot]) {
+            free(meta);
+            return NULL;
+        }
+        struct block* blk = image_load_block(slot, header, is_loaded);
+        image_meta_blocks[image_meta_block_count++] = blk;
+        size_t offset = i * IMAGE_META_PER_BLOCK;
+        memcpy(meta + offset, blk->memory, MIN(header->meta_size - offset, IMAGE_META_PER_BLOCK));
+        slot = *image_meta_next(blk);
+    }
+    return meta;
 }
 
-int ufs_open(const char* filename, int flags) {
-    struct file* file = find_file(filename);
-    bool created = false;
+static bool image_meta_read(const char** pos, const char* end, void* dst, size_t size) {
+    if ((size_t)(end - *pos) < size) {
+        return false;
+    }
+    memcpy(dst, *pos, size);
+    *pos += size;
+    return true;
+}
 
-    if (!file && (flags & UFS_CREATE)) {
-        file = malloc(sizeof(struct file));
-        if (!file) {
-            set_error(UFS_ERR_NO_MEM);
-            return -1;
-        }
-        
-        file->name = strdup(filename);
-        if (!file->name) {
-            free(file);
-            set_error(UFS_ERR_NO_MEM);
-            return -1;
-        }
-        
-        file->block_list = NULL;
-        file->last_block = NULL;
-        file->refs = 0;
-        file->size = 0;
-        file->deleted = false;
-        file->next = file_list;
-        file->prev = NULL;
-        
-        if (file_list != NULL) {
-            file_list->prev = file;
-        }
-        file_list = file;
-        created = true;
+/** Read the file table of the checkpoint into a snapshot to restore. */
+static int image_load_snapshot(const char* meta, const struct image_header* header,
+                               bool* is_loaded) {
+    const char* pos = meta;
+    const char* end = meta + header->meta_size;
+    uint64_t file_count;
+    if (!image_meta_read(&pos, end, &file_count, sizeof(file_count)) ||
+        file_count > header->meta_size) {
+        return -1;
     }
-    
-    if (!file) {
-        set_error(UFS_ERR_NO_FILE);
+    /* The checkpoint is freed by image_close() on an error. */
+    image_checkpoint = calloc(1, sizeof(*image_checkpoint));
+    if (!image_checkpoint ||
+        (file_count > 0 &&
+         (image_checkpoint->files = calloc(file_count, sizeof(*image_checkpoint->files))) == NULL)) {
         return -1;
     }
-
-    int fd = -1;
-    for (int i = 0; i < file_descriptor_capacity; i++) {
-        if (file_descriptors[i] == NULL) {
-            fd = i;
-            break;
+    for (uint64_t i = 0; i < file_count; i++) {
+        struct ufs_snapshot_file* f = &image_checkpoint->files[image_checkpoint->count];
+        uint32_t name_len, type;
+        uint64_t size, block_count;
+        if (!image_meta_read(&pos, end, &name_len, sizeof(name_len)) ||
+            !image_meta_read(&pos, end, &type, sizeof(type)) || (size_t)(end - pos) < name_len) {
+            return -1;
         }
-    }
-    
-    if (fd == -1) {
-        int new_capacity = file_descriptor_capacity == 0 ? 16 : file_descriptor_capacity * 2;
-        struct filedesc** new_arr = realloc(file_descriptors, new_capacity * sizeof(*file_descriptors));
-        if (!new_arr) {
-            set_error(UFS_ERR_NO_MEM);
-            if (created) {
-                if (file->refs == 0) {
-                    if (file->prev) file->prev->next = file->next;
-                    if (file->next) file->next->prev = file->prev;
-                    if (file_list == file) file_list = file->next;
-                    free(file->name);
-                    free(file);
-                }
-            }
+        f->name = strndup(pos, name_len);
+        pos += name_len;
+        if (!f->name) {
             return -1;
         }
-        
-        for (int i = file_descriptor_capacity; i < new_capacity; i++) {
-            new_arr[i] = NULL;
+        image_checkpoint->count++;
+        if (!image_meta_read(&pos, end, &size, sizeof(size)) ||
+            !image_meta_read(&pos, end, &block_count, sizeof(block_count)) ||
+            type > IMAGE_TYPE_DIR || size > MAX_FILE_SIZE ||
+            block_count != (size + BLOCK_SIZE - 1) / BLOCK_SIZE ||
+            (size_t)(end - pos) < block_count * sizeof(uint32_t)) {
+            return -1;
         }
-        file_descriptors = new_arr;
-        fd = file_descriptor_capacity;
-        file_descriptor_capacity = new_capacity;
-    }
-
-    struct filedesc* desc = malloc(sizeof(struct filedesc));
-    if (!desc) {
-        set_error(UFS_ERR_NO_MEM);
-        if (created) {
-            if (file->refs == 0) {
-                if (file->prev) file->prev->next = file->next;
-                if (file->next) file->next->prev = file->prev;
-                if (file_list == file) file_list = file->next;
-                free(file->name);
-                free(file);
+        f->is_dir = type == IMAGE_TYPE_DIR;
+        f->size = size;
+        if (block_count > 0 && (f->blocks = calloc(block_count, sizeof(*f->blocks))) == NULL) {
+            return -1;
+        }
+        f->block_count = block_count;
+        for (uint64_t j = 0; j < block_count; j++) {
+            uint32_t slot;
+            memcpy(&slot, pos, sizeof(slot));
+            pos += sizeof(slot);
+            if (slot == IMAGE_NO_SLOT) {
+                continue;
+            }
+            f->blocks[j] = image_load_block(slot, header, is_loaded);
+            if (!f->blocks[j]) {
+                return -1;
             }
         }
-        return -1;
-    }
-    
-    int access_flags = flags & (UFS_READ_ONLY | UFS_WRITE_ONLY | UFS_READ_WRITE);
-    if (access_flags == 0) {
-        access_flags = UFS_READ_WRITE;
     }
-    
-    desc->file = file;
-    desc->pos = 0;
-    desc->flags = access_flags;
-    
-    file_descriptors[fd] = desc;
-    file->refs++;
-    file_descriptor_count++;
-    
-    return fd;
+    return pos == end ? 0 : -1;
 }
 
-ssize_t ufs_write(int fd, const char* buf, size_t size) {
-    if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
-        set_error(UFS_ERR_NO_FILE);
+/** Map the regions of the checkpoint and create its files. */
+static int image_load(const struct image_header* header) {
+    struct stat st;
+    if (fstat(image_fd, &st) < 0 || header->slot_size != SLAB_SLOT_SIZE ||
+        (uint64_t)st.st_size < IMAGE_DATA_OFFSET + header->region_count * SLAB_REGION_SIZE ||
+        header->region_count > UINT32_MAX / SLAB_REGION_SLOTS) {
         return -1;
     }
-
-    struct filedesc* desc = file_descriptors[fd];
-    struct file* file = desc->file;
-    
-#if NEED_OPEN_FLAGS
-    if (!(desc->flags & (UFS_WRITE_ONLY | UFS_READ_WRITE))) {
-        set_error(UFS_ERR_NO_PERMISSION);
-        return -1;
+    for (size_t i = 0; i < header->region_count; i++) {
+        struct slab_region* r = calloc(1, sizeof(*r));
+        if (!r || image_map_region(r) < 0) {
+            free(r);
+            return -1;
+        }
+        /* Only the block headers are touched, no need to read ahead. */
+        madvise(r->base, SLAB_REGION_SIZE, MADV_RANDOM);
+        /* All the slots have been used, so none is known to be zero. */
+        r->carved = SLAB_REGION_SLOTS;
     }
-#endif
 
-    if (desc->pos + size > MAX_FILE_SIZE) {
-        set_error(UFS_ERR_NO_MEM);
+    bool* is_loaded = calloc(header->region_count * SLAB_REGION_SLOTS, sizeof(bool));
+    if (!is_loaded) {
         return -1;
     }
-    
-    size_t new_size = desc->pos + size;
-    if (new_size > file->size) {
-        if (extend_file(file, new_size) < 0) {
-            set_error(UFS_ERR_NO_MEM);
-            return -1;
+    char* meta = image_load_meta(header, is_loaded);
+    int rc = meta != NULL ? image_load_snapshot(meta, header, is_loaded) : -1;
+    free(meta);
+
+    /* The slots which are not loaded are free. */
+    for (size_t i = 0; i < image_region_count; i++) {
+        struct slab_region* r = image_regions[i];
+        for (size_t j = SLAB_REGION_SLOTS; j > 0; j--) {
+            uint32_t slot = i * SLAB_REGION_SLOTS + j - 1;
+            if (!is_loaded[slot]) {
+                struct block* blk = image_block_at(slot);
+                blk->region = r;
+                *block_next(blk) = r->free_list;
+                r->free_list = blk;
+            }
         }
-    }
-    
-    size_t bytes_written = 0;
-    size_t current_pos = desc->pos;
-    
-    while (bytes_written < size) {
-        size_t block_index = current_pos / BLOCK_SIZE;
-        size_t offset = current_pos % BLOCK_SIZE;
-        
-        struct block* blk = get_block(file, block_index);
-        if (blk == NULL) {
-            break;
+        if (slab_region_is_full(r)) {
+            slab_region_push_tail(r);
+        } else {
+            slab_region_push_head(r);
         }
-        
-        size_t to_write = MIN(BLOCK_SIZE - offset, size - bytes_written);
-        memcpy(blk->memory + offset, buf + bytes_written, to_write);
-        bytes_written += to_write;
-        current_pos += to_write;
+        madvise(r->base, SLAB_REGION_SIZE, MADV_NORMAL);
     }
-    
-    desc->pos = current_pos;
-    return bytes_written;
-}
-
-ssize_t ufs_read(int fd, char* buf, size_t size) {
-    if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
-        set_error(UFS_ERR_NO_FILE);
+    free(is_loaded);
+    if (rc < 0) {
         return -1;
     }
 
-    struct filedesc* desc = file_descriptors[fd];
-    struct file* file = desc->file;
-    
-#if NEED_OPEN_FLAGS
-    if (!(desc->flags & (UFS_READ_ONLY | UFS_READ_WRITE))) {
-        set_error(UFS_ERR_NO_PERMISSION);
-        return -1;
-    }
-#endif
+    image_generation = header->generation;
+    return ufs_restore(image_checkpoint);
+}
 
-    if (desc->pos >= file->size) {
-        return 0;
-    }
-    
-    size_t bytes_to_read = MIN(size, file->size - desc->pos);
-    size_t bytes_read = 0;
-    size_t current_pos = desc->pos;
-    
-    while (bytes_read < bytes_to_read) {
-        size_t block_index = current_pos / BLOCK_SIZE;
-        size_t offset = current_pos % BLOCK_SIZE;
-        
-        struct block* blk = get_block(file, block_index);
-        if (blk == NULL) {
-            break;
+static void image_close(void) {
+    /*
+     * A free block keeps the free list link in its data, so the blocks of
+     * the checkpoint are not freed. They are dropped with the regions.
+     */
+    if (image_checkpoint != NULL) {
+        for (size_t i = 0; i < image_checkpoint->count; i++) {
+            free(image_checkpoint->files[i].blocks);
+            free(image_checkpoint->files[i].name);
         }
-        
-        size_t to_read = MIN(BLOCK_SIZE - offset, bytes_to_read - bytes_read);
-        memcpy(buf + bytes_read, blk->memory + offset, to_read);
-        bytes_read += to_read;
-        current_pos += to_read;
+        free(image_checkpoint->files);
+        free(image_checkpoint);
+        image_checkpoint = NULL;
     }
-    
-    desc->pos = current_pos;
-    return bytes_read;
+    free(image_meta_blocks);
+    image_meta_blocks = NULL;
+    image_meta_block_count = 0;
+    for (size_t i = 0; i < image_region_count; i++) {
+        munmap(image_regions[i]->base, SLAB_REGION_SIZE);
+        free(image_regions[i]);
+    }
+    free(image_regions);
+    image_regions = NULL;
+    image_region_count = 0;
+    image_region_capacity = 0;
+    slab_head = NULL;
+    slab_tail = NULL;
+    block_cache = NULL;
+    block_cache_count = 0;
+    close(image_fd);
+    image_fd = -1;
+    image_generation = 0;
 }
 
-int ufs_close(int fd) {
-    if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
-        set_error(UFS_ERR_NO_FILE);
+int ufs_image_open(const char* path) {
+    /* The anonymous regions are unmapped once the cached blocks are freed. */
+    size_t cache_limit = block_cache_limit;
+    ufs_set_block_cache_limit(0);
+    ufs_set_block_cache_limit(cache_limit);
+    if (image_fd >= 0 || file_list != NULL || slab_head != NULL) {
+        set_error(UFS_ERR_BUSY);
+        return -1;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        set_error(UFS_ERR_IO);
         return -1;
     }
 
-    struct filedesc* desc = file_descriptors[fd];
-    struct file* file = desc->file;
-    
-    free(desc);
-    file_descriptors[fd] = NULL;
-    file_descriptor_count--;
-    
-    file->refs--;
-    if (file->refs == 0 && file->deleted) {
-        if (file->prev != NULL) {
-            file->prev->next = file->next;
-        } else {
-            file_list = file->next;
+    struct image_header headers[2];
+    const struct image_header* header = NULL;
+    for (int i = 0; i < 2; i++) {
+        struct image_header* h = &headers[i];
+        memset(h, 0, sizeof(*h));
+        if (pread(fd, h, sizeof(*h), i * IMAGE_HEADER_SIZE) < 0 ||
+            (h->magic != IMAGE_MAGIC && h->magic != 0)) {
+            /* Not an image, better not to overwrite it. */
+            close(fd);
+            set_error(UFS_ERR_IO);
+            return -1;
         }
-        
-        if (file->next != NULL) {
-            file->next->prev = file->prev;
+        if (h->magic == IMAGE_MAGIC && h->checksum == image_header_checksum(h) &&
+            (header == NULL || h->generation > header->generation)) {
+            header = h;
         }
-        
-        struct block* blk = file->block_list;
-        while (blk != NULL) {
-            struct block* next = blk->next;
-            free(blk->memory);
-            free(blk);
-            blk = next;
+    }
+
+    image_fd = fd;
+    if (header == NULL) {
+        /* No checkpoint yet, the regions written before it are dropped. */
+        if (ftruncate(fd, IMAGE_DATA_OFFSET) < 0) {
+            image_close();
+            set_error(UFS_ERR_IO);
+            return -1;
         }
-        
-        free(file->name);
-        free(file);
+        return 0;
+    }
+    if (image_load(header) < 0) {
+        ufs_destroy();
+        set_error(UFS_ERR_IO);
+        return -1;
     }
-    
     return 0;
 }
 
-int ufs_delete(const char* filename) {
-    struct file* file = find_file(filename);
-    if (file == NULL) {
-        set_error(UFS_ERR_NO_FILE);
-        return -1;
+#if NEED_RESIZE
+static int file_resize(struct filedesc* desc, size_t new_size) {
+    struct file* file = desc->file;
+    size_t old_size = file->size;
+    if (new_size == old_size) {
+        return 0;
     }
-    
-    file->deleted = true;
-    
-    if (file->refs == 0) {
-        if (file->prev != NULL) {
-            file->prev->next = file->next;
-        } else {
-            file_list = file->next;
+
+    if (new_size < old_size) {
+        if (file->borrows > 0) {
+            set_error(UFS_ERR_BUSY);
+            return -1;
         }
-        
-        if (file->next != NULL) {
-            file->next->prev = file->prev;
+        if (shrink_file(file, new_size) < 0) {
+            set_error(UFS_ERR_NO_MEM);
+            return -1;
         }
-        
-        struct block* blk = file->block_list;
-        while (blk != NULL) {
-            struct block* next = blk->next;
-            free(blk->memory);
-            free(blk);
-            blk = next;
+
+        /*
+         * The positions are protected by the file lock which is held, so
+         * the other descriptors can be moved without their own locks.
+         */
+        for (struct filedesc* d = file->descs; d != NULL; d = d->file_next) {
+            if (d->pos > new_size) {
+                d->pos = new_size;
+            }
         }
-        
-        free(file->name);
-        free(file);
+    } else if (extend_file(file, new_size) < 0) {
+        set_error(UFS_ERR_NO_MEM);
+        return -1;
     }
-    
+
     return 0;
 }
 
-#if NEED_RESIZE
 int ufs_resize(int fd, size_t new_size) {
-    if (fd < 0 || fd >= file_descriptor_capacity || file_descriptors[fd] == NULL) {
-        set_error(UFS_ERR_NO_FILE);
+    struct filedesc* desc = desc_acquire(fd);
+    if (!desc) {
         return -1;
     }
 
-    struct filedesc* desc = file_descriptors[fd];
-    struct file* file = desc->file;
-    
-#if NEED_OPEN_FLAGS
-    if (!(desc->flags & (UFS_WRITE_ONLY | UFS_READ_WRITE))) {
-        set_error(UFS_ERR_NO_PERMISSION);
+    if (desc_check_access(desc, UFS_WRITE_ONLY | UFS_READ_WRITE) < 0) {
+        desc_release(desc);
         return -1;
     }
-#endif
 
     if (new_size > MAX_FILE_SIZE) {
+        desc_release(desc);
         set_error(UFS_ERR_NO_MEM);
         return -1;
     }
-    
-    size_t old_size = file->size;
-    if (new_size == old_size) {
-        return 0;
-    }
-    
-    if (new_size < old_size) {
-        size_t blocks_to_keep = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        struct block* blk = file->block_list;
-        struct block* last_kept = NULL;
-        size_t current_block_index = 0;
-        
-        while (blk != NULL && current_block_index < blocks_to_keep) {
-            last_kept = blk;
-            blk = blk->next;
-            current_block_index++;
-        }
-        
-        if (last_kept != NULL) {
-            struct block* to_free = last_kept->next;
-            last_kept->next = NULL;
-            file->last_block = last_kept;
-            
-            while (to_free != NULL) {
-                struct block* next = to_free->next;
-                free(to_free->memory);
-                free(to_free);
-                to_free = next;
-            }
-        } else {
-            struct block* to_free = file->block_list;
-            file->block_list = NULL;
-            file->last_block = NULL;
-            
-            while (to_free != NULL) {
-                struct block* next = to_free->next;
-                free(to_free->memory);
-                free(to_free);
-                to_free = next;
-            }
-        }
-        
-        file->size = new_size;
 
-        for (int i = 0; i < file_descriptor_capacity; i++) {
-            if (file_descriptors[i] != NULL && 
-                file_descriptors[i]->file == file && 
-                file_descriptors[i]->pos > new_size) {
-                file_descriptors[i]->pos = new_size;
-            }
-        }
-    } else {
-        size_t current_blocks = (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        size_t needed_blocks = (new_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-        size_t blocks_to_add = needed_blocks - current_blocks;
-        
-        for (size_t i = 0; i < blocks_to_add; i++) {
-            struct block* blk = create_block();
-            if (blk == NULL) {
-                set_error(UFS_ERR_NO_MEM);
-                return -1;
-            }
-            
-            if (file->last_block != NULL) {
-                file->last_block->next = blk;
-                blk->prev = file->last_block;
-            } else {
-                file->block_list = blk;
-            }
-            file->last_block = blk;
-        }
-        file->size = new_size;
-    }
-    
-    return 0;
+    pthread_rwlock_wrlock(&desc->file->lock);
+    int rc = file_resize(desc, new_size);
+    pthread_rwlock_unlock(&desc->file->lock);
+    desc_release(desc);
+    return rc;
 }
 #endif
 
 void ufs_destroy(void) {
+    ufs_compress_stop();
     struct file* file = file_list;
     while (file != NULL) {
         struct file* next = file->next;
-        
-        struct block* blk = file->block_list;
-        while (blk != NULL) {
-            struct block* next_blk = blk->next;
-            free(blk->memory);
-            free(blk);
-            blk = next_blk;
-        }
-        
+
+        truncate_blocks(file, 0);
+        dir_free_children(file);
+        pthread_rwlock_destroy(&file->lock);
+        free(file->blocks);
         free(file->name);
         free(file);
         file = next;
     }
     file_list = NULL;
-    
+    for (int i = 0; i < NAME_SHARD_COUNT; i++) {
+        name_table_destroy(&name_shards[i].table);
+        name_table_destroy(&root_children[i]);
+    }
+    /* All the blocks are free now, so this unmaps all the regions. */
+    size_t cache_limit = block_cache_limit;
+    ufs_set_block_cache_limit(0);
+    block_cache_limit = cache_limit;
+
     for (int i = 0; i < file_descriptor_capacity; i++) {
         if (file_descriptors[i] != NULL) {
+            pthread_mutex_destroy(&file_descriptors[i]->pos_lock);
             free(file_descriptors[i]);
         }
     }
     free(file_descriptors);
     file_descriptors = NULL;
-    
+    free(fd_free_map);
+    fd_free_map = NULL;
+    free(fd_free_summary);
+    fd_free_summary = NULL;
+
     file_descriptor_count = 0;
     file_descriptor_capacity = 0;
+    if (image_fd >= 0) {
+        image_close();
+    }
     set_error(UFS_ERR_NO_ERR);
-}
\ No newline at end of file
+}
@@ -1,12 +1,14 @@
 #pragma once
 
+#include <stdbool.h>
 #include <sys/types.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
  * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * has an unique path: names of its directories and its own name
+ * joined with '/', like "dir/subdir/file". A file in the root has
+ * no directories in the path.
  */
 
 /**
@@ -67,9 +69,27 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+	/** The file has borrowed ranges, see ufs_read_borrow(). */
+	UFS_ERR_BUSY,
+	/** The image file can't be read or written, see ufs_image_open(). */
+	UFS_ERR_IO,
+	/** The file or directory exists already. */
+	UFS_ERR_EXISTS,
+	/** A file is used as a directory. */
+	UFS_ERR_NOT_DIR,
+	/** A directory is used as a file. */
+	UFS_ERR_IS_DIR,
+	/** The directory has entries. */
+	UFS_ERR_NOT_EMPTY,
 };
 
-/** Get code of the last error. */
+/** A buffer of the vectored calls. */
+struct ufs_iovec {
+	void *base;
+	size_t len;
+};
+
+/** Get code of the last error of the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
@@ -81,7 +101,9 @@ ufs_errno();
  * @retval > 0 File descriptor.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified, or no directory to create it in.
+ *     - UFS_ERR_NOT_DIR - a part of the path is a file.
+ *     - UFS_ERR_IS_DIR - the path is a directory.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -114,12 +136,114 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at the given offset. The descriptor
+ * position is not used and does not move. Writing behind the end
+ * of the file leaves a hole of zeros before the data.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Offset in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the given offset. The descriptor
+ * position is not used and does not move, so many threads can
+ * read through one descriptor in parallel.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Offset in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write the buffers one after another, as one ufs_write() of
+ * their concatenation.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_writev(int fd, const struct ufs_iovec *iov, int iovcnt);
+
+/**
+ * Read into the buffers one after another, as one ufs_read() into
+ * their concatenation.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Count of @a iov.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_readv(int fd, const struct ufs_iovec *iov, int iovcnt);
+
+/**
+ * Read data from the file without a copy. Instead of the bytes
+ * the caller gets pointers into the file memory, one buffer per
+ * block covered by the range. The descriptor position moves like
+ * in ufs_read(). The memory must not be modified, and stays valid
+ * until the borrow is released by ufs_read_release(). Until then
+ * the file can't be truncated and the descriptor can't be closed,
+ * but it can be written, and the new data is visible through the
+ * borrowed pointers.
+ * @param fd File descriptor from ufs_open().
+ * @param size Maximum bytes to borrow.
+ * @param[out] out Buffers pointing into the file.
+ * @param[in][out] cnt Count of @a out, then count of the borrowed
+ *     buffers. When they are too few, less bytes are borrowed.
+ *
+ * @retval > 0 How many bytes were borrowed.
+ * @retval 0 EOF. Nothing is borrowed.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_read_borrow(int fd, size_t size, struct ufs_iovec *out, int *cnt);
+
+/**
+ * Release one borrow made by ufs_read_borrow() through the same
+ * descriptor.
+ * @param fd File descriptor from ufs_open().
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor or nothing is
+ *       borrowed through it.
+ */
+int
+ufs_read_release(int fd);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
  * @retval 0 Success.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_BUSY - ranges borrowed through the descriptor are
+ *       not released or asynchronous calls on it are not finished.
  */
 int
 ufs_close(int fd);
@@ -135,10 +259,116 @@ ufs_close(int fd);
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_IS_DIR - it is a directory, see ufs_rmdir().
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a directory. Its parent directory must exist.
+ * @param path Path of the new directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no parent directory or the path is
+ *       empty or has empty parts.
+ *     - UFS_ERR_NOT_DIR - a part of the path is a file.
+ *     - UFS_ERR_EXISTS - the path is taken.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Remove an empty directory.
+ * @param path Path of the directory.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - it is a file.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries.
+ */
+int
+ufs_rmdir(const char *path);
+
+/** An entry of a directory, see ufs_readdir(). */
+struct ufs_dirent {
+	/** Name inside the directory. */
+	const char *name;
+	bool is_dir;
+};
+
+/** An opened directory, see ufs_opendir(). */
+struct ufs_dir;
+
+/**
+ * Open a directory to list its entries. They are taken at once,
+ * so the later changes are not seen.
+ * @param path Path of the directory, "" or "/" for the root.
+ * @retval not NULL The directory. Close it with ufs_closedir().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_DIR - it is a file.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * Next entry of the directory in no particular order. It is valid
+ * until the directory is closed.
+ * @retval NULL No more entries.
+ */
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir);
+
+void
+ufs_closedir(struct ufs_dir *dir);
+
+struct thread_pool;
+
+/** Handle of an asynchronous call, see ufs_write_async(). */
+struct ufs_async;
+
+/**
+ * Start ufs_write() in a thread of the pool. The calls on the same
+ * descriptor run one by one in the order they were made, so they
+ * move its position like the synchronous ones. The buffer must stay
+ * valid until the call is finished.
+ * @param pool Thread pool to run the call.
+ * @retval not NULL Handle of the call. It must be joined with
+ *     ufs_async_join() before the pool is deleted.
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_BUSY - the pool has too many tasks.
+ */
+struct ufs_async *
+ufs_write_async(struct thread_pool *pool, int fd, const char *buf,
+		size_t size);
+
+/** Start ufs_read() in a thread of the pool like ufs_write_async(). */
+struct ufs_async *
+ufs_read_async(struct thread_pool *pool, int fd, char *buf, size_t size);
+
+/**
+ * Start ufs_delete() in a thread of the pool. Freeing the blocks of
+ * a big file happens there too, unless it is still opened.
+ */
+struct ufs_async *
+ufs_delete_async(struct thread_pool *pool, const char *filename);
+
+/** Check if the asynchronous call is finished. */
+bool
+ufs_async_is_done(struct ufs_async *op);
+
+/**
+ * Wait for the asynchronous call to finish and free its handle.
+ * @retval The result of the call. On an error ufs_errno() returns
+ *     its code.
+ */
+ssize_t
+ufs_async_join(struct ufs_async *op);
+
 #if NEED_RESIZE
 
 /**
@@ -156,18 +386,170 @@ ufs_delete(const char *filename);
  *     - UFS_ERR_NO_FILE - invalid file descriptor.
  *     - UFS_ERR_NO_PERMISSION - descriptor should have been opened with
  *       UFS_WRITE_ONLY or UFS_READ_WRITE permissions.
- *     - UFS_ERR_NO_MEM - not enough memory. Can appear only when
- *       @a new_size is bigger than the current size.
+ *     - UFS_ERR_NO_MEM - not enough memory. When @a new_size is
+ *       smaller, can appear only if the last kept block is shared
+ *       with a clone or a snapshot and has to be copied.
+ *     - UFS_ERR_BUSY - the file has borrowed ranges and
+ *       @a new_size is smaller than the current size.
  */
 int
 ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Set how many free full blocks are kept cached for reuse instead of being
+ * given back to the system. The default is 256 blocks, 16MB. A smaller
+ * limit frees the extra cached blocks right away.
+ *
+ * @param count Maximal number of cached free blocks.
+ */
+void
+ufs_set_block_cache_limit(size_t count);
+
+/**
+ * Make @a dst a copy of @a src. The copy shares the data blocks
+ * with the source and a block is copied only when one of the files
+ * changes it, so cloning costs a pointer per block. If @a dst
+ * exists, its content is replaced, and its opened descriptors see
+ * the new one.
+ * @param src Name of the file to copy.
+ * @param dst Name of the copy. Created if it does not exist.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_BUSY - @a dst has borrowed ranges.
+ */
+int
+ufs_clone(const char *src, const char *dst);
+
+/** Saved state of all the files, see ufs_snapshot(). */
+struct ufs_snapshot;
+
+/**
+ * Save names and data of all the files. The data blocks are shared
+ * with the files like in ufs_clone(). Each file is saved at some
+ * moment of the call, the changes made concurrently to different
+ * files may be seen or not.
+ * @retval not NULL The snapshot. It must be deleted with
+ *     ufs_snapshot_delete() before ufs_destroy().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+struct ufs_snapshot *
+ufs_snapshot(void);
+
+/**
+ * Replace all the files with the ones from the snapshot. The files
+ * which are replaced or are not in the snapshot are deleted like by
+ * ufs_delete(), so their opened descriptors keep working with the
+ * old data. The snapshot stays and can be restored again.
+ * @param snapshot Snapshot from ufs_snapshot().
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code. Nothing
+ *     is changed then.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+int
+ufs_restore(const struct ufs_snapshot *snapshot);
+
+/** Free the snapshot. */
+void
+ufs_snapshot_delete(struct ufs_snapshot *snapshot);
+
+/**
+ * Keep the files in an image file. Its data is mapped into memory,
+ * so the blocks of the files are stored in the file right away, and
+ * the opening only reads the table of the files. The file system must
+ * be empty, the files of the last ufs_sync() are loaded from the
+ * image. The image stays attached until ufs_destroy(), which drops
+ * the changes made after the last ufs_sync().
+ * @param path Path of the image file. It is created if not exists.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_BUSY - there are files or an image already.
+ *     - UFS_ERR_IO - the image can't be opened or is broken.
+ */
+int
+ufs_image_open(const char *path);
+
+/**
+ * Save a checkpoint of all the files into the image. Each file is
+ * saved at some moment of the call like in ufs_snapshot(). A crash at
+ * any moment leaves either the previous checkpoint or this one.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no image, see ufs_image_open().
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_IO - the image can't be written.
+ */
+int
+ufs_sync(void);
+
+/** Compressed blocks of a file or of all the files. */
+struct ufs_compress_stat {
+	/** Number of the compressed blocks. */
+	size_t block_count;
+	/** Size of their data when decompressed. */
+	size_t data_size;
+	/** Memory the compressed data takes. */
+	size_t packed_size;
+};
+
+/**
+ * Start compressing the cold blocks in the background. A block not
+ * read or written for @a cold_sec seconds is compressed, and its
+ * next access decompresses it again. The blocks shared with clones
+ * and snapshots, the borrowed ones and the blocks of an image file
+ * stay as they are. The compressor runs until ufs_compress_stop().
+ * @param cold_sec Seconds a block must be untouched to compress it.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_BUSY - the compressor is running already.
+ *     - UFS_ERR_NO_MEM - the thread can't be created.
+ */
+int
+ufs_compress_start(unsigned cold_sec);
+
+/** Stop the background compressor. The blocks stay compressed. */
+void
+ufs_compress_stop(void);
+
+/**
+ * Compress the cold blocks right now, in the calling thread. It is
+ * what the background compressor does each second.
+ * @param cold_sec Seconds a block must be untouched to compress it.
+ *     With 0 all the blocks are compressed.
+ * @retval Number of the blocks compressed.
+ */
+size_t
+ufs_compress_cold(unsigned cold_sec);
+
+/**
+ * Get the compressed blocks of the file. The compression ratio is
+ * data_size / packed_size.
+ * @param fd Descriptor of the file.
+ * @param stat Filled with the numbers.
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+int
+ufs_compress_stat(int fd, struct ufs_compress_stat *stat);
+
+/**
+ * Get the compressed blocks of all the files. A block shared by
+ * several files is counted once.
+ */
+void
+ufs_compress_stat_total(struct ufs_compress_stat *stat);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to
  * be used. Purpose of the destruction is to reclaim all the dynamic memory.
+ * Unlike the other functions it must not run concurrently with any ufs call.
  */
 void
 ufs_destroy(void);
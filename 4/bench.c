@@ -0,0 +1,240 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Thread pool benchmark. Tiny tasks are pushed from outside and joined, so
+ * the cost of the queue itself dominates. Then a tree of tasks is made by
+ * the tasks themselves, each one pushes its children into its own pool,
+ * which is how the recursive work is spread. Both are run with a growing
+ * number of threads. At last several threads push into one pool at once,
+ * and the latency of each push is measured.
+ */
+
+enum {
+	/** Tasks pushed from outside in one round. */
+	PUSH_COUNT = 100 * 1000,
+	PUSH_ROUNDS = 5,
+	/**
+	 * The tree has 2^(TREE_DEPTH + 1) - 1 tasks. A queue going breadth
+	 * first has half of them at once, which must fit TPOOL_MAX_TASKS.
+	 */
+	TREE_DEPTH = 15,
+	/** Pushes of one thread in the latency test. */
+	LATENCY_COUNT = 10 * 1000,
+	LATENCY_POOL_THREADS = 4,
+};
+
+static const int thread_counts[] = {1, 2, 4, 8, 12, 16, 20};
+static const int pusher_counts[] = {1, 2, 4, 8};
+
+static double
+clock_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+clock_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+report_ops(const char *name, int threads, size_t ops, double elapsed)
+{
+	char full[32];
+	snprintf(full, sizeof(full), "%s x%d", name, threads);
+	printf("%-16s %10.0f tasks/s\n", full, ops / elapsed);
+}
+
+static void *
+task_nop_f(void *arg)
+{
+	return arg;
+}
+
+static int
+bench_push(int threads)
+{
+	struct thread_pool *pool;
+	struct thread_task **tasks = malloc(PUSH_COUNT * sizeof(*tasks));
+	if (thread_pool_new(threads, &pool) != 0)
+		return -1;
+	for (int i = 0; i < PUSH_COUNT; ++i) {
+		if (thread_task_new(&tasks[i], task_nop_f, NULL) != 0)
+			return -1;
+	}
+	double start = clock_sec();
+	for (int round = 0; round < PUSH_ROUNDS; ++round) {
+		for (int i = 0; i < PUSH_COUNT; ++i) {
+			if (thread_pool_push_task(pool, tasks[i]) != 0)
+				return -1;
+		}
+		for (int i = 0; i < PUSH_COUNT; ++i) {
+			if (thread_task_join(tasks[i], NULL) != 0)
+				return -1;
+		}
+	}
+	report_ops("push+join", threads, (size_t)PUSH_COUNT * PUSH_ROUNDS,
+		   clock_sec() - start);
+	for (int i = 0; i < PUSH_COUNT; ++i)
+		thread_task_delete(tasks[i]);
+	free(tasks);
+	return thread_pool_delete(pool);
+}
+
+struct tree_ctx {
+	struct thread_pool *pool;
+	int *done;
+	struct tree_ctx *child;
+};
+
+static void *
+task_tree_f(void *arg)
+{
+	struct tree_ctx *ctx = arg;
+	if (ctx->child != NULL) {
+		for (int i = 0; i < 2; ++i) {
+			struct thread_task *t;
+			if (thread_task_new(&t, task_tree_f, ctx->child) != 0 ||
+			    thread_pool_push_task(ctx->pool, t) != 0 ||
+			    thread_task_detach(t) != 0)
+				abort();
+		}
+	}
+	__atomic_add_fetch(ctx->done, 1, __ATOMIC_RELAXED);
+	return arg;
+}
+
+static int
+bench_tree(int threads)
+{
+	struct thread_pool *pool;
+	struct thread_task *root;
+	struct tree_ctx ctx[TREE_DEPTH + 1];
+	int done = 0;
+	const int total = (1 << (TREE_DEPTH + 1)) - 1;
+	if (thread_pool_new(threads, &pool) != 0)
+		return -1;
+	for (int i = 0; i <= TREE_DEPTH; ++i) {
+		ctx[i].pool = pool;
+		ctx[i].done = &done;
+		ctx[i].child = i == 0 ? NULL : &ctx[i - 1];
+	}
+	double start = clock_sec();
+	if (thread_task_new(&root, task_tree_f, &ctx[TREE_DEPTH]) != 0 ||
+	    thread_pool_push_task(pool, root) != 0 ||
+	    thread_task_detach(root) != 0)
+		return -1;
+	while (__atomic_load_n(&done, __ATOMIC_RELAXED) != total)
+		usleep(100);
+	report_ops("tree", threads, total, clock_sec() - start);
+	/* The last tasks can be still finishing. */
+	while (thread_pool_delete(pool) != 0)
+		usleep(100);
+	return 0;
+}
+
+struct pusher {
+	pthread_t thread;
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	double *latency;
+	int failed;
+};
+
+static void *
+pusher_f(void *arg)
+{
+	struct pusher *p = arg;
+	for (int i = 0; i < LATENCY_COUNT; ++i) {
+		double start = clock_nsec();
+		if (thread_pool_push_task(p->pool, p->tasks[i]) != 0)
+			p->failed = 1;
+		p->latency[i] = clock_nsec() - start;
+	}
+	return NULL;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double l = *(const double *)a, r = *(const double *)b;
+	return (l > r) - (l < r);
+}
+
+static int
+bench_latency(int pushers)
+{
+	struct thread_pool *pool;
+	struct pusher p[pushers];
+	const int total = pushers * LATENCY_COUNT;
+	struct thread_task **tasks = malloc(total * sizeof(*tasks));
+	double *latency = malloc(total * sizeof(*latency));
+	int rc = 0;
+	if (thread_pool_new(LATENCY_POOL_THREADS, &pool) != 0)
+		return -1;
+	for (int i = 0; i < total; ++i) {
+		if (thread_task_new(&tasks[i], task_nop_f, NULL) != 0)
+			return -1;
+	}
+	for (int i = 0; i < pushers; ++i) {
+		p[i].pool = pool;
+		p[i].tasks = tasks + i * LATENCY_COUNT;
+		p[i].latency = latency + i * LATENCY_COUNT;
+		p[i].failed = 0;
+		pthread_create(&p[i].thread, NULL, pusher_f, &p[i]);
+	}
+	for (int i = 0; i < pushers; ++i) {
+		pthread_join(p[i].thread, NULL);
+		rc |= p[i].failed;
+	}
+	for (int i = 0; i < total; ++i) {
+		if (thread_task_join(tasks[i], NULL) != 0)
+			rc = -1;
+		thread_task_delete(tasks[i]);
+	}
+	qsort(latency, total, sizeof(*latency), cmp_double);
+	printf("push latency x%-3d p50 %6.0f ns, p99 %6.0f ns\n", pushers,
+	       latency[total / 2], latency[total * 99 / 100]);
+	free(latency);
+	free(tasks);
+	if (thread_pool_delete(pool) != 0)
+		return -1;
+	return rc == 0 ? 0 : -1;
+}
+
+int
+main(void)
+{
+	int count = sizeof(thread_counts) / sizeof(thread_counts[0]);
+	for (int i = 0; i < count; ++i) {
+		if (bench_push(thread_counts[i]) != 0) {
+			printf("error\n");
+			return 1;
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		if (bench_tree(thread_counts[i]) != 0) {
+			printf("error\n");
+			return 1;
+		}
+	}
+	count = sizeof(pusher_counts) / sizeof(pusher_counts[0]);
+	for (int i = 0; i < count; ++i) {
+		if (bench_latency(pusher_counts[i]) != 0) {
+			printf("error\n");
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -363,6 +363,128 @@ test_detach_long(void)
 #endif
 }
 
+struct tree_ctx {
+	struct thread_pool *pool;
+	int *leaves;
+	int *failed;
+	struct tree_ctx *child;
+};
+
+/**
+ * A node pushes two detached children into the pool of its own worker, so
+ * they go to its deque, and the other workers have to steal them.
+ */
+static void *
+task_tree_f(void *arg)
+{
+	struct tree_ctx *ctx = arg;
+	if (ctx->child == NULL) {
+		__atomic_add_fetch(ctx->leaves, 1, __ATOMIC_RELAXED);
+		return arg;
+	}
+	for (int i = 0; i < 2; ++i) {
+		struct thread_task *t;
+		if (thread_task_new(&t, task_tree_f, ctx->child) != 0 ||
+		    thread_pool_push_task(ctx->pool, t) != 0 ||
+		    thread_task_detach(t) != 0)
+			__atomic_store_n(ctx->failed, 1, __ATOMIC_RELAXED);
+	}
+	return arg;
+}
+
+static void
+test_push_from_worker(void)
+{
+#if NEED_DETACH
+	unit_test_start();
+
+	enum { depth = 12 };
+	struct thread_pool *p;
+	struct thread_task *t;
+	struct tree_ctx ctx[depth + 1];
+	int leaves = 0;
+	int failed = 0;
+	unit_fail_if(thread_pool_new(4, &p) != 0);
+	for (int i = 0; i <= depth; ++i) {
+		ctx[i].pool = p;
+		ctx[i].leaves = &leaves;
+		ctx[i].failed = &failed;
+		ctx[i].child = i == 0 ? NULL : &ctx[i - 1];
+	}
+	unit_fail_if(thread_task_new(&t, task_tree_f, &ctx[depth]) != 0);
+	unit_check(thread_pool_push_task(p, t) == 0, "push the root");
+	unit_check(thread_task_join(t, NULL) == 0, "join the root");
+	unit_fail_if(thread_task_delete(t) != 0);
+	while (__atomic_load_n(&leaves, __ATOMIC_RELAXED) != 1 << depth &&
+	       __atomic_load_n(&failed, __ATOMIC_RELAXED) == 0)
+		usleep(1000);
+	unit_check(__atomic_load_n(&failed, __ATOMIC_RELAXED) == 0 &&
+		   __atomic_load_n(&leaves, __ATOMIC_RELAXED) == 1 << depth,
+		   "all the pushes from the workers are done");
+	unit_check(thread_pool_thread_count(p) <= 4, "thread count is limited");
+	while (thread_pool_delete(p) != 0)
+		usleep(100);
+
+	unit_test_finish();
+#endif
+}
+
+struct pusher_ctx {
+	struct thread_pool *pool;
+	struct thread_task **tasks;
+	int count;
+	int failed;
+};
+
+static void *
+pusher_f(void *arg)
+{
+	struct pusher_ctx *ctx = arg;
+	for (int i = 0; i < ctx->count; ++i) {
+		if (thread_pool_push_task(ctx->pool, ctx->tasks[i]) != 0)
+			ctx->failed = 1;
+	}
+	return NULL;
+}
+
+static void
+test_push_concurrent(void)
+{
+	unit_test_start();
+
+	enum { pushers = 4, count = 2000 };
+	struct thread_pool *p;
+	struct thread_task *tasks[pushers * count];
+	struct pusher_ctx ctx[pushers];
+	pthread_t threads[pushers];
+	int sum = 0;
+	unit_fail_if(thread_pool_new(3, &p) != 0);
+	for (int i = 0; i < pushers * count; ++i)
+		unit_fail_if(thread_task_new(&tasks[i], task_incr_f, &sum) != 0);
+	for (int i = 0; i < pushers; ++i) {
+		ctx[i].pool = p;
+		ctx[i].tasks = tasks + i * count;
+		ctx[i].count = count;
+		ctx[i].failed = 0;
+		unit_fail_if(pthread_create(&threads[i], NULL, pusher_f,
+					    &ctx[i]) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < pushers; ++i) {
+		unit_fail_if(pthread_join(threads[i], NULL) != 0);
+		ok = ok && ctx[i].failed == 0;
+	}
+	unit_check(ok, "concurrent pushes");
+	for (int i = 0; i < pushers * count; ++i) {
+		ok = ok && thread_task_join(tasks[i], NULL) == 0;
+		unit_fail_if(thread_task_delete(tasks[i]) != 0);
+	}
+	unit_check(ok && sum == pushers * count, "all the tasks are done");
+	unit_check(thread_pool_delete(p) == 0, "delete");
+
+	unit_test_finish();
+}
+
 int
 main(int argc, char **argv)
 {
@@ -386,6 +508,8 @@ main(int argc, char **argv)
 	test_timed_join();
 	test_detach_stress();
 	test_detach_long();
+	test_push_from_worker();
+	test_push_concurrent();
 
 	unit_test_finish();
 	return 0;
@@ -2,9 +2,15 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <time.h>
 #include <string.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 enum task_state {
     TASK_CREATED,
@@ -27,47 +33,432 @@ struct thread_task {
     pthread_cond_t task_cond;
 };
 
+enum {
+    DEQUE_MIN_CAPACITY = 64,
+    /** Most tasks a worker moves from the injector to its deque at once. */
+    INJECTOR_BATCH = 32,
+};
+
+/**
+ * Ring of a deque. A full ring is replaced with a twice bigger one, and the
+ * old one is kept until the pool is deleted, because a thief can still be
+ * reading it.
+ */
+struct task_ring {
+    long capacity;
+    struct task_ring *prev;
+    struct thread_task *tasks[];
+};
+
+/**
+ * Chase-Lev deque of a worker. The owner pushes and takes the tasks at the
+ * bottom without any locks, the other workers steal them from the top with
+ * a CAS, which is the only contended operation.
+ */
+struct task_deque {
+    long top;
+    char pad[64 - sizeof(long)];
+    long bottom;
+    struct task_ring *ring;
+};
+
+/**
+ * Vyukov's intrusive MPSC queue linked through task->next. A push is one
+ * exchange of the tail, so any number of threads push without locks. The
+ * head is owned by one consumer at a time, the workers take turns with the
+ * is_consumed flag and the one which can't get it goes stealing instead.
+ */
+struct task_queue {
+    struct thread_task *head;
+    bool is_consumed;
+    char pad[64];
+    struct thread_task *tail;
+    /** Stays in the queue when it is empty, so the tail is never NULL. */
+    struct thread_task stub;
+};
+
+struct worker {
+    pthread_t thread;
+    struct thread_pool *pool;
+    struct task_deque deque;
+    unsigned seed;
+    /** 1 while the worker sleeps and nobody has woken it up, a futex word. */
+    int asleep;
+};
+
+/**
+ * The tasks pushed by a worker go to its own deque, the ones pushed from
+ * outside go to the injector queue. An idle worker takes its own tasks,
+ * then a batch from the injector, then steals from the others, and sleeps
+ * only when there is nothing anywhere. To sleep, a worker sets its asleep
+ * word, registers in sleeping, checks for work once more and waits on the
+ * word. A pusher looks at sleeping and only when it isn't 0 claims one of
+ * the sleepers by resetting its word and wakes it. The claimed worker isn't
+ * counted as sleeping anymore, so a busy pool doesn't make a single syscall
+ * and a woken worker isn't woken again before it runs. The mutex is left
+ * for starting the threads and deleting the pool.
+ */
 struct thread_pool {
     int max_threads;
-    pthread_t *threads;
+    struct worker *workers;
+    /** Changed under the mutex, read without it. */
     int thread_count;
-    struct thread_task *head;
-    struct thread_task *tail;
+    struct task_queue injector;
+    /** Tasks pushed to the injector and not taken yet, at least as many as in it. */
+    int injected;
+    /** Queued and running tasks. */
     int task_count;
-    int running_count;
+    /** Workers not running a task, a push starts a new one when it is 0. */
     int idle_count;
+    /** Workers going to sleep or sleeping, and not claimed by a waker. */
+    int sleeping;
     pthread_mutex_t mutex;
+    /** Sleep without futex, on the other systems. */
     pthread_cond_t cond;
     bool shutdown;
 };
 
-static void *worker_thread(void *arg)
+/** Worker of the current thread, NULL in the other threads. */
+static __thread struct worker *current_worker = NULL;
+
+static struct task_ring *task_ring_new(long capacity, struct task_ring *prev)
 {
-    struct thread_pool *pool = arg;
-    
+    struct task_ring *r = malloc(sizeof(*r) + capacity * sizeof(r->tasks[0]));
+    if (!r) return NULL;
+    r->capacity = capacity;
+    r->prev = prev;
+    return r;
+}
+
+static int task_deque_create(struct task_deque *d)
+{
+    d->top = d->bottom = 0;
+    d->ring = task_ring_new(DEQUE_MIN_CAPACITY, NULL);
+    return d->ring ? 0 : -1;
+}
+
+static void task_deque_destroy(struct task_deque *d)
+{
+    struct task_ring *r = d->ring;
+    while (r) {
+        struct task_ring *prev = r->prev;
+        free(r);
+        r = prev;
+    }
+}
+
+/** Push at the bottom, only the owner does it. Fails if the ring can't grow. */
+static int task_deque_push(struct task_deque *d, struct thread_task *task)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    struct task_ring *r = __atomic_load_n(&d->ring, __ATOMIC_RELAXED);
+    if (b - t >= r->capacity) {
+        struct task_ring *bigger = task_ring_new(r->capacity * 2, r);
+        if (!bigger) return -1;
+        for (long i = t; i < b; i++)
+            bigger->tasks[i & (bigger->capacity - 1)] =
+                __atomic_load_n(&r->tasks[i & (r->capacity - 1)], __ATOMIC_RELAXED);
+        __atomic_store_n(&d->ring, bigger, __ATOMIC_RELEASE);
+        r = bigger;
+    }
+    __atomic_store_n(&r->tasks[b & (r->capacity - 1)], task, __ATOMIC_RELAXED);
+    /* Sequential, so a worker going to sleep sees it or is seen asleep. */
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+/** Take the last pushed task, only the owner does it. */
+static struct thread_task *task_deque_take(struct task_deque *d)
+{
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    struct task_ring *r = __atomic_load_n(&d->ring, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    struct thread_task *task = __atomic_load_n(&r->tasks[b & (r->capacity - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        /* The last task, a thief can be taking it right now. */
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST,
+                                         __ATOMIC_RELAXED))
+            task = NULL;
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+/** Take the oldest task of another worker. NULL if empty or lost a race. */
+static struct thread_task *task_deque_steal(struct task_deque *d)
+{
+    long t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+    if (t >= b) return NULL;
+    struct task_ring *r = __atomic_load_n(&d->ring, __ATOMIC_ACQUIRE);
+    struct thread_task *task = __atomic_load_n(&r->tasks[t & (r->capacity - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED))
+        return NULL;
+    return task;
+}
+
+static bool task_deque_is_empty(struct task_deque *d)
+{
+    return __atomic_load_n(&d->top, __ATOMIC_SEQ_CST) >=
+           __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+}
+
+static void task_queue_create(struct task_queue *q)
+{
+    q->stub.next = NULL;
+    q->head = q->tail = &q->stub;
+    q->is_consumed = false;
+}
+
+/** Any thread can push. */
+static void task_queue_push(struct task_queue *q, struct thread_task *task)
+{
+    __atomic_store_n(&task->next, NULL, __ATOMIC_RELAXED);
+    struct thread_task *prev = __atomic_exchange_n(&q->tail, task, __ATOMIC_ACQ_REL);
+    /* Till this store the task is in the queue, but the consumer can't reach it. */
+    __atomic_store_n(&prev->next, task, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pop the first task, only the consumer does it. NULL when the queue is
+ * empty or the first task is still being linked by its pusher.
+ */
+static struct thread_task *task_queue_pop(struct task_queue *q)
+{
+    struct thread_task *head = q->head;
+    struct thread_task *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (head == &q->stub) {
+        if (!next) return NULL;
+        q->head = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) {
+        q->head = next;
+        return head;
+    }
+    if (__atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) != head) return NULL;
+    /* The last task can leave only with something behind it. */
+    task_queue_push(q, &q->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (!next) return NULL;
+    q->head = next;
+    return head;
+}
+
+#ifdef __linux__
+
+/** Sleep while the worker's word is still 1. Can return spuriously. */
+static void worker_wait(struct worker *w)
+{
+    syscall(SYS_futex, &w->asleep, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void worker_wake(struct worker *w)
+{
+    syscall(SYS_futex, &w->asleep, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#else
+
+static void worker_wait(struct worker *w)
+{
+    struct thread_pool *pool = w->pool;
     pthread_mutex_lock(&pool->mutex);
-    pool->idle_count++;
-    while (!pool->shutdown) {
-        while (pool->head == NULL && !pool->shutdown) {
-            pthread_cond_wait(&pool->cond, &pool->mutex);
-        }
-        if (pool->shutdown) break;
-
-        struct thread_task *task = pool->head;
-        pool->head = task->next;
-        if (!pool->head) pool->tail = NULL;
-        pool->task_count--;
-        pool->running_count++;
-        pool->idle_count--;
+    if (__atomic_load_n(&w->asleep, __ATOMIC_SEQ_CST) == 1)
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void worker_wake(struct worker *w)
+{
+    struct thread_pool *pool = w->pool;
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+#endif
+
+/** Claim a sleeping worker and wake it. False if it is already awake. */
+static bool worker_claim(struct worker *w)
+{
+    int one = 1;
+    if (!__atomic_compare_exchange_n(&w->asleep, &one, 0, false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED))
+        return false;
+    __atomic_sub_fetch(&w->pool->sleeping, 1, __ATOMIC_SEQ_CST);
+    worker_wake(w);
+    return true;
+}
+
+/** Wake one sleeping worker if there is any. Called after a task is queued. */
+static void pool_notify(struct thread_pool *pool)
+{
+    if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) == 0) return;
+    int count = __atomic_load_n(&pool->thread_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (worker_claim(&pool->workers[i])) return;
+    }
+}
+
+static bool pool_has_work(struct thread_pool *pool)
+{
+    if (__atomic_load_n(&pool->injected, __ATOMIC_SEQ_CST) > 0) return true;
+    int count = __atomic_load_n(&pool->thread_count, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < count; i++) {
+        if (!task_deque_is_empty(&pool->workers[i].deque)) return true;
+    }
+    return false;
+}
+
+static void *worker_thread(void *arg);
+
+/**
+ * Start one more worker if all of them are busy. The check is repeated
+ * under the mutex, so only the first of the racing pushers starts it.
+ */
+static void pool_grow(struct thread_pool *pool)
+{
+    if (__atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED) >= pool->max_threads ||
+        __atomic_load_n(&pool->idle_count, __ATOMIC_RELAXED) > 0)
+        return;
+    pthread_mutex_lock(&pool->mutex);
+    int n = pool->thread_count;
+    if (n >= pool->max_threads || __atomic_load_n(&pool->idle_count, __ATOMIC_RELAXED) > 0 ||
+        pool->shutdown) {
         pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+    struct worker *w = &pool->workers[n];
+    w->pool = pool;
+    w->seed = n + 1;
+    w->asleep = 0;
+    if (task_deque_create(&w->deque) != 0) {
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+    /* Idle from now on, so the next pushes don't start one more. */
+    __atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&w->thread, NULL, worker_thread, w) != 0) {
+        __atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+        task_deque_destroy(&w->deque);
+        pthread_mutex_unlock(&pool->mutex);
+        return;
+    }
+    __atomic_store_n(&pool->thread_count, n + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/**
+ * Take the first task of the injector and move a share of the rest into the
+ * own deque, where the other workers can steal them. If another worker is
+ * taking from the injector now, this one doesn't wait for it.
+ */
+static struct thread_task *worker_take_injected(struct worker *w)
+{
+    struct thread_pool *pool = w->pool;
+    struct task_queue *q = &pool->injector;
+    if (__atomic_load_n(&pool->injected, __ATOMIC_RELAXED) <= 0 ||
+        __atomic_exchange_n(&q->is_consumed, true, __ATOMIC_ACQUIRE))
+        return NULL;
+    struct thread_task *task = task_queue_pop(q);
+    if (task) {
+        /* A just started worker can be not counted yet. */
+        int count = __atomic_load_n(&pool->thread_count, __ATOMIC_RELAXED);
+        int batch = __atomic_load_n(&pool->injected, __ATOMIC_RELAXED) / (count > 0 ? count : 1);
+        if (batch > INJECTOR_BATCH) batch = INJECTOR_BATCH;
+        int moved = 0;
+        struct thread_task *t;
+        while (moved < batch && (t = task_queue_pop(q)) != NULL) {
+            if (task_deque_push(&w->deque, t) != 0) {
+                /* Can't grow the deque, leave it to the others. */
+                task_queue_push(q, t);
+                break;
+            }
+            moved++;
+        }
+        __atomic_sub_fetch(&pool->injected, 1 + moved, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&q->is_consumed, false, __ATOMIC_RELEASE);
+    return task;
+}
+
+static struct thread_task *worker_steal(struct worker *w)
+{
+    struct thread_pool *pool = w->pool;
+    int count = __atomic_load_n(&pool->thread_count, __ATOMIC_ACQUIRE);
+    if (count < 2) return NULL;
+    w->seed = w->seed * 1103515245 + 12345;
+    int start = (w->seed >> 16) % count;
+    for (int i = 0; i < count; i++) {
+        struct worker *victim = &pool->workers[(start + i) % count];
+        if (victim == w) continue;
+        struct thread_task *task = task_deque_steal(&victim->deque);
+        if (task) return task;
+    }
+    return NULL;
+}
+
+static struct thread_task *worker_find_task(struct worker *w)
+{
+    struct thread_task *task = task_deque_take(&w->deque);
+    if (!task) task = worker_take_injected(w);
+    if (!task) task = worker_steal(w);
+    return task;
+}
+
+/**
+ * Sleep until there is some work. False when the pool is deleted. Either
+ * a pusher sees the worker in sleeping, or the worker sees the task.
+ */
+static bool worker_park(struct worker *w)
+{
+    struct thread_pool *pool = w->pool;
+    __atomic_store_n(&w->asleep, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST) && !pool_has_work(pool)) {
+        while (__atomic_load_n(&w->asleep, __ATOMIC_SEQ_CST) == 1 &&
+               !__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST))
+            worker_wait(w);
+    } else {
+        /*
+         * The work can be a task still being linked into the injector or
+         * taken by another worker, let them finish.
+         */
+        sched_yield();
+    }
+    /* Not claimed by anybody, so still counted. */
+    int one = 1;
+    if (__atomic_compare_exchange_n(&w->asleep, &one, 0, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_RELAXED))
+        __atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+    return !__atomic_load_n(&pool->shutdown, __ATOMIC_SEQ_CST);
+}
+
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct thread_pool *pool = w->pool;
+    current_worker = w;
+    while (true) {
+        struct thread_task *task = worker_find_task(w);
+        if (!task) {
+            if (!worker_park(w)) break;
+            continue;
+        }
+        __atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
 
         void *res = task->function(task->arg);
 
-        pthread_mutex_lock(&pool->mutex);
-        pool->running_count--;
-        pthread_cond_signal(&pool->cond);
-        pool->idle_count++;
-        pthread_mutex_unlock(&pool->mutex);
+        __atomic_add_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELEASE);
 
         pthread_mutex_lock(&task->task_mutex);
         task->result = res;
@@ -81,12 +472,8 @@ static void *worker_thread(void *arg)
             pthread_cond_destroy(&task->task_cond);
             free(task);
         }
-
-        pthread_mutex_lock(&pool->mutex);
     }
-    
-    pool->idle_count--;
-    pthread_mutex_unlock(&pool->mutex);
+    __atomic_sub_fetch(&pool->idle_count, 1, __ATOMIC_RELAXED);
     return NULL;
 }
 
@@ -97,13 +484,13 @@ int thread_pool_new(int max_thread_count, struct thread_pool **pool)
 
     struct thread_pool *p = malloc(sizeof(*p));
     if (!p) return TPOOL_ERR_SYSTEM;
-    p->threads = calloc(max_thread_count, sizeof(pthread_t));
-    if (!p->threads) { free(p); return TPOOL_ERR_SYSTEM; }
+    p->workers = calloc(max_thread_count, sizeof(struct worker));
+    if (!p->workers) { free(p); return TPOOL_ERR_SYSTEM; }
 
     p->max_threads = max_thread_count;
     p->thread_count = 0;
-    p->head = p->tail = NULL;
-    p->task_count = p->running_count = p->idle_count = 0;
+    task_queue_create(&p->injector);
+    p->injected = p->task_count = p->idle_count = p->sleeping = 0;
     p->shutdown = false;
     pthread_mutex_init(&p->mutex, NULL);
     pthread_cond_init(&p->cond, NULL);
@@ -114,36 +501,43 @@ int thread_pool_new(int max_thread_count, struct thread_pool **pool)
 int thread_pool_thread_count(const struct thread_pool *pool)
 {
     if (!pool) return 0;
-    pthread_mutex_lock((pthread_mutex_t*)&pool->mutex);
-    int c = pool->thread_count;
-    pthread_mutex_unlock((pthread_mutex_t*)&pool->mutex);
-    return c;
+    return __atomic_load_n(&pool->thread_count, __ATOMIC_ACQUIRE);
 }
 
-int thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+/**
+ * No lock, until it is queued the task belongs to the pusher, and the queue
+ * publishes these fields to the worker.
+ */
+static void task_set_pushed(struct thread_task *task, struct thread_pool *pool)
 {
-    if (!pool || !task) return TPOOL_ERR_INVALID_ARGUMENT;
-    pthread_mutex_lock(&pool->mutex);
-    if (pool->shutdown) { pthread_mutex_unlock(&pool->mutex); return TPOOL_ERR_INVALID_ARGUMENT; }
-    if (pool->task_count + pool->running_count >= TPOOL_MAX_TASKS) { pthread_mutex_unlock(&pool->mutex); return TPOOL_ERR_TOO_MANY_TASKS; }
-
-    task->next = NULL; task->pool = pool;
-    if (pool->tail) pool->tail->next = task; else pool->head = task;
-    pool->tail = task;
-    pool->task_count++;
-
-    pthread_mutex_lock(&task->task_mutex);
+    task->pool = pool;
     task->pushed = true;
     task->state = TASK_QUEUED;
     task->detached = false;
-    pthread_mutex_unlock(&task->task_mutex);
+}
 
-    if (pool->thread_count < pool->max_threads && pool->idle_count == 0) {
-        pthread_create(&pool->threads[pool->thread_count++], NULL, worker_thread, pool);
+/**
+ * Nothing here takes a lock. The mutex is taken only to start a new worker,
+ * which happens at most max_threads times in the pool's life.
+ */
+int thread_pool_push_task(struct thread_pool *pool, struct thread_task *task)
+{
+    if (!pool || !task) return TPOOL_ERR_INVALID_ARGUMENT;
+    if (__atomic_add_fetch(&pool->task_count, 1, __ATOMIC_RELAXED) > TPOOL_MAX_TASKS) {
+        __atomic_sub_fetch(&pool->task_count, 1, __ATOMIC_RELAXED);
+        return TPOOL_ERR_TOO_MANY_TASKS;
     }
+    task_set_pushed(task, pool);
 
-    pthread_cond_signal(&pool->cond);
-    pthread_mutex_unlock(&pool->mutex);
+    struct worker *w = current_worker;
+    /* The pool can't be deleted while its own worker runs a task. */
+    if (!w || w->pool != pool || task_deque_push(&w->deque, task) != 0) {
+        /* Counted first, so the workers don't sleep while it is linked. */
+        __atomic_add_fetch(&pool->injected, 1, __ATOMIC_SEQ_CST);
+        task_queue_push(&pool->injector, task);
+    }
+    pool_grow(pool);
+    pool_notify(pool);
     return 0;
 }
 
@@ -151,21 +545,22 @@ int thread_pool_delete(struct thread_pool *pool)
 {
     if (!pool) return TPOOL_ERR_INVALID_ARGUMENT;
     pthread_mutex_lock(&pool->mutex);
-    if (pool->task_count > 0 || pool->running_count > 0) {
+    if (__atomic_load_n(&pool->task_count, __ATOMIC_ACQUIRE) > 0) {
         pthread_mutex_unlock(&pool->mutex);
         return TPOOL_ERR_HAS_TASKS;
     }
-    pool->shutdown = true;
-    pthread_cond_broadcast(&pool->cond);
+    __atomic_store_n(&pool->shutdown, true, __ATOMIC_SEQ_CST);
     pthread_mutex_unlock(&pool->mutex);
 
     for (int i = 0; i < pool->thread_count; i++) {
-        pthread_join(pool->threads[i], NULL);
+        worker_claim(&pool->workers[i]);
+        pthread_join(pool->workers[i].thread, NULL);
+        task_deque_destroy(&pool->workers[i].deque);
     }
 
     pthread_mutex_destroy(&pool->mutex);
     pthread_cond_destroy(&pool->cond);
-    free(pool->threads);
+    free(pool->workers);
     free(pool);
     return 0;
 }
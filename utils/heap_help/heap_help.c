@@ -688,3 +688,12 @@ heaph_get_alloc_count(void)
 	spinlock_rel(&allocs_lock);
 	return res;
 }
+
+uint64_t
+heaph_get_alloc_count_total(void)
+{
+	spinlock_acq(&allocs_lock);
+	uint64_t res = alloc_count_total;
+	spinlock_rel(&allocs_lock);
+	return res;
+}